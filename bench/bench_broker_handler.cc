@@ -0,0 +1,165 @@
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "broker/broker_handler.h"
+#include "broker/message_queue.h"
+#include "proto_types.h"
+
+namespace pork {
+
+    class NullMessageQueue: public AbstractMessageQueue {
+        public:
+            bool pop_free_message(Message& msg,
+                    const std::string& consumer_id) override { return false; }
+            bool try_pop_free_message(Message& msg,
+                    const std::string& consumer_id) override { return false; }
+            void push_message(
+                    Message&& msg,
+                    const std::vector<Dependency>& deps) override {}
+            void push_message_group(
+                    std::vector<Message>&& msgs,
+                    const std::vector<Dependency>& deps) override {}
+            void push_message_copies(
+                    const Message& msg,
+                    const SharedPayloadPtr& payload,
+                    const std::vector<id_t>& ids,
+                    const std::vector<Dependency>& deps,
+                    bool reserved) override {}
+            void reserve_copies(
+                    const Message& msg,
+                    const SharedPayloadPtr& payload,
+                    size_t n_copies,
+                    const std::vector<Dependency>& deps) override {}
+            void cancel_copies(
+                    const Message& msg,
+                    const SharedPayloadPtr& payload,
+                    size_t n_copies,
+                    const std::vector<Dependency>& deps) override {}
+            void ack(id_t msg_id) override {}
+            void fail(id_t msg_id) override {}
+            void requeue(id_t msg_id) override {}
+            void remove_consumer(const std::string& consumer_id) override {}
+            void drop_consumer(const std::string& consumer_id) override {}
+            void configure(const QueueOptions& options) override {}
+            void get_stats(QueueStats& stats) override {}
+            void expire_messages() override {}
+    };
+
+    // every call on the handler goes through ensure_queue, the message
+    // queue itself does nothing
+    class BenchBrokerHandler: public BrokerHandler {
+        public:
+            BenchBrokerHandler(): BrokerHandler() {}
+
+        protected:
+            std::shared_ptr<AbstractMessageQueue> create_mq() override {
+                return std::make_shared<NullMessageQueue>();
+            }
+    };
+
+    static std::unique_ptr<BenchBrokerHandler> handler;
+    static std::vector<std::string> queue_names;
+
+    static void BM_HandlerEnsureQueue(benchmark::State& state)
+    {
+        int n_queues = state.range(0);
+        if (state.thread_index() == 0) {
+            handler.reset(new BenchBrokerHandler());
+            queue_names.clear();
+            for (int i = 0; i < n_queues; ++i) {
+                queue_names.push_back("queue" + std::to_string(i));
+                handler->ack(queue_names.back(), 0);
+            }
+        }
+        // a cheap per-thread pseudo-random walk over the queues
+        size_t idx = state.thread_index() * 7919;
+        for (auto _ : state) {
+            idx = (idx * 1103515245 + 12345) % n_queues;
+            handler->ack(queue_names[idx], 0);
+        }
+        state.SetItemsProcessed(state.iterations());
+        if (state.thread_index() == 0) {
+            handler.reset();
+        }
+    }
+    BENCHMARK(BM_HandlerEnsureQueue)
+        ->RangeMultiplier(10)->Range(1, 10000)
+        ->ThreadRange(1, 64)->UseRealTime();
+
+    // first use of a queue name, which takes the exclusive lock
+    static void BM_HandlerCreateQueue(benchmark::State& state)
+    {
+        std::unique_ptr<BenchBrokerHandler> h(new BenchBrokerHandler());
+        int i = 0;
+        for (auto _ : state) {
+            state.PauseTiming();
+            std::string name = "queue" + std::to_string(i++);
+            state.ResumeTiming();
+            h->ack(name, 0);
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+    BENCHMARK(BM_HandlerCreateQueue);
+
+    // a fetch over range(0) queues, only one of which has a message
+    static void BM_HandlerFetchAny(benchmark::State& state)
+    {
+        int n_queues = state.range(0);
+        BrokerHandler h(1);
+        std::vector<Subscription> subs(n_queues);
+        for (int i = 0; i < n_queues; ++i) {
+            subs[i].queue_name = "queue" + std::to_string(i);
+            subs[i].weight = 1 + i % 3;
+        }
+        Message msg;
+        msg.type = MessageType::NORMAL;
+        msg.payload = "msg";
+        int i = 0;
+        for (auto _ : state) {
+            h.addMessage(subs[i++ % n_queues].queue_name, msg, {});
+            Message recv;
+            h.ackAndGetAnyMessage(recv, subs, {}, "");
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+    BENCHMARK(BM_HandlerFetchAny)->RangeMultiplier(4)->Range(1, 256);
+
+    // range(0) copies of a 4KB message, added as a group if range(1) is 0,
+    // published with the payload shared otherwise, then fetched and acked
+    static void BM_HandlerFanOut(benchmark::State& state)
+    {
+        int n_copies = state.range(0);
+        bool shared = state.range(1);
+        BrokerHandler h(1);
+        Message msg;
+        msg.type = MessageType::NORMAL;
+        msg.payload.assign(4096, 'p');
+        std::vector<Message> group(n_copies, msg);
+        auto add = [&] (std::vector<id_t>& ids) {
+            if (shared) {
+                h.publish(ids, {"q"}, msg, n_copies, {});
+            } else {
+                h.addMessageGroup(ids, "q", group, {});
+            }
+        };
+        std::vector<id_t> ids;
+        Message recv;
+        add(ids);
+        QueueStats stats;
+        h.getQueueStats(stats, "q");
+        state.counters["held_bytes"] = stats.message_bytes;
+        for (auto _ : state) {
+            for (size_t i = 0; i < ids.size(); ++i) {
+                h.ackAndGetMessage(recv, "q", {}, "");
+                h.ack("q", recv.id);
+            }
+            add(ids);
+        }
+        state.SetItemsProcessed(state.iterations() * n_copies);
+    }
+    BENCHMARK(BM_HandlerFanOut)->ArgsProduct({{1, 4, 16, 64}, {0, 1}});
+
+} /* pork */
@@ -0,0 +1,258 @@
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "broker/message_queue.h"
+#include "proto_types.h"
+
+namespace pork {
+
+    static Message make_msg(id_t id, const std::string& resolve_dep = "")
+    {
+        Message msg;
+        msg.__set_id(id);
+        msg.payload = "msg" + std::to_string(id);
+        msg.type = MessageType::NORMAL;
+        if (!resolve_dep.empty()) {
+            msg.__set_resolve_dep(resolve_dep);
+        }
+        return msg;
+    }
+
+    static Dependency make_dep(const std::string& key, int n)
+    {
+        Dependency dep;
+        dep.key = key;
+        dep.n = n;
+        return dep;
+    }
+
+    static std::unique_ptr<MessageQueue> shared_mq;
+    static std::atomic<id_t> next_id(0);
+
+    // every thread pushes before it pops, so pop_free_message never waits
+    static void BM_MqPushPopAck(benchmark::State& state)
+    {
+        if (state.thread_index() == 0) {
+            shared_mq.reset(new MessageQueue());
+        }
+        for (auto _ : state) {
+            shared_mq->push_message(make_msg(next_id++), {});
+            Message recv;
+            shared_mq->pop_free_message(recv);
+            shared_mq->ack(recv.id);
+        }
+        state.SetItemsProcessed(state.iterations());
+        if (state.thread_index() == 0) {
+            shared_mq.reset();
+        }
+    }
+    BENCHMARK(BM_MqPushPopAck)->ThreadRange(1, 64)->UseRealTime();
+
+    static void BM_MqPushFree(benchmark::State& state)
+    {
+        if (state.thread_index() == 0) {
+            shared_mq.reset(new MessageQueue());
+        }
+        for (auto _ : state) {
+            shared_mq->push_message(make_msg(next_id++), {});
+        }
+        state.SetItemsProcessed(state.iterations());
+        if (state.thread_index() == 0) {
+            shared_mq.reset();
+        }
+    }
+    BENCHMARK(BM_MqPushFree)->ThreadRange(1, 64)->UseRealTime();
+
+    // a keyed message goes to the ready queue of its owner among range(0)
+    // consumers, found by hashing the key against each of them
+    static void BM_MqPushPartitioned(benchmark::State& state)
+    {
+        std::unique_ptr<MessageQueue> mq(new MessageQueue());
+        id_t id = 0;
+        for (int i = 0; i < state.range(0); ++i) {
+            mq->push_message(make_msg(id++), {});
+            Message recv;
+            mq->pop_free_message(recv, "consumer" + std::to_string(i));
+        }
+        for (auto _ : state) {
+            auto msg = make_msg(id);
+            msg.__set_partition_key("key" + std::to_string(id++ % 1024));
+            mq->push_message(std::move(msg), {});
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+    BENCHMARK(BM_MqPushPartitioned)->RangeMultiplier(4)->Range(1, 64);
+
+    // an ordered queue with range(0) keys, each with a message out and one
+    // waiting behind it. every ack lets the next message of a key out
+    static void BM_MqOrderedPushPopAck(benchmark::State& state)
+    {
+        int n_keys = state.range(0);
+        std::unique_ptr<MessageQueue> mq(new MessageQueue());
+        QueueOptions options;
+        options.ordered = true;
+        mq->configure(options);
+        std::vector<std::string> keys;
+        for (int i = 0; i < n_keys; ++i) {
+            keys.push_back("key" + std::to_string(i));
+        }
+        id_t id = 0;
+        for (int i = 0; i < n_keys; ++i) {
+            auto msg = make_msg(id++);
+            msg.__set_partition_key(keys[i]);
+            mq->push_message(std::move(msg), {});
+        }
+        for (auto _ : state) {
+            auto msg = make_msg(id);
+            msg.__set_partition_key(keys[id++ % n_keys]);
+            mq->push_message(std::move(msg), {});
+            Message recv;
+            mq->pop_free_message(recv);
+            mq->ack(recv.id);
+        }
+        state.SetItemsProcessed(state.iterations());
+        QueueStats stats;
+        mq->get_stats(stats);
+        state.counters["lanes"] = stats.n_lanes;
+    }
+    BENCHMARK(BM_MqOrderedPushPopAck)->RangeMultiplier(10)->Range(10, 1000000);
+
+    // pushes range(0) dependants on a single key and then acks the resolving
+    // messages one by one. with `staggered` the i-th dependant waits for i + 1
+    // resolutions, so every ack frees exactly one message; otherwise all of
+    // them are freed by the last ack
+    static void resolve_dependants(benchmark::State& state, bool staggered)
+    {
+        int n = state.range(0);
+        for (auto _ : state) {
+            state.PauseTiming();
+            std::unique_ptr<MessageQueue> mq(new MessageQueue());
+            id_t id = 0;
+            for (int i = 0; i < n; ++i) {
+                mq->push_message(make_msg(id++), {make_dep("key", staggered ? i + 1 : n)});
+            }
+            std::vector<id_t> resolvers;
+            for (int i = 0; i < n; ++i) {
+                mq->push_message(make_msg(id++, "key"), {});
+                Message recv;
+                mq->pop_free_message(recv);
+                resolvers.push_back(recv.id);
+            }
+            state.ResumeTiming();
+
+            for (auto r : resolvers) {
+                mq->ack(r);
+            }
+
+            state.PauseTiming();
+            mq.reset();
+            state.ResumeTiming();
+        }
+        state.SetItemsProcessed(state.iterations() * n);
+    }
+
+    static void BM_MqResolveStaggered(benchmark::State& state)
+    {
+        resolve_dependants(state, true);
+    }
+    BENCHMARK(BM_MqResolveStaggered)->RangeMultiplier(4)->Range(1 << 8, 1 << 14)
+        ->Unit(benchmark::kMillisecond);
+
+    static void BM_MqResolveAtOnce(benchmark::State& state)
+    {
+        resolve_dependants(state, false);
+    }
+    BENCHMARK(BM_MqResolveAtOnce)->RangeMultiplier(4)->Range(1 << 8, 1 << 14)
+        ->Unit(benchmark::kMillisecond);
+
+    // pushes dependants with many keys each, as a join over range(0) inputs
+    static void BM_MqPushManyDeps(benchmark::State& state)
+    {
+        int n_deps = state.range(0);
+        std::vector<Dependency> deps;
+        for (int i = 0; i < n_deps; ++i) {
+            deps.push_back(make_dep("key" + std::to_string(i), 1));
+        }
+        std::unique_ptr<MessageQueue> mq(new MessageQueue());
+        id_t id = 0;
+        for (auto _ : state) {
+            mq->push_message(make_msg(id++), deps);
+        }
+        state.SetItemsProcessed(state.iterations());
+    }
+    BENCHMARK(BM_MqPushManyDeps)->RangeMultiplier(4)->Range(1, 256);
+
+    // a DAG run by N_WORKERS workers in lockstep, each taking a message and
+    // acking it in every step: N_CHAINS chains of CHAIN_LENGTH messages, each
+    // waiting for the previous one, N_HUBS messages with HUB_FAN_OUT dependants
+    // each, and the filler messages nothing waits for, pushed first. the
+    // makespan is the number of steps until all are done, at least
+    // max(CHAIN_LENGTH, n_messages / N_WORKERS)
+    static void BM_MqDagMakespan(benchmark::State& state)
+    {
+        const int N_WORKERS = 16;
+        const int N_CHAINS = 4;
+        const int CHAIN_LENGTH = 64;
+        const int N_HUBS = 2;
+        const int HUB_FAN_OUT = 32;
+        const int N_FILLERS = N_WORKERS * CHAIN_LENGTH;
+        const int N_MSGS = N_FILLERS + N_CHAINS * CHAIN_LENGTH + N_HUBS * (1 + HUB_FAN_OUT);
+        int64_t makespan = 0;
+        for (auto _ : state) {
+            std::unique_ptr<MessageQueue> mq(new MessageQueue());
+            QueueOptions options;
+            options.critical_path = state.range(0) != 0;
+            mq->configure(options);
+            id_t id = 0;
+            for (int i = 0; i < N_FILLERS; ++i) {
+                mq->push_message(make_msg(id++), {});
+            }
+            for (int c = 0; c < N_CHAINS; ++c) {
+                std::string prev;
+                for (int i = 0; i < CHAIN_LENGTH; ++i) {
+                    std::string key = "chain" + std::to_string(c) + "." + std::to_string(i);
+                    if (prev.empty()) {
+                        mq->push_message(make_msg(id++, key), {});
+                    } else {
+                        mq->push_message(make_msg(id++, key), {make_dep(prev, 1)});
+                    }
+                    prev = key;
+                }
+            }
+            for (int h = 0; h < N_HUBS; ++h) {
+                std::string key = "hub" + std::to_string(h);
+                mq->push_message(make_msg(id++, key), {});
+                for (int i = 0; i < HUB_FAN_OUT; ++i) {
+                    mq->push_message(make_msg(id++), {make_dep(key, 1)});
+                }
+            }
+
+            int n_done = 0;
+            makespan = 0;
+            std::vector<id_t> taken;
+            while (n_done < N_MSGS) {
+                taken.clear();
+                Message recv;
+                while (taken.size() < size_t(N_WORKERS) && mq->try_pop_free_message(recv)) {
+                    taken.push_back(recv.id);
+                }
+                for (id_t msg_id : taken) {
+                    mq->ack(msg_id);
+                }
+                n_done += taken.size();
+                ++makespan;
+            }
+        }
+        state.SetItemsProcessed(state.iterations() * N_MSGS);
+        state.counters["makespan"] = makespan;
+        state.counters["lower_bound"] = std::max(CHAIN_LENGTH,
+                (N_MSGS + N_WORKERS - 1) / N_WORKERS);
+    }
+    BENCHMARK(BM_MqDagMakespan)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+} /* pork */
@@ -0,0 +1,98 @@
+#include <string>
+
+#include <benchmark/benchmark.h>
+
+#include "broker/message_queue.h"
+#include "compression.h"
+#include "proto_types.h"
+
+namespace pork {
+
+    // records shaped like what the workers usually emit
+    static std::string make_payload(size_t size)
+    {
+        static const char* names[] = {"alpha", "beta", "gamma", "delta", "epsilon"};
+        std::string payload = "[";
+        for (int i = 0; payload.size() < size; ++i) {
+            payload += "{\"id\": " + std::to_string(i * 7919 % 100003)
+                + ", \"name\": \"" + names[i % 5]
+                + "\", \"score\": " + std::to_string(i * 31 % 997) + "." + std::to_string(i % 10)
+                + ", \"tags\": [\"" + names[i * 3 % 5] + "\", \"" + names[i * 7 % 5] + "\"]},";
+        }
+        payload.back() = ']';
+        return payload;
+    }
+
+    static void BM_Compress(benchmark::State& state)
+    {
+        auto codec = static_cast<Compression::type>(state.range(0));
+        if (!compression_supported(codec)) {
+            state.SkipWithError("codec not built in");
+            return;
+        }
+        Message msg;
+        msg.payload = make_payload(state.range(1));
+        size_t n_compressed = 0;
+        for (auto _ : state) {
+            Message copy(msg);
+            compress_payload(copy, codec);
+            n_compressed = copy.payload.size();
+        }
+        state.SetBytesProcessed(state.iterations() * msg.payload.size());
+        state.counters["ratio"] = double(msg.payload.size()) / n_compressed;
+    }
+    BENCHMARK(BM_Compress)
+        ->ArgsProduct({{Compression::LZ4, Compression::ZSTD}, {1 << 10, 16 << 10, 256 << 10}});
+
+    static void BM_Decompress(benchmark::State& state)
+    {
+        auto codec = static_cast<Compression::type>(state.range(0));
+        if (!compression_supported(codec)) {
+            state.SkipWithError("codec not built in");
+            return;
+        }
+        Message msg;
+        msg.payload = make_payload(state.range(1));
+        size_t n_bytes = msg.payload.size();
+        compress_payload(msg, codec);
+        for (auto _ : state) {
+            Message copy(msg);
+            decompress_payload(copy);
+            benchmark::DoNotOptimize(copy.payload.data());
+        }
+        state.SetBytesProcessed(state.iterations() * n_bytes);
+    }
+    BENCHMARK(BM_Decompress)
+        ->ArgsProduct({{Compression::LZ4, Compression::ZSTD}, {1 << 10, 16 << 10, 256 << 10}});
+
+    // what the broker holds for the same messages, with and without
+    // compression
+    static void BM_QueueMemory(benchmark::State& state)
+    {
+        auto codec = static_cast<Compression::type>(state.range(0));
+        if (!compression_supported(codec)) {
+            state.SkipWithError("codec not built in");
+            return;
+        }
+        const int n_msgs = 1000;
+        Message msg;
+        msg.type = MessageType::NORMAL;
+        msg.payload = make_payload(state.range(1));
+        compress_payload(msg, codec);
+        QueueStats stats;
+        for (auto _ : state) {
+            MessageQueue mq;
+            for (int i = 0; i < n_msgs; ++i) {
+                Message copy(msg);
+                copy.__set_id(i);
+                mq.push_message(std::move(copy), {});
+            }
+            mq.get_stats(stats);
+        }
+        state.SetItemsProcessed(state.iterations() * n_msgs);
+        state.counters["message_bytes"] = stats.message_bytes;
+    }
+    BENCHMARK(BM_QueueMemory)
+        ->ArgsProduct({{Compression::NONE, Compression::LZ4, Compression::ZSTD}, {16 << 10}});
+
+} /* pork */
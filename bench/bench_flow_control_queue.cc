@@ -0,0 +1,83 @@
+#include <memory>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "flow_control_queue.h"
+
+using namespace pork;
+
+static void BM_FcqPutPop(benchmark::State& state)
+{
+    FlowControlQueue<int> q(3, 5);
+    int i = 0;
+    for (auto _ : state) {
+        q.put(i++);
+        benchmark::DoNotOptimize(q.pop());
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FcqPutPop);
+
+// range(0) puts, then one pop_batch for them all
+static void BM_FcqPutPopBatch(benchmark::State& state)
+{
+    size_t batch_size = state.range(0);
+    FlowControlQueue<int> q(batch_size, batch_size + 2);
+    std::vector<int> batch;
+    int i = 0;
+    for (auto _ : state) {
+        for (size_t j = 0; j < batch_size; ++j) {
+            q.put(i++);
+        }
+        q.pop_batch(batch, batch_size);
+        benchmark::DoNotOptimize(batch.data());
+    }
+    state.SetItemsProcessed(state.iterations() * batch_size);
+}
+BENCHMARK(BM_FcqPutPopBatch)->RangeMultiplier(4)->Range(1, 256);
+
+static std::unique_ptr<FlowControlQueue<int>> ping_q;
+static std::unique_ptr<FlowControlQueue<int>> pong_q;
+
+// thread 0 sends a ping and waits for the pong thread 1 sends back
+static void BM_FcqPingPong(benchmark::State& state)
+{
+    if (state.thread_index() == 0) {
+        ping_q.reset(new FlowControlQueue<int>(3, 5));
+        pong_q.reset(new FlowControlQueue<int>(3, 5));
+    }
+    int i = 0;
+    for (auto _ : state) {
+        if (state.thread_index() == 0) {
+            ping_q->put(i++);
+            benchmark::DoNotOptimize(pong_q->pop());
+        } else {
+            pong_q->put(ping_q->pop());
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FcqPingPong)->Threads(2)->UseRealTime();
+
+static std::unique_ptr<FlowControlQueue<int>> buffer_q;
+
+// the pattern BaseWorker uses: thread 0 fetches whenever the buffer is low,
+// thread 1 processes
+static void BM_FcqWorkerBuffer(benchmark::State& state)
+{
+    if (state.thread_index() == 0) {
+        buffer_q.reset(new FlowControlQueue<int>(3, 5));
+    }
+    int i = 0;
+    for (auto _ : state) {
+        if (state.thread_index() == 0) {
+            buffer_q->wait_till_low();
+            buffer_q->put(i++);
+        } else {
+            benchmark::DoNotOptimize(buffer_q->pop());
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FcqWorkerBuffer)->Threads(2)->UseRealTime();
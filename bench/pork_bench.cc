@@ -0,0 +1,594 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/lexical_cast.hpp>
+#include <boost/smart_ptr.hpp>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/server/TThreadedServer.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TServerSocket.h>
+#include <thrift/transport/TSocket.h>
+
+#include "Broker.h"
+#include "broker/broker_handler.h"
+#include "common.h"
+#include "proto_types.h"
+#include "shm_transport.h"
+#include "worker.h"
+
+using namespace pork;
+using namespace apache::thrift::protocol;
+using namespace apache::thrift::server;
+using namespace apache::thrift::transport;
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct BenchConfig {
+    std::string mode = "network";  // network, shm or embedded
+    std::string topology = "chain";  // chain, fanout or fanin
+    int messages = 100000;  // number of messages emitted by the source
+    int stages = 3;  // number of queues in a chain
+    int fanout = 4;
+    int fanin = 4;
+    int payload_size = 64;
+    int workers = 1;  // per stage
+    int batch = 0;  // 0 for emitting messages one by one
+    int rate = 0;  // msgs/s emitted by the source, 0 for unlimited
+    int max_queued = 0;  // per queue limit on unacked messages, 0 for unlimited
+    int io_us = 0;  // downstream I/O a relay waits for per message
+    int in_flight = 1;  // messages a relay keeps waiting for I/O at once
+    int timeout = 300;  // seconds
+    std::string broker;  // host:port of a running broker, empty to start one in-process
+    std::string shm_path;  // unix socket of the broker's shm transport
+    uint16_t port = 6784;  // port of the in-process broker
+};
+
+static void print_usage(const char* prog)
+{
+    std::fprintf(stderr,
+            "Usage: %s [--mode=network|shm|embedded] [--topology=chain|fanout|fanin]\n"
+            "          [--messages=N] [--stages=N]\n"
+            "          [--fanout=N] [--fanin=N] [--payload-size=BYTES] [--workers=N]\n"
+            "          [--batch=N] [--rate=MSGS_PER_SEC] [--max-queued=N]\n"
+            "          [--io-us=MICROSECONDS] [--in-flight=N]\n"
+            "          [--timeout=SECONDS]\n"
+            "          [--broker=HOST:PORT | --port=PORT] [--shm-path=SOCKET]\n", prog);
+}
+
+static BenchConfig parse_args(int argc, char** argv)
+{
+    BenchConfig cfg;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        size_t eq_pos = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq_pos == std::string::npos) {
+            throw std::invalid_argument(arg);
+        }
+        std::string key = arg.substr(2, eq_pos - 2);
+        std::string value = arg.substr(eq_pos + 1);
+        if (key == "mode") {
+            cfg.mode = value;
+        } else if (key == "topology") {
+            cfg.topology = value;
+        } else if (key == "messages") {
+            cfg.messages = boost::lexical_cast<int>(value);
+        } else if (key == "stages") {
+            cfg.stages = boost::lexical_cast<int>(value);
+        } else if (key == "fanout") {
+            cfg.fanout = boost::lexical_cast<int>(value);
+        } else if (key == "fanin") {
+            cfg.fanin = boost::lexical_cast<int>(value);
+        } else if (key == "payload-size") {
+            cfg.payload_size = boost::lexical_cast<int>(value);
+        } else if (key == "workers") {
+            cfg.workers = boost::lexical_cast<int>(value);
+        } else if (key == "batch") {
+            cfg.batch = boost::lexical_cast<int>(value);
+        } else if (key == "rate") {
+            cfg.rate = boost::lexical_cast<int>(value);
+        } else if (key == "max-queued") {
+            cfg.max_queued = boost::lexical_cast<int>(value);
+        } else if (key == "io-us") {
+            cfg.io_us = boost::lexical_cast<int>(value);
+        } else if (key == "in-flight") {
+            cfg.in_flight = boost::lexical_cast<int>(value);
+        } else if (key == "timeout") {
+            cfg.timeout = boost::lexical_cast<int>(value);
+        } else if (key == "broker") {
+            cfg.broker = value;
+        } else if (key == "shm-path") {
+            cfg.shm_path = value;
+        } else if (key == "port") {
+            cfg.port = boost::lexical_cast<uint16_t>(value);
+        } else {
+            throw std::invalid_argument(arg);
+        }
+    }
+
+    if (cfg.mode != "network" && cfg.mode != "shm" && cfg.mode != "embedded") {
+        throw std::invalid_argument("--mode=" + cfg.mode);
+    }
+    if (cfg.mode == "shm" && !cfg.broker.empty() && cfg.shm_path.empty()) {
+        // the workers would quietly talk tcp instead
+        throw std::invalid_argument("--mode=shm with --broker needs --shm-path");
+    }
+    if (cfg.topology != "chain" && cfg.topology != "fanout" && cfg.topology != "fanin") {
+        throw std::invalid_argument("--topology=" + cfg.topology);
+    }
+    if (cfg.stages < 1 || cfg.fanout < 1 || cfg.fanin < 1 || cfg.workers < 1
+            || cfg.in_flight < 1) {
+        throw std::invalid_argument(
+                "stages, fanout, fanin, workers and in-flight must be positive");
+    }
+    if (cfg.payload_size < static_cast<int>(sizeof(int64_t))) {
+        cfg.payload_size = sizeof(int64_t);  // room for the timestamp
+    }
+    if (cfg.topology == "fanin") {
+        cfg.messages -= cfg.messages % cfg.fanin;  // only complete groups
+    }
+    return cfg;
+}
+
+static std::string stage_queue(int stage)
+{
+    return "bench.q" + std::to_string(stage);
+}
+
+// the first 8 bytes of every payload carry the time the source emitted it
+static int64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            bench_clock::now().time_since_epoch()).count();
+}
+
+static Message make_payload_msg(int64_t ts, int payload_size)
+{
+    Message msg;
+    msg.type = MessageType::NORMAL;
+    msg.payload.assign(payload_size, 'x');
+    std::memcpy(&msg.payload[0], &ts, sizeof(ts));
+    return msg;
+}
+
+class LatencyRecorder {
+    public:
+        LatencyRecorder(size_t n_expected): n_expected(n_expected) {
+            latencies.reserve(n_expected);
+        }
+
+        void record(const Message& msg) {
+            int64_t ts;
+            std::memcpy(&ts, msg.payload.data(), sizeof(ts));
+            int64_t now = now_ns();
+            std::unique_lock<std::mutex> lock(mtx);
+            latencies.push_back(now - ts);
+            last_ns = now;
+            if (latencies.size() == n_expected) {
+                done_cv.notify_all();
+            }
+        }
+
+        bool wait_done(int timeout_sec) {
+            std::unique_lock<std::mutex> lock(mtx);
+            return done_cv.wait_for(lock, std::chrono::seconds(timeout_sec),
+                    [this] () { return latencies.size() >= n_expected; });
+        }
+
+        // must be called after all workers are stopped
+        std::vector<int64_t>& sorted() {
+            std::sort(latencies.begin(), latencies.end());
+            return latencies;
+        }
+
+        int64_t last_recorded_ns() const { return last_ns; }
+
+    private:
+        size_t n_expected;
+        std::vector<int64_t> latencies;
+        int64_t last_ns = 0;
+        std::mutex mtx;
+        std::condition_variable done_cv;
+};
+
+// where the workers find the broker: either a handler in the same process
+// or a host and port to connect to, optionally via shared memory
+struct BrokerEndpoint {
+    std::shared_ptr<BrokerHandler> embedded;
+    std::string host;
+    uint16_t port;
+    std::string shm_path;
+};
+
+// worker specific arguments go first, the rest is passed to BaseWorker
+template<typename W, typename... Args>
+static W* make_worker(const BrokerEndpoint& ep, const std::string& queue, Args&&... args)
+{
+    if (ep.embedded) {
+        return new W(std::forward<Args>(args)..., ep.embedded, queue);
+    }
+    return new W(std::forward<Args>(args)..., ep.host, ep.port, queue, ep.shm_path);
+}
+
+class SourceWorker: public BaseWorker {
+    public:
+        template<typename... BaseArgs>
+        SourceWorker(const BenchConfig& cfg, BaseArgs&&... base_args):
+            BaseWorker(std::forward<BaseArgs>(base_args)...), cfg(cfg) {}
+
+        bool process_message(const Message& msg) override {
+            return false;
+        }
+
+        void produce() {
+            auto start = bench_clock::now();
+            std::vector<Message> buf;
+            for (int i = 0; i < cfg.messages; ++i) {
+                if (cfg.rate > 0) {
+                    std::this_thread::sleep_until(
+                            start + std::chrono::microseconds(1000000LL * i / cfg.rate));
+                }
+
+                Message msg = make_payload_msg(now_ns(), cfg.payload_size);
+                if (cfg.topology == "fanin") {
+                    int group = i / cfg.fanin;
+                    msg.__set_resolve_dep("bench.group" + std::to_string(group));
+                    if (i % cfg.fanin == 0) {  // the joiner carries the group's timestamp
+                        Dependency dep;
+                        dep.key = msg.resolve_dep;
+                        dep.n = cfg.fanin;
+                        emit(stage_queue(0), make_payload_msg(now_ns(), cfg.payload_size), {dep});
+                    }
+                }
+
+                if (cfg.batch <= 0) {
+                    emit(stage_queue(0), std::move(msg), {});
+                } else {
+                    buf.push_back(msg);
+                    if (static_cast<int>(buf.size()) == cfg.batch) {
+                        emit(stage_queue(0), std::move(buf), {});
+                        buf.clear();
+                    }
+                }
+            }
+            if (!buf.empty()) {
+                emit(stage_queue(0), std::move(buf), {});
+            }
+        }
+
+    private:
+        const BenchConfig& cfg;
+};
+
+// stands in for the downstream I/O of a relay, completing what is submitted
+// after a fixed delay, in order
+class FakeIo {
+    public:
+        explicit FakeIo(int delay_us):
+            delay(delay_us), thread(&FakeIo::run, this) {}
+
+        ~FakeIo() {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                stopping = true;
+            }
+            cv.notify_all();
+            thread.join();
+        }
+
+        // blocks for the delay instead
+        void wait() const {
+            std::this_thread::sleep_for(delay);
+        }
+
+        void submit(std::function<void()> done) {
+            std::lock_guard<std::mutex> lock(mtx);
+            pending.emplace_back(bench_clock::now() + delay, std::move(done));
+            cv.notify_all();
+        }
+
+    private:
+        void run() {
+            std::unique_lock<std::mutex> lock(mtx);
+            while (true) {
+                if (pending.empty()) {
+                    if (stopping) {
+                        return;
+                    }
+                    cv.wait(lock);
+                } else if (bench_clock::now() < pending.front().first) {
+                    cv.wait_until(lock, pending.front().first);
+                } else {
+                    auto done = std::move(pending.front().second);
+                    pending.pop_front();
+                    lock.unlock();
+                    done();
+                    lock.lock();
+                }
+            }
+        }
+
+        std::chrono::microseconds delay;
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::deque<std::pair<bench_clock::time_point, std::function<void()>>> pending;
+        bool stopping = false;
+        std::thread thread;
+};
+
+// waits for io, if given, before forwarding a message: blocking unless the
+// worker keeps several messages in flight
+class RelayWorker: public BaseWorker {
+    public:
+        template<typename... BaseArgs>
+        RelayWorker(const std::string& next_queue, int copies, FakeIo* io,
+                BaseArgs&&... base_args):
+            BaseWorker(std::forward<BaseArgs>(base_args)...),
+            next_queue(next_queue), copies(copies), io(io) {}
+
+        bool process_message(const Message& msg) override {
+            if (io) {
+                io->wait();
+            }
+            forward(msg.payload);
+            return true;
+        }
+
+        void process_message_async(
+                Message msg, std::function<void(bool)> done) override {
+            if (!io) {
+                BaseWorker::process_message_async(std::move(msg), std::move(done));
+                return;
+            }
+            auto held = std::make_shared<Message>(std::move(msg));
+            io->submit([this, held, done] () {
+                forward(held->payload);
+                done(true);
+            });
+        }
+
+    private:
+        void forward(const std::string& payload) {
+            Message next_msg;
+            next_msg.type = MessageType::NORMAL;
+            next_msg.payload = payload;
+            if (copies == 1) {
+                emit(next_queue, std::move(next_msg), {});
+            } else {
+                emit(next_queue, std::vector<Message>(copies, next_msg), {});
+            }
+        }
+
+        std::string next_queue;
+        int copies;
+        FakeIo* io;
+};
+
+// dependencies are resolved within a queue, so in a fan-in the group members
+// and their joiner share a queue and only the joiners are recorded
+class SinkWorker: public BaseWorker {
+    public:
+        template<typename... BaseArgs>
+        SinkWorker(LatencyRecorder& recorder, BaseArgs&&... base_args):
+            BaseWorker(std::forward<BaseArgs>(base_args)...), recorder(recorder) {}
+
+        bool process_message(const Message& msg) override {
+            if (!msg.__isset.resolve_dep) {
+                recorder.record(msg);
+            }
+            return true;
+        }
+
+    private:
+        LatencyRecorder& recorder;
+};
+
+static bool wait_for_broker(const BrokerEndpoint& ep, int timeout_sec)
+{
+    auto deadline = bench_clock::now() + std::chrono::seconds(timeout_sec);
+    while (bench_clock::now() < deadline) {
+        try {
+            TSocket socket(ep.host, ep.port);
+            socket.open();
+            socket.close();
+            if (!ep.shm_path.empty()) {
+                TShmTransport shm(ep.shm_path);
+                shm.open();
+                shm.close();
+            }
+            return true;
+        } catch (const TTransportException&) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+    }
+    return false;
+}
+
+// bounds the stage queues, so that a fast source is held back by the broker
+static void configure_queues(const BrokerEndpoint& ep, const BenchConfig& cfg)
+{
+    QueueOptions options;
+    options.max_messages = cfg.max_queued;
+    options.block_ms = 100;
+
+    std::shared_ptr<BrokerIf> broker = ep.embedded;
+    boost::shared_ptr<TTransport> transport;
+    if (!broker) {
+        transport = boost::make_shared<TBufferedTransport>(
+                boost::make_shared<TSocket>(ep.host, ep.port));
+        broker = std::make_shared<BrokerClient>(
+                boost::make_shared<TBinaryProtocol>(transport));
+        transport->open();
+    }
+    for (int s = 0; s < std::max(cfg.stages, 2); ++s) {
+        broker->configureQueue(stage_queue(s), options);
+    }
+    if (transport) {
+        transport->close();
+    }
+}
+
+static int64_t percentile(const std::vector<int64_t>& sorted, double q)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t idx = static_cast<size_t>(q * sorted.size());
+    return sorted[std::min(idx, sorted.size() - 1)];
+}
+
+int main(int argc, char** argv)
+{
+    BenchConfig cfg;
+    try {
+        cfg = parse_args(argc, argv);
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "Invalid argument: %s\n", e.what());
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    BrokerEndpoint ep;
+    ep.host = "localhost";
+    ep.port = cfg.port;
+    std::unique_ptr<TThreadedServer> server;
+    std::thread server_thread;
+    std::unique_ptr<TThreadedServer> shm_server;
+    std::thread shm_server_thread;
+    if (cfg.mode == "embedded") {
+        // block id 0 stands in for the one normally allocated via zookeeper
+        ep.embedded = std::make_shared<BrokerHandler>(0);
+    } else if (cfg.broker.empty()) {
+        auto handler = boost::make_shared<BrokerHandler>(0);
+        server.reset(new TThreadedServer(
+                boost::make_shared<BrokerProcessor>(handler),
+                boost::make_shared<TServerSocket>(ep.port),
+                boost::make_shared<TBufferedTransportFactory>(),
+                boost::make_shared<TBinaryProtocolFactory>()));
+        server_thread = std::thread([&server] () { server->serve(); });
+        if (cfg.mode == "shm") {
+            ep.shm_path = !cfg.shm_path.empty() ? cfg.shm_path
+                : "/tmp/pork-bench." + std::to_string(ep.port) + ".sock";
+            shm_server.reset(new TThreadedServer(
+                    boost::make_shared<BrokerProcessor>(handler),
+                    boost::make_shared<TShmServerTransport>(ep.shm_path),
+                    boost::make_shared<TTransportFactory>(),
+                    boost::make_shared<TBinaryProtocolFactory>()));
+            shm_server_thread = std::thread([&shm_server] () { shm_server->serve(); });
+        }
+    } else {
+        size_t colon_pos = cfg.broker.rfind(':');
+        ep.host = cfg.broker.substr(0, colon_pos);
+        ep.port = boost::lexical_cast<uint16_t>(cfg.broker.substr(colon_pos + 1));
+        if (cfg.mode == "shm") {
+            ep.shm_path = cfg.shm_path;
+        }
+    }
+    if (!ep.embedded && !wait_for_broker(ep, 10)) {
+        LOG_FATAL << "Broker at " << ep.host << ":" << ep.port << " is not reachable";
+        return 1;
+    }
+
+    if (cfg.max_queued > 0) {
+        configure_queues(ep, cfg);
+    }
+
+    size_t n_expected;
+    if (cfg.topology == "fanout") {
+        n_expected = static_cast<size_t>(cfg.messages) * cfg.fanout;
+    } else if (cfg.topology == "fanin") {
+        n_expected = cfg.messages / cfg.fanin;
+    } else {
+        n_expected = cfg.messages;
+    }
+    LatencyRecorder recorder(n_expected);
+
+    // outlives the workers, which wait for their messages in flight
+    std::unique_ptr<FakeIo> io;
+    if (cfg.io_us > 0) {
+        io.reset(new FakeIo(cfg.io_us));
+    }
+    std::vector<std::unique_ptr<BaseWorker>> workers;
+    auto add_relay = [&] (int stage, int copies) {
+        workers.emplace_back(make_worker<RelayWorker>(
+                    ep, stage_queue(stage), stage_queue(stage + 1), copies, io.get()));
+        if (cfg.in_flight > 1) {
+            workers.back()->set_concurrency(cfg.in_flight);
+        }
+    };
+    for (int i = 0; i < cfg.workers; ++i) {
+        if (cfg.topology == "chain") {
+            for (int s = 0; s + 1 < cfg.stages; ++s) {
+                add_relay(s, 1);
+            }
+            workers.emplace_back(make_worker<SinkWorker>(
+                        ep, stage_queue(cfg.stages - 1), recorder));
+        } else if (cfg.topology == "fanout") {
+            add_relay(0, cfg.fanout);
+            workers.emplace_back(make_worker<SinkWorker>(ep, stage_queue(1), recorder));
+        } else {
+            workers.emplace_back(make_worker<SinkWorker>(ep, stage_queue(0), recorder));
+        }
+    }
+
+    std::vector<std::thread> worker_threads;
+    for (auto& w : workers) {
+        worker_threads.emplace_back(&BaseWorker::run, w.get());
+    }
+
+    std::unique_ptr<SourceWorker> source(
+            make_worker<SourceWorker>(ep, stage_queue(0) + ".source", cfg));
+    int64_t start_ns = now_ns();
+    source->produce();
+    int64_t produced_ns = now_ns();
+
+    bool completed = recorder.wait_done(cfg.timeout);
+
+    for (auto& w : workers) {
+        w->stop();
+    }
+    for (auto& t : worker_threads) {
+        t.join();
+    }
+    if (server) {
+        server->stop();
+        server_thread.join();
+    }
+    if (shm_server) {
+        shm_server->stop();
+        shm_server_thread.join();
+    }
+
+    auto& latencies = recorder.sorted();
+    double elapsed_sec = (recorder.last_recorded_ns() - start_ns) * 1e-9;
+    double throughput = elapsed_sec > 0 ? latencies.size() / elapsed_sec : 0;
+
+    std::printf("{\"mode\": \"%s\", \"topology\": \"%s\", \"messages\": %d, \"stages\": %d, "
+            "\"fanout\": %d, \"fanin\": %d, \"payload_size\": %d, \"workers\": %d, "
+            "\"batch\": %d, \"rate\": %d, \"max_queued\": %d, \"io_us\": %d, \"in_flight\": %d, "
+            "\"completed\": %s, \"delivered\": %zu, "
+            "\"produce_sec\": %.6f, \"elapsed_sec\": %.6f, \"throughput_msgs_per_sec\": %.1f, "
+            "\"latency_us\": {\"p50\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f}}\n",
+            cfg.mode.c_str(), cfg.topology.c_str(), cfg.messages, cfg.stages, cfg.fanout, cfg.fanin,
+            cfg.payload_size, cfg.workers, cfg.batch, cfg.rate, cfg.max_queued,
+            cfg.io_us, cfg.in_flight,
+            completed ? "true" : "false", latencies.size(),
+            (produced_ns - start_ns) * 1e-9, elapsed_sec, throughput,
+            percentile(latencies, 0.5) * 1e-3, percentile(latencies, 0.99) * 1e-3,
+            percentile(latencies, 0.999) * 1e-3,
+            (latencies.empty() ? 0 : latencies.back()) * 1e-3);
+
+    return completed ? 0 : 2;
+}
@@ -1,5 +1,6 @@
 #include <cstring>
 #include <memory>
+#include <thread>
 
 #include <boost/smart_ptr.hpp>
 #include <thrift/protocol/TBinaryProtocol.h>
@@ -11,6 +12,7 @@
 #include "Broker.h"
 #include "broker/broker_handler.h"
 #include "common.h"
+#include "shm_transport.h"
 
 using namespace pork;
 using namespace apache::thrift;
@@ -23,6 +25,8 @@ int main() {
     const char* zk_addr = "localhost:2181";
     int zk_recv_timeout = 3000;
     const char* broker_addr = "localhost:6783";
+    const char* broker_shm_path = "/tmp/pork-broker.6783.sock";
+    const char* broker_spill_dir = "/tmp";
 
     std::shared_ptr<zhandle_t> zk_handle(
             zookeeper_init(zk_addr, nullptr, zk_recv_timeout, 0, nullptr, 0),
@@ -49,12 +53,33 @@ int main() {
         // TODO: err handling
     }
 
+    ret = zoo_create(zk_handle.get(), ZNODE_BROKER_SHM_PATH,
+            broker_shm_path, strlen(broker_shm_path),
+            &ZOO_READ_ACL_UNSAFE, ZOO_EPHEMERAL, nullptr, 0);
+    if (ret != ZOK) {
+        // TODO: err handling
+    }
+
     // thrift uses boost's smart ptrs
     auto handler = boost::make_shared<BrokerHandler>(zk_handle.get());
+    handler->set_spill_dir(broker_spill_dir);
+    auto processor = boost::make_shared<BrokerProcessor>(handler);
+
+    // co-located workers talk to the same handler via shared memory
+    TThreadedServer shm_server(
+            processor,
+            boost::make_shared<TShmServerTransport>(broker_shm_path),
+            boost::make_shared<TTransportFactory>(),
+            boost::make_shared<TBinaryProtocolFactory>());
+    std::thread shm_thread([&shm_server] () { shm_server.serve(); });
+
     TThreadedServer server(
-            boost::make_shared<BrokerProcessor>(handler),
+            processor,
             boost::make_shared<TServerSocket>(6783),
             boost::make_shared<TBufferedTransportFactory>(),
             boost::make_shared<TBinaryProtocolFactory>());
     server.serve();
+
+    shm_server.stop();
+    shm_thread.join();
 }
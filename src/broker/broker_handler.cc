@@ -1,12 +1,22 @@
+#include <algorithm>
+#include <chrono>
 #include <cstring>
+#include <map>
+#include <random>
 #include <string>
+#include <utility>
 #include <vector>
 
+#include <boost/chrono/duration.hpp>
+#include <boost/chrono/system_clocks.hpp>
+
 #include <boost/lexical_cast.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/lock_factories.hpp>
 #include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 #include "broker/broker_handler.h"
 #include "common.h"
@@ -14,6 +24,46 @@
 
 namespace pork {
 
+    std::chrono::milliseconds BrokerHandler::FETCH_ANY_TIMEOUT(5000);
+
+    namespace {
+        // counts a fetch in as waiting on ready_signal for as long as it lives
+        class WaiterGuard {
+            public:
+                explicit WaiterGuard(ReadySignal& signal): signal(signal) {
+                    ++signal.n_waiters;
+                }
+                ~WaiterGuard() { --signal.n_waiters; }
+
+            private:
+                ReadySignal& signal;
+        };
+
+        // puts the indices of subscriptions in the order to look at them, so
+        // that each comes first in proportion to its weight (Efraimidis and
+        // Spirakis)
+        void weighted_order(const std::vector<Subscription>& subscriptions,
+                std::vector<size_t>& order)
+        {
+            if (order.size() < 2) {
+                return;
+            }
+            static thread_local std::mt19937_64 rng(std::random_device{}());
+            std::exponential_distribution<double> exp_dist;
+            std::vector<std::pair<double, size_t>> keys;
+            keys.reserve(order.size());
+            for (size_t i : order) {
+                int weight = std::max(subscriptions[i].weight, 1);
+                keys.emplace_back(exp_dist(rng) / weight, i);
+            }
+            std::sort(keys.begin(), keys.end());
+            order.clear();
+            for (auto& key : keys) {
+                order.push_back(key.second);
+            }
+        }
+    }
+
     BrokerHandler::BrokerHandler(zhandle_t* zk_handle):
         zk_handle(zk_handle)
     {
@@ -24,9 +74,21 @@ namespace pork {
         if (ret != ZOK) {
             throw std::runtime_error(zerror(ret));
         }
-        id_t block_id = boost::lexical_cast<id_t>(
-                zk_node_path_buf + strlen(ZNODE_ID_BLOCK_PREFIX));
-        next_id = 1 + (block_id << (sizeof(block_id) * 4));  // block id as the upper half
+        init_next_id(boost::lexical_cast<id_t>(
+                zk_node_path_buf + strlen(ZNODE_ID_BLOCK_PREFIX)));
+        watch_consumers();
+        start_reaper();
+    }
+
+    BrokerHandler::BrokerHandler(id_t block_id)
+    {
+        init_next_id(block_id);
+        start_reaper();
+    }
+
+    BrokerHandler::~BrokerHandler()
+    {
+        stop_reaper();
     }
 
     void BrokerHandler::getMessage(
@@ -44,10 +106,8 @@ namespace pork {
             const Message& message,
             const std::vector<Dependency>& deps)
     {
-        auto msg = std::make_shared<Message>(message);
-        msg->__set_id(get_next_id());
-        ensure_queue(queue_name)->push_message(msg, deps);
-        return msg->id;
+        Message msg(message);
+        return push_message(ensure_queue(queue_name), std::move(msg), deps);
     }
 
     void BrokerHandler::addMessageGroup(
@@ -56,16 +116,73 @@ namespace pork {
             const std::vector<Message>& messages,
             const std::vector<Dependency>& deps)
     {
-        auto q = ensure_queue(queue_name);
+        std::vector<Message> msgs(messages);
+        push_message_group(_return, ensure_queue(queue_name), std::move(msgs), deps);
+    }
+
+    void BrokerHandler::publish(
+            std::vector<id_t>& _return,
+            const std::vector<std::string>& queue_names,
+            const Message& message,
+            const int32_t n_copies,
+            const std::vector<Dependency>& deps)
+    {
         _return.clear();
-        for (auto& m : messages) {
-            auto msg = std::make_shared<Message>(m);
-            msg->__set_id(get_next_id());
-            q->push_message(msg, deps);
-            _return.push_back(msg->id);
+        if (queue_names.empty() || n_copies <= 0) {
+            return;
+        }
+        size_t n_total = queue_names.size() * n_copies;
+        boost::intrusive_ptr<SharedPayload> payload(new SharedPayload());
+        Message msg(message);
+        payload->data.swap(msg.payload);
+        payload->compression = msg.compression;
+        // each copy bears its part of the payload, so that dropping them all
+        // gives back what it took
+        payload->share = (payload->data.size() + n_total - 1) / n_total;
+        std::vector<std::shared_ptr<AbstractMessageQueue>> qs;
+        for (auto& queue_name : queue_names) {
+            qs.push_back(ensure_queue(queue_name));
+        }
+        // room is taken in every queue before any copy is added, a producer
+        // retrying after Overloaded must not add copies twice
+        size_t n_reserved = 0;
+        try {
+            for (; n_reserved < qs.size(); ++n_reserved) {
+                qs[n_reserved]->reserve_copies(msg, payload, n_copies, deps);
+            }
+        } catch (...) {
+            for (size_t i = 0; i < n_reserved; ++i) {
+                qs[i]->cancel_copies(msg, payload, n_copies, deps);
+            }
+            throw;
+        }
+        std::vector<id_t> ids(n_copies);
+        for (auto& q : qs) {
+            for (auto& id : ids) {
+                id = get_next_id();
+            }
+            q->push_message_copies(msg, payload, ids, deps, true);
+            _return.insert(_return.end(), ids.begin(), ids.end());
         }
     }
 
+    id_t BrokerHandler::addMessage(
+            const std::string& queue_name,
+            Message&& message,
+            const std::vector<Dependency>& deps)
+    {
+        return push_message(ensure_queue(queue_name), std::move(message), deps);
+    }
+
+    void BrokerHandler::addMessageGroup(
+            std::vector<id_t>& _return,
+            const std::string& queue_name,
+            std::vector<Message>&& messages,
+            const std::vector<Dependency>& deps)
+    {
+        push_message_group(_return, ensure_queue(queue_name), std::move(messages), deps);
+    }
+
     void BrokerHandler::ack(const std::string& queue_name, const id_t msg_id)
     {
         ensure_queue(queue_name)->ack(msg_id);
@@ -76,8 +193,242 @@ namespace pork {
         ensure_queue(queue_name)->fail(msg_id);
     }
 
+    void BrokerHandler::ackAndGetMessage(
+            Message& _return,
+            const std::string& queue_name,
+            const std::vector<Outcome>& outcomes,
+            const std::string& consumer_id)
+    {
+        auto q = ensure_queue(queue_name);
+        apply_outcomes(q, outcomes);
+        if (!q->pop_free_message(_return, consumer_id)) {
+            throw Timeout();  // no free msg
+        }
+    }
+
+    void BrokerHandler::ackAndGetAnyMessage(
+            Message& _return,
+            const std::vector<Subscription>& subscriptions,
+            const std::vector<Outcome>& outcomes,
+            const std::string& consumer_id)
+    {
+        for (auto& outcome : outcomes) {
+            apply_outcomes(ensure_queue(outcome.queue_name), {outcome});
+        }
+        std::vector<std::shared_ptr<AbstractMessageQueue>> qs;
+        ensure_queues(subscriptions, qs);
+
+        WaiterGuard guard(*ready_signal);
+        auto deadline = boost::chrono::steady_clock::now()
+            + boost::chrono::milliseconds(FETCH_ANY_TIMEOUT.count());
+        std::vector<size_t> order;
+        while (true) {
+            uint64_t version = ready_signal->version();
+            // most of many queues are empty, only draw among the others
+            order.clear();
+            for (size_t i = 0; i < qs.size(); ++i) {
+                if (qs[i]->may_have_ready()) {
+                    order.push_back(i);
+                }
+            }
+            weighted_order(subscriptions, order);
+            for (size_t i : order) {
+                if (qs[i]->try_pop_free_message(_return, consumer_id)) {
+                    _return.__set_queue_name(subscriptions[i].queue_name);
+                    return;
+                }
+            }
+            if (!ready_signal->wait(version, deadline)) {
+                throw Timeout();  // no free msg
+            }
+        }
+    }
+
+    void BrokerHandler::leaveQueue(
+            const std::string& queue_name,
+            const std::string& consumer_id)
+    {
+        ensure_queue(queue_name)->remove_consumer(consumer_id);
+    }
+
+    void BrokerHandler::ackBatch(
+            const std::string& queue_name,
+            const std::vector<Outcome>& outcomes)
+    {
+        apply_outcomes(ensure_queue(queue_name), outcomes);
+    }
+
+    void BrokerHandler::releaseMessages(
+            const std::string& queue_name,
+            const std::vector<id_t>& msg_ids)
+    {
+        auto q = ensure_queue(queue_name);
+        for (id_t msg_id : msg_ids) {
+            q->requeue(msg_id);
+        }
+    }
+
+    void BrokerHandler::configureQueue(
+            const std::string& queue_name,
+            const QueueOptions& options)
+    {
+        ensure_queue(queue_name)->configure(options);
+    }
+
+    void BrokerHandler::getQueueStats(QueueStats& _return, const std::string& queue_name)
+    {
+        ensure_queue(queue_name)->get_stats(_return);
+    }
+
+    void BrokerHandler::getBrokerStats(BrokerStats& _return)
+    {
+        _return.memory_budget = memory_budget->max_bytes;
+        _return.used_bytes = memory_budget->used_bytes;
+        _return.queues.clear();
+        PORK_RLOCK(rlock_, queues_mtx);
+        for (auto& q : queues) {
+            q.second->get_stats(_return.queues[q.first]);
+        }
+    }
+
+    void BrokerHandler::setMemoryBudget(const int64_t max_bytes)
+    {
+        memory_budget->max_bytes = max_bytes;
+    }
+
+    void BrokerHandler::start_reaper()
+    {
+        reaper = boost::thread(&BrokerHandler::reap, this);
+    }
+
+    void BrokerHandler::stop_reaper()
+    {
+        {
+            PORK_LOCK(reaper_mtx);
+            stopping = true;
+        }
+        reaper_cv.notify_all();
+        if (reaper.joinable()) {
+            reaper.join();
+        }
+    }
+
+    void BrokerHandler::reap()
+    {
+        boost::unique_lock<boost::mutex> lock(reaper_mtx);
+        while (true) {
+            reaper_cv.wait_for(lock, boost::chrono::milliseconds(REAP_INTERVAL_MS),
+                    [this] () {
+                        return stopping || consumers_changed || !lost_consumers.empty();
+                    });
+            if (stopping) {
+                break;
+            }
+            std::vector<std::string> lost;
+            lost.swap(lost_consumers);
+            bool recheck = consumers_changed || rewatch_consumers;
+            consumers_changed = false;
+            lock.unlock();
+            if (recheck) {
+                auto gone = watch_consumers();
+                lost.insert(lost.end(), gone.begin(), gone.end());
+            }
+            std::vector<std::shared_ptr<AbstractMessageQueue>> qs;
+            {
+                PORK_RLOCK(rlock_, queues_mtx);
+                for (auto& q : queues) {
+                    qs.push_back(q.second);
+                }
+            }
+            for (auto& q : qs) {
+                for (auto& consumer_id : lost) {
+                    q->drop_consumer(consumer_id);
+                }
+                q->expire_messages();
+            }
+            lock.lock();
+        }
+    }
+
+    void BrokerHandler::consumers_gone(const std::vector<std::string>& consumer_ids)
+    {
+        {
+            PORK_LOCK(reaper_mtx);
+            lost_consumers.insert(lost_consumers.end(),
+                    consumer_ids.begin(), consumer_ids.end());
+        }
+        reaper_cv.notify_all();
+    }
+
+    std::vector<std::string> BrokerHandler::watch_consumers()
+    {
+        std::vector<std::string> gone;
+        std::map<std::string, int64_t> current;
+        rewatch_consumers = !get_consumers(current);
+        if (rewatch_consumers) {
+            return gone;
+        }
+        for (auto& known : known_consumers) {
+            auto iter = current.find(known.first);
+            if (iter == current.end() || iter->second != known.second) {
+                gone.push_back(known.first);
+            }
+        }
+        known_consumers.swap(current);
+        if (!gone.empty()) {
+            LOG_INFO << gone.size() << " consumers gone, taking back their messages";
+        }
+        return gone;
+    }
+
+    bool BrokerHandler::get_consumers(std::map<std::string, int64_t>& consumers)
+    {
+        String_vector children;
+        int ret = zoo_wget_children(zk_handle, ZNODE_CONSUMERS,
+                &BrokerHandler::on_consumers_changed, this, &children);
+        if (ret != ZOK) {
+            LOG_WARNING << "Failed to watch the consumers: " << zerror(ret);
+            return false;
+        }
+        for (int i = 0; i < children.count; ++i) {
+            std::string path = std::string(ZNODE_CONSUMERS) + "/" + children.data[i];
+            struct Stat stat;
+            if (zoo_exists(zk_handle, path.c_str(), 0, &stat) == ZOK) {
+                consumers[children.data[i]] = stat.czxid;
+            }
+        }
+        deallocate_String_vector(&children);
+        return true;
+    }
+
+    void BrokerHandler::on_consumers_changed(zhandle_t* zh, int type, int state,
+            const char* path, void* ctx)
+    {
+        if (type == ZOO_SESSION_EVENT) {
+            if (state == ZOO_EXPIRED_SESSION_STATE) {
+                LOG_WARNING << "ZooKeeper session expired, lost consumers go "
+                    "unnoticed until it is connected again";
+                return;
+            }
+            // consumers might have come and gone while disconnected, and a new
+            // session has no watch
+            if (state != ZOO_CONNECTED_STATE) {
+                return;
+            }
+        } else if (type != ZOO_CHILD_EVENT) {
+            return;
+        }
+        auto handler = static_cast<BrokerHandler*>(ctx);
+        {
+            boost::lock_guard<boost::mutex> lock(handler->reaper_mtx);
+            handler->consumers_changed = true;
+        }
+        handler->reaper_cv.notify_all();
+    }
+
     std::shared_ptr<AbstractMessageQueue> BrokerHandler::create_mq() {
-        return std::shared_ptr<MessageQueue>(new MessageQueue());
+        return std::shared_ptr<MessageQueue>(
+                new MessageQueue(memory_budget, spill_dir, ready_signal));
     }
 
     std::shared_ptr<AbstractMessageQueue> BrokerHandler::ensure_queue(
@@ -99,9 +450,78 @@ namespace pork {
         return q_iter->second;
     }
 
+    void BrokerHandler::ensure_queues(
+            const std::vector<Subscription>& subscriptions,
+            std::vector<std::shared_ptr<AbstractMessageQueue>>& qs)
+    {
+        qs.resize(subscriptions.size());
+        bool all_found = true;
+        {
+            PORK_RLOCK(rlock_, queues_mtx);
+            for (size_t i = 0; i < subscriptions.size(); ++i) {
+                auto q_iter = queues.find(subscriptions[i].queue_name);
+                if (q_iter != queues.end()) {
+                    qs[i] = q_iter->second;
+                } else {
+                    all_found = false;
+                }
+            }
+        }
+        if (!all_found) {
+            for (size_t i = 0; i < subscriptions.size(); ++i) {
+                if (!qs[i]) {
+                    qs[i] = ensure_queue(subscriptions[i].queue_name);
+                }
+            }
+        }
+    }
+
     id_t BrokerHandler::get_next_id()
     {
         return next_id++;
     }
 
+    id_t BrokerHandler::push_message(
+            const std::shared_ptr<AbstractMessageQueue>& q,
+            Message&& msg,
+            const std::vector<Dependency>& deps)
+    {
+        id_t id = get_next_id();
+        msg.__set_id(id);
+        q->push_message(std::move(msg), deps);
+        return id;
+    }
+
+    void BrokerHandler::push_message_group(
+            std::vector<id_t>& ids,
+            const std::shared_ptr<AbstractMessageQueue>& q,
+            std::vector<Message>&& msgs,
+            const std::vector<Dependency>& deps)
+    {
+        ids.clear();
+        for (auto& msg : msgs) {
+            msg.__set_id(get_next_id());
+            ids.push_back(msg.id);
+        }
+        q->push_message_group(std::move(msgs), deps);
+    }
+
+    void BrokerHandler::init_next_id(id_t block_id)
+    {
+        next_id = 1 + (block_id << (sizeof(block_id) * 4));  // block id as the upper half
+    }
+
+    void BrokerHandler::apply_outcomes(
+            const std::shared_ptr<AbstractMessageQueue>& q,
+            const std::vector<Outcome>& outcomes)
+    {
+        for (auto& outcome : outcomes) {
+            if (outcome.acked) {
+                q->ack(outcome.msg_id);
+            } else {
+                q->fail(outcome.msg_id);
+            }
+        }
+    }
+
 } /* pork  */
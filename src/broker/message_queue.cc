@@ -1,6 +1,19 @@
+#include <algorithm>
+#include <atomic>
+#include <functional>
 #include <memory>
+#include <new>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
 
 #include <boost/chrono/duration.hpp>
+#include <boost/chrono/system_clocks.hpp>
+#include <boost/pool/singleton_pool.hpp>
+#include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/lock_factories.hpp>
 #include <boost/thread/mutex.hpp>
@@ -14,34 +27,537 @@ namespace pork {
 
     boost::chrono::milliseconds MessageQueue::POP_FREE_TIMEOUT(5000);
 
-    bool MessageQueue::pop_free_message(Message& msg)
-    {
-        boost::unique_lock<boost::mutex> lock(free_msgs_mtx);
-        if (free_msgs_not_empty_cv.wait_for(lock, POP_FREE_TIMEOUT,
-                    [this]() { return !free_msgs.empty(); })) {
-            // free_msgs is not empty, pop the msg and set the state
-            auto intern_msg = free_msgs.front();
-            intern_msg->state = MessageState::IN_PROGRESS;
-            msg = *intern_msg->msg;
-            free_msgs.pop();
-            return true;
-        } else {  // timeout
+    namespace {
+        struct InternalMessagePoolTag {};
+        typedef boost::singleton_pool<InternalMessagePoolTag,
+                sizeof(InternalMessage)> InternalMessagePool;
+
+        // what a message costs on top of its payload
+        size_t message_cost(const Message& msg, const std::vector<Dependency>& deps)
+        {
+            return sizeof(InternalMessage) + msg.payload.size() + msg.resolve_dep.size()
+                + deps.size() * sizeof(InternalDependency::Dependant);
+        }
+
+        // a node of all_deps, assuming a red-black tree node of 3 pointers and a color
+        size_t dependency_cost(const std::string& key)
+        {
+            return sizeof(std::pair<const std::string, InternalDependency>)
+                + 4 * sizeof(void*) + key.size();
+        }
+
+        std::atomic<unsigned> n_spilling_queues(0);
+
+        // segment files of different queues and brokers must not collide
+        std::string spill_prefix()
+        {
+            return "pork-spill." + std::to_string(getpid())
+                + "." + std::to_string(n_spilling_queues++);
+        }
+
+        int64_t now_ms()
+        {
+            return boost::chrono::duration_cast<boost::chrono::milliseconds>(
+                    boost::chrono::system_clock::now().time_since_epoch()).count();
+        }
+
+        // the band a message resolving a key n messages wait for is raised to:
+        // 0 for none, 1 for one, 2 for two or three, the top one for more
+        int dependants_band(size_t n)
+        {
+            int band = 0;
+            while (n > 0 && band < ReadyQueue::N_BANDS - 1) {
+                n >>= 1;
+                ++band;
+            }
+            return band;
+        }
+
+        // the finalizer of splitmix64, spreads similar hashes apart
+        uint64_t mix64(uint64_t x)
+        {
+            x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+            return x ^ (x >> 31);
+        }
+
+        uint64_t consumer_hash(const std::string& consumer_id)
+        {
+            return mix64(std::hash<std::string>()(consumer_id));
+        }
+
+        struct IdCompare {
+            bool operator()(id_t id, const InternalMessage& msg) const {
+                return id < msg.id;
+            }
+            bool operator()(const InternalMessage& msg, id_t id) const {
+                return msg.id < id;
+            }
+        };
+    }
+
+    void* InternalMessage::operator new(size_t size)
+    {
+        if (size != sizeof(InternalMessage)) {
+            return ::operator new(size);
+        }
+        void* p = InternalMessagePool::malloc();
+        if (p == nullptr) {
+            throw std::bad_alloc();
+        }
+        return p;
+    }
+
+    void InternalMessage::operator delete(void* p)
+    {
+        if (p != nullptr) {
+            InternalMessagePool::free(p);
+        }
+    }
+
+    void ReadyQueue::push(InternalMessagePtr&& msg)
+    {
+        int band = msg->band;
+        bands[band].emplace_back(n_pushed++, std::move(msg));
+        non_empty_bands |= 1u << band;
+        ++n_msgs;
+        if (counter != nullptr) {
+            ++*counter;
+        }
+    }
+
+    void ReadyQueue::raise(InternalMessagePtr&& msg, int old_band)
+    {
+        // counted once already, in its old band
+        int band = msg->band;
+        bands[band].emplace_back(n_pushed++, std::move(msg));
+        non_empty_bands |= 1u << band;
+        drop_stale(old_band);
+    }
+
+    const InternalMessagePtr& ReadyQueue::peek() const
+    {
+        return bands[next_band()].front().second;
+    }
+
+    InternalMessagePtr ReadyQueue::pop()
+    {
+        int band = next_band();
+        uint64_t seq = bands[band].front().first;
+        bool overtaking = false;
+        for (unsigned rest = non_empty_bands & ~(1u << band); rest; rest &= rest - 1) {
+            if (bands[__builtin_ctz(rest)].front().first < seq) {
+                overtaking = true;
+                break;
+            }
+        }
+        n_overtaking = overtaking ? n_overtaking + 1 : 0;
+        return pop_band(band);
+    }
+
+    InternalMessagePtr ReadyQueue::pop_lowest()
+    {
+        return pop_band(__builtin_ctz(non_empty_bands));
+    }
+
+    int ReadyQueue::next_band() const
+    {
+        int top = 31 - __builtin_clz(non_empty_bands);
+        if (starvation_limit <= 0 || n_overtaking < starvation_limit) {
+            return top;
+        }
+        int oldest = top;
+        for (unsigned rest = non_empty_bands & ~(1u << top); rest; rest &= rest - 1) {
+            int band = __builtin_ctz(rest);
+            if (bands[band].front().first < bands[oldest].front().first) {
+                oldest = band;
+            }
+        }
+        return oldest;
+    }
+
+    InternalMessagePtr ReadyQueue::pop_band(int band)
+    {
+        auto& q = bands[band];
+        InternalMessagePtr msg = std::move(q.front().second);
+        q.pop_front();
+        drop_stale(band);
+        --n_msgs;
+        if (counter != nullptr) {
+            --*counter;
+        }
+        return msg;
+    }
+
+    void ReadyQueue::drop_stale(int band)
+    {
+        auto& q = bands[band];
+        while (!q.empty() && is_stale(q.front(), band)) {
+            q.pop_front();
+        }
+        if (q.empty()) {
+            non_empty_bands &= ~(1u << band);
+        }
+    }
+
+    MessageQueue::~MessageQueue()
+    {
+        // unlinked one by one, a long lane would overflow the stack otherwise
+        for (auto& lane : lanes) {
+            while (lane.second.first) {
+                lane.second.first = std::move(lane.second.first->next_in_lane);
+            }
+        }
+        all_msgs.clear_and_dispose([] (InternalMessage* msg) {
+            intrusive_ptr_release(msg);
+        });
+        budget->used_bytes -= n_bytes + dependency_bytes;
+    }
+
+    uint64_t ReadySignal::version()
+    {
+        PORK_LOCK(mtx);
+        return n_notified;
+    }
+
+    bool ReadySignal::wait(uint64_t version, boost::chrono::steady_clock::time_point deadline)
+    {
+        boost::unique_lock<boost::mutex> lock(mtx);
+        while (n_notified == version) {
+            if (cv.wait_until(lock, deadline) == boost::cv_status::timeout) {
+                return n_notified != version;
+            }
+        }
+        return true;
+    }
+
+    void ReadySignal::notify()
+    {
+        if (n_waiters == 0) {
+            return;
+        }
+        {
+            PORK_LOCK(mtx);
+            ++n_notified;
+        }
+        cv.notify_all();
+    }
+
+    bool MessageQueue::pop_free_message(Message& msg, const std::string& consumer_id)
+    {
+        return pop(msg, consumer_id, boost::chrono::steady_clock::now() + POP_FREE_TIMEOUT);
+    }
+
+    bool MessageQueue::try_pop_free_message(Message& msg, const std::string& consumer_id)
+    {
+        if (!may_have_ready()) {
             return false;
         }
+        return pop(msg, consumer_id, boost::chrono::steady_clock::now());
+    }
+
+    bool MessageQueue::pop(Message& msg, const std::string& consumer_id,
+            boost::chrono::steady_clock::time_point deadline)
+    {
+        InternalMessagePtr intern_msg;
+        std::vector<InternalMessagePtr> expired;
+        {
+            boost::unique_lock<boost::mutex> lock(free_msgs_mtx);
+            if (!consumer_id.empty()) {
+                auto iter = consumers.find(consumer_id);
+                if (iter == consumers.end()) {
+                    iter = add_consumer(consumer_id);
+                }
+                ++iter->second.n_fetching;
+            }
+            while (true) {
+                release_delayed();
+                // looked up every time, the consumer might have left meanwhile
+                Consumer* consumer = find_consumer(consumer_id);
+                while (!intern_msg) {
+                    ReadyQueue* ready = next_ready_queue(consumer);
+                    if (ready == nullptr) {
+                        break;
+                    }
+                    auto next = ready->pop();
+                    forget_resolver(*next);
+                    // a hedged message is out already, it is not for the ttl to drop
+                    bool is_expired = !next->hedged
+                        && next->expires_at > 0 && next->expires_at <= now_ms();
+                    // counted before it shows as taken, so that a failing or
+                    // taken back other attempt sees this one out
+                    ++next->n_out;
+                    auto expected = MessageState::QUEUING;
+                    if (!next->state.compare_exchange_strong(expected, is_expired
+                                ? MessageState::EXPIRED : MessageState::IN_PROGRESS)) {
+                        // expired in the background, or a hedged one acked
+                        // meanwhile, only a husk is left
+                        --next->n_out;
+                        continue;
+                    }
+                    if (is_expired) {
+                        --next->n_out;
+                        expired.push_back(std::move(next));
+                    } else {
+                        intern_msg = std::move(next);
+                    }
+                }
+                if (intern_msg) {
+                    track(*intern_msg, consumer != nullptr ? consumer->hash : 0);
+                    if (!intern_msg->hedged && hedge_percentile != 0) {
+                        intern_msg->out_at = now_ms();
+                        out_msgs.emplace_back(intern_msg->out_at, intern_msg->id);
+                    }
+                    break;
+                }
+                if (!expired.empty()) {
+                    // this might free some dependants, see if one can be taken
+                    lock.unlock();
+                    for (auto& expired_msg : expired) {
+                        finish_expiry(std::move(expired_msg));
+                    }
+                    expired.clear();
+                    lock.lock();
+                    continue;
+                }
+                auto now = boost::chrono::steady_clock::now();
+                if (now >= deadline) {
+                    break;  // timeout
+                }
+                // nobody notifies when a delayed message is due, wake up for
+                // the earliest one
+                auto until = deadline;
+                if (!delayed_msgs.empty()) {
+                    int64_t due_in = delayed_msgs.next_due_ms() - now_ms();
+                    until = std::min(deadline,
+                            now + boost::chrono::milliseconds(std::max<int64_t>(due_in, 0)));
+                }
+                free_msgs_not_empty_cv.wait_until(lock, until);
+            }
+            Consumer* consumer = find_consumer(consumer_id);
+            if (consumer != nullptr) {
+                --consumer->n_fetching;
+                consumer->last_seen = now_ms();
+            }
+            // start paging in the next spilled payload before it is asked for
+            ReadyQueue* next = next_ready_queue(consumer);
+            if (next != nullptr && next->peek()->spilled) {
+                spill_store->prefetch(next->peek()->spill_loc);
+            }
+        }
+
+        for (auto& expired_msg : expired) {
+            finish_expiry(std::move(expired_msg));
+        }
+        if (!intern_msg) {
+            return false;
+        }
+
+        // the message cannot change any more, copy it without the lock. the ack
+        // of another attempt of a hedged one leaves it as it is
+        msg = intern_msg->msg;
+        if (intern_msg->shared_payload) {
+            msg.payload = intern_msg->shared_payload->data;
+        }
+        if (!intern_msg->joined.empty()) {
+            msg.__isset.joined = true;
+            msg.__isset.joined_compression = true;
+            msg.joined.reserve(intern_msg->joined.size());
+            msg.joined_compression.reserve(intern_msg->joined.size());
+            for (auto& result : intern_msg->joined) {
+                msg.joined.push_back(result->data);
+                msg.joined_compression.push_back(result->compression);
+            }
+        }
+        if (intern_msg->spilled && !spill_store->read(intern_msg->spill_loc, msg.payload)) {
+            // the message has been replaced meanwhile, never hand it out truncated
+            LOG_WARNING << "Failed to read the spilled payload of message "
+                << intern_msg->id << ", failing it";
+            drop_unreadable(*intern_msg);
+            return pop(msg, consumer_id, deadline);
+        }
+        return true;
+    }
+
+    void MessageQueue::drop_unreadable(InternalMessage& msg)
+    {
+        msg.state = MessageState::FAILED;
+        bool current = false;
+        {
+            PORK_LOCK(all_msgs_mtx);
+            auto iter = all_msgs.find(msg.id, IdCompare());
+            // a replaced message has been released along with its payload
+            if (iter != all_msgs.end() && &*iter == &msg) {
+                all_msgs.erase(iter);
+                current = true;
+            }
+        }
+        if (current) {
+            intrusive_ptr_release(&msg);  // the reference held by all_msgs
+            untrack(msg);
+            release(msg);
+        }
+        leave_lane(msg);
     }
 
     void MessageQueue::push_message(
-            const std::shared_ptr<Message>& msg,
+            Message&& msg,
+            const std::vector<Dependency>& deps)
+    {
+        size_t n_bytes = message_cost(msg, deps);
+        size_t payload_bytes = msg.payload.size();
+        if (!admit(1, n_bytes, payload_bytes)) {
+            insert_message(std::move(msg), deps, n_bytes, nullptr);
+            return;
+        }
+
+        n_bytes -= payload_bytes;
+        SegmentStore::Location spill_loc;
+        try {
+            spill_loc = spill_store->append(msg.payload);
+        } catch (...) {
+            cancel_spill(1, n_bytes, payload_bytes);
+            throw;
+        }
+        insert_message(std::move(msg), deps, n_bytes, &spill_loc);
+    }
+
+    void MessageQueue::push_message_group(
+            std::vector<Message>&& msgs,
             const std::vector<Dependency>& deps)
     {
-        auto intern_msg = std::make_shared<InternalMessage>(msg);
+        size_t n_bytes = 0;
+        size_t payload_bytes = 0;
+        for (auto& msg : msgs) {
+            n_bytes += message_cost(msg, deps);
+            payload_bytes += msg.payload.size();
+        }
+        if (!admit(msgs.size(), n_bytes, payload_bytes)) {
+            for (auto& msg : msgs) {
+                size_t msg_bytes = message_cost(msg, deps);
+                insert_message(std::move(msg), deps, msg_bytes, nullptr);
+            }
+            return;
+        }
+
+        std::vector<SegmentStore::Location> spill_locs;
+        try {
+            for (auto& msg : msgs) {
+                spill_locs.push_back(spill_store->append(msg.payload));
+            }
+        } catch (...) {
+            for (auto& loc : spill_locs) {
+                spill_store->release(loc);
+            }
+            cancel_spill(msgs.size(), n_bytes - payload_bytes, payload_bytes);
+            throw;
+        }
+        for (size_t i = 0; i < msgs.size(); ++i) {
+            size_t msg_bytes = message_cost(msgs[i], deps) - msgs[i].payload.size();
+            insert_message(std::move(msgs[i]), deps, msg_bytes, &spill_locs[i]);
+        }
+    }
+
+    void MessageQueue::push_message_copies(
+            const Message& msg,
+            const SharedPayloadPtr& payload,
+            const std::vector<id_t>& ids,
+            const std::vector<Dependency>& deps,
+            bool reserved)
+    {
+        size_t msg_bytes = message_cost(msg, deps) + payload->share;
+        if (!reserved) {
+            reserve_copies(msg, payload, ids.size(), deps);
+        }
+        for (id_t id : ids) {
+            Message copy(msg);
+            copy.__set_id(id);
+            insert_message(std::move(copy), deps, msg_bytes, nullptr, payload);
+        }
+    }
+
+    void MessageQueue::reserve_copies(
+            const Message& msg,
+            const SharedPayloadPtr& payload,
+            size_t n_copies,
+            const std::vector<Dependency>& deps)
+    {
+        size_t msg_bytes = message_cost(msg, deps) + payload->share;
+        // spilling would write the payload once for every copy
+        admit(n_copies, n_copies * msg_bytes, n_copies * payload->share, false);
+    }
+
+    void MessageQueue::cancel_copies(
+            const Message& msg,
+            const SharedPayloadPtr& payload,
+            size_t n_copies,
+            const std::vector<Dependency>& deps)
+    {
+        size_t msg_bytes = message_cost(msg, deps) + payload->share;
+        cancel_admission(n_copies, n_copies * msg_bytes, n_copies * payload->share);
+    }
+
+    void MessageQueue::insert_message(
+            Message&& msg,
+            const std::vector<Dependency>& deps,
+            size_t n_bytes,
+            const SegmentStore::Location* spill_loc,
+            const SharedPayloadPtr& shared_payload)
+    {
+        InternalMessagePtr intern_msg(new InternalMessage());
+        swap(intern_msg->msg, msg);
+        intern_msg->id = intern_msg->msg.id;
+        intern_msg->n_bytes = n_bytes;
+        intern_msg->shared_payload = shared_payload;
+        int ttl_ms = intern_msg->msg.__isset.ttl_ms
+            ? intern_msg->msg.ttl_ms : default_ttl_ms.load();
+        if (ttl_ms > 0) {
+            intern_msg->expires_at = now_ms() + ttl_ms;
+        }
+        intern_msg->band = std::min(std::max(intern_msg->msg.priority, 0),
+                ReadyQueue::N_BANDS - 1);
+        if (intern_msg->msg.__isset.partition_key) {
+            intern_msg->partition_hash =
+                std::hash<std::string>()(intern_msg->msg.partition_key);
+        }
+        if (spill_loc != nullptr) {
+            intern_msg->spilled = true;
+            intern_msg->spill_loc = *spill_loc;
+            std::string().swap(intern_msg->msg.payload);
+        }
+        InternalMessagePtr replaced;
         {  // add to new_msg
             PORK_LOCK(all_msgs_mtx);
-            all_msgs[msg->id] = intern_msg;
+            auto inserted = all_msgs.insert(*intern_msg);
+            if (!inserted.second) {  // same id pushed again, replace the old one
+                replaced.reset(&*inserted.first, false);
+                all_msgs.replace_node(inserted.first, *intern_msg);
+            }
+            intrusive_ptr_add_ref(intern_msg.get());
+        }
+        if (replaced) {
+            untrack(*replaced);
+            release(*replaced);
+        }
+        if (intern_msg->expires_at > 0) {
+            PORK_LOCK(expiring_msgs_mtx);
+            expiring_msgs.insert(intern_msg->expires_at, id_t(intern_msg->id));
+        }
+
+        if (critical_path && intern_msg->msg.__isset.resolve_dep) {
+            PORK_LOCK(all_deps_mtx);
+            auto dep_iter = all_deps.find(intern_msg->msg.resolve_dep);
+            if (dep_iter == all_deps.end()) {
+                dep_iter = all_deps.emplace(std::piecewise_construct,
+                        std::forward_as_tuple(intern_msg->msg.resolve_dep),
+                        std::forward_as_tuple()).first;
+                charge_dependency(intern_msg->msg.resolve_dep);
+            }
+            intern_msg->resolves = &dep_iter->second;
         }
 
         if (deps.empty()) {  // free message
-            push_free_message(intern_msg);
+            push_free_message(std::move(intern_msg));
             return;
         }
 
@@ -50,93 +566,948 @@ namespace pork {
             // it must be aware that after the msg is pushed to all_deps, other threads
             // might resolve this dep immediately and might free this msg
             PORK_LOCK(all_deps_mtx);
-            for (auto dep : deps) {
-                // will create a null unique_ptr if not exists
-                auto& intern_dep = all_deps[dep.key];
-                if (intern_dep.get() == nullptr) {
-                    intern_dep.reset(new InternalDependency());
+            for (auto& dep : deps) {
+                auto dep_iter = all_deps.find(dep.key);
+                if (dep_iter == all_deps.end()) {
+                    dep_iter = all_deps.emplace(std::piecewise_construct,
+                            std::forward_as_tuple(dep.key), std::forward_as_tuple()).first;
+                    charge_dependency(dep.key);
                 }
-                int n_needed = dep.n - intern_dep->n_resolved;
-                if (n_needed > 0) {
-                    intern_msg->n_deps += n_needed;
-                    intern_dep->dependants.push_back(intern_msg);
+                auto& intern_dep = dep_iter->second;
+                if (dep.n > intern_dep.n_resolved) {
+                    ++intern_msg->n_deps;
+                    intern_dep.dependants.emplace_back(dep.n, intern_msg);
+                    std::push_heap(intern_dep.dependants.begin(),
+                            intern_dep.dependants.end(), InternalDependency::heap_cmp);
+                    size_t n = intern_dep.dependants.size();
+                    intern_dep.n_dependants = n;
+                    if (critical_path && dependants_band(n) > dependants_band(n - 1)) {
+                        PORK_LOCK(free_msgs_mtx);
+                        raise_resolvers(intern_dep);
+                    }
+                } else {
+                    join_results(intern_dep, dep.n, *intern_msg);
                 }
             }
 
             if (intern_msg->n_deps == 0) {  // check if there are really some deps
-                push_free_message(intern_msg);
+                push_free_message(std::move(intern_msg));
             }
         }
     }
 
     void MessageQueue::ack(id_t msg_id)
     {
-        PORK_RLOCK(rlock_, all_msgs_mtx);
-        auto msg = all_msgs.at(msg_id);
-        rlock_all_msgs_mtx.unlock();
-
-        if (msg->state != MessageState::IN_PROGRESS) {
+        auto msg = take_in_progress(msg_id, MessageState::ACKED);
+        if (!msg) {
             return;
         }
+        untrack(*msg);
+        if (hedge_percentile != 0) {
+            add_out_time(*msg);
+        }
+        SharedPayloadPtr result;
+        if (msg->msg.__isset.resolve_dep && msg->msg.join) {
+            // before release, which drops a spilled payload
+            result = take_result(*msg);
+        }
+        release(*msg);
+        leave_lane(*msg);
+        if (msg->msg.__isset.resolve_dep) {
+            resolve(msg->msg.resolve_dep, result);
+        }
+    }
 
-        msg->state = MessageState::ACKED;
-        if (msg->msg->__isset.resolve_dep) {
-            PORK_ULOCK(ulock_, all_deps_mtx);
-            auto dep_iter = all_deps.find(msg->msg->resolve_dep);
-            if (dep_iter == all_deps.end()) {
-                PORK_ULOCK_UPGRADE(ulock_all_deps_mtx);
-                all_deps[msg->msg->resolve_dep].reset(new InternalDependency(1));
-            } else {
-                auto& dep = dep_iter->second;
-                ++dep->n_resolved;
+    void MessageQueue::requeue(id_t msg_id)
+    {
+        take_back(msg_id, nullptr);
+    }
+
+    void MessageQueue::take_back(id_t msg_id, const uint64_t* taken_by)
+    {
+        InternalMessagePtr msg;
+        {
+            PORK_RLOCK(rlock_, all_msgs_mtx);
+            auto iter = all_msgs.find(msg_id, IdCompare());
+            if (iter == all_msgs.end()) {
+                return;
+            }
+            if (taken_by != nullptr && iter->taken_by != *taken_by) {
+                return;  // out to someone else by now
+            }
+            bool hedged = iter->hedged;
+            if (hedged && --iter->n_out > 0) {
+                return;  // the other attempt carries on
+            }
+            auto expected = MessageState::IN_PROGRESS;
+            if (!iter->state.compare_exchange_strong(expected, MessageState::QUEUING)) {
+                if (hedged && expected == MessageState::QUEUING) {
+                    // the other attempt, yet to be taken, is the retry of this one
+                    untrack(*iter);
+                }
+                return;
+            }
+            if (!hedged) {
+                --iter->n_out;
+            }
+            msg.reset(&*iter);
+        }
+        untrack(*msg);
+        PORK_LOCK(free_msgs_mtx);
+        ReadyQueue* ready;
+        if (msg->holds_lane) {  // still the one out for its key
+            ready = &ready_queue_of(*msg);
+            ready->push(std::move(msg));
+        } else {
+            ready = make_ready(std::move(msg));
+        }
+        if (ready != nullptr && ready->size() == 1) {
+            notify_ready();
+        }
+    }
 
-                // using two loops to avoid unnecessary lock upgrade
-                // or temporary list creation when there's no new free msg
+    void MessageQueue::resolve(const std::string& key, const SharedPayloadPtr& result)
+    {
+        PORK_ULOCK(ulock_, all_deps_mtx);
+        auto dep_iter = all_deps.find(key);
+        if (dep_iter == all_deps.end()) {
+            PORK_ULOCK_UPGRADE(ulock_all_deps_mtx);
+            auto& dep = all_deps[key];
+            dep.n_resolved = 1;
+            charge_dependency(key);
+            keep_result(dep, result);
+        } else {
+            auto& dep = dep_iter->second;
+            int n_resolved = ++dep.n_resolved;
+
+            // only upgrade the lock when some dependant is satisfied, or there
+            // is a result to keep
+            auto& heap = dep.dependants;
+            bool satisfies = !heap.empty() && heap.front().first <= n_resolved;
+            if (satisfies || result) {
+                PORK_ULOCK_UPGRADE(ulock_all_deps_mtx);
+                keep_result(dep, result);
+                if (!satisfies) {
+                    return;
+                }
+                PORK_LOCK(free_msgs_mtx);
                 bool has_free_msg = false;
-                for (auto dependant : dep->dependants) {
-                    if (--dependant->n_deps == 0) {
+                while (!heap.empty() && heap.front().first <= n_resolved) {
+                    std::pop_heap(heap.begin(), heap.end(), InternalDependency::heap_cmp);
+                    auto dependant = std::move(heap.back());
+                    heap.pop_back();
+                    dep.n_dependants = heap.size();
+                    join_results(dep, dependant.first, *dependant.second);
+                    if (--dependant.second->n_deps == 0) {
+                        // push_free_message is not used here to avoid
+                        // repeatedly locking-unlocking free_msgs_mtx
+                        make_free(std::move(dependant.second));
                         has_free_msg = true;
                     }
                 }
-
                 if (has_free_msg) {
-                    PORK_ULOCK_UPGRADE(ulock_all_deps_mtx);
-                    PORK_LOCK(free_msgs_mtx);
-                    auto i = dep->dependants.begin();
-                    while (i != dep->dependants.end()) {
-                        if ((*i)->n_deps == 0) {
-                            // push_free_message is not used here to avoid
-                            // repeatedly locking-unlocking free_msgs_mtx
-                            free_msgs.push(*i);
-                            i = dep->dependants.erase(i);
-                        } else {
-                            ++i;
-                        }
-                    }
                     // we are not sure if there was only one free msg being added,
-                    // just notify all
-                    free_msgs_not_empty_cv.notify_all();
+                    // or if it was delayed, just notify all
+                    notify_ready();
                 }
             }
         }
     }
 
+    SharedPayloadPtr MessageQueue::take_result(InternalMessage& msg)
+    {
+        if (!msg.shared_payload && msg.hedged) {
+            // the other attempt may be copying the payload out, leave it be
+            boost::intrusive_ptr<SharedPayload> result(new SharedPayload());
+            result->data = msg.msg.payload;
+            result->compression = msg.msg.compression;
+            return result;
+        }
+        if (!msg.shared_payload) {
+            boost::intrusive_ptr<SharedPayload> result(new SharedPayload());
+            result->compression = msg.msg.compression;
+            if (msg.spilled) {
+                spill_store->read(msg.spill_loc, result->data);
+            } else {
+                // charged the same as the payload it replaces
+                result->data.swap(msg.msg.payload);
+                result->share = result->data.size();
+            }
+            msg.shared_payload = result;
+        }
+        return msg.shared_payload;
+    }
+
+    void MessageQueue::keep_result(InternalDependency& dep, const SharedPayloadPtr& result)
+    {
+        if (result) {
+            dep.results.push_back(result);
+            dependency_bytes += result->data.size();
+            budget->used_bytes += result->data.size();
+        }
+    }
+
+    void MessageQueue::join_results(InternalDependency& dep, int n, InternalMessage& msg)
+    {
+        size_t n_joined = std::min(size_t(std::max(n, 0)), dep.results.size());
+        if (n_joined == 0) {
+            return;
+        }
+        msg.joined.insert(msg.joined.end(),
+                dep.results.begin(), dep.results.begin() + n_joined);
+        if (dep.dependants.empty()) {
+            size_t n_bytes = 0;
+            for (auto& result : dep.results) {
+                n_bytes += result->data.size();
+            }
+            dependency_bytes -= n_bytes;
+            budget->used_bytes -= n_bytes;
+            dep.results.clear();
+        }
+    }
+
     void MessageQueue::fail(id_t msg_id)
     {
-        PORK_RLOCK(rlock_, all_msgs_mtx);
-        all_msgs.at(msg_id)->state = MessageState::FAILED;
+        auto msg = take_in_progress(msg_id, MessageState::FAILED);
+        if (msg) {
+            untrack(*msg);
+            release(*msg);
+            leave_lane(*msg);
+        }
     }
 
-    void MessageQueue::push_free_message(const std::shared_ptr<InternalMessage>& msg)
+    void MessageQueue::remove_consumer(const std::string& consumer_id)
     {
         PORK_LOCK(free_msgs_mtx);
-        free_msgs.push(msg);
-        if (free_msgs.size() == 1) {
+        auto iter = consumers.find(consumer_id);
+        if (iter != consumers.end()) {
+            erase_consumer(iter);
+        }
+    }
+
+    void MessageQueue::drop_consumer(const std::string& consumer_id)
+    {
+        // it might have been timed out or left already
+        uint64_t hash = consumer_hash(consumer_id);
+        remove_consumer(consumer_id);
+        std::vector<id_t> ids;
+        {
+            PORK_LOCK(taken_msgs_mtx);
+            auto iter = taken_msgs.find(hash);
+            if (iter == taken_msgs.end()) {
+                return;
+            }
+            ids.assign(iter->second.begin(), iter->second.end());
+            taken_msgs.erase(iter);
+        }
+        for (id_t id : ids) {
+            take_back(id, &hash);
+        }
+    }
+
+    void MessageQueue::track(InternalMessage& msg, uint64_t hash)
+    {
+        uint64_t previous = msg.taken_by.exchange(hash);
+        if (previous == 0 && hash == 0) {
+            return;  // anonymous consumers are not tracked
+        }
+        PORK_LOCK(taken_msgs_mtx);
+        if (previous != 0 && previous != hash) {
+            // a hedged message taken again, it comes back with its last attempt
+            auto iter = taken_msgs.find(previous);
+            if (iter != taken_msgs.end()) {
+                iter->second.erase(msg.id);
+                if (iter->second.empty()) {
+                    taken_msgs.erase(iter);
+                }
+            }
+        }
+        if (hash != 0) {
+            taken_msgs[hash].insert(msg.id);
+        }
+    }
+
+    void MessageQueue::untrack(const InternalMessage& msg)
+    {
+        uint64_t hash = msg.taken_by;
+        if (hash == 0) {
+            return;
+        }
+        PORK_LOCK(taken_msgs_mtx);
+        auto iter = taken_msgs.find(hash);
+        if (iter != taken_msgs.end()) {
+            iter->second.erase(msg.id);
+            if (iter->second.empty()) {
+                taken_msgs.erase(iter);
+            }
+        }
+    }
+
+    void MessageQueue::configure(const QueueOptions& options)
+    {
+        {
+            PORK_LOCK(free_msgs_mtx);
+            starvation_limit = options.starvation_limit;
+            free_msgs.set_starvation_limit(starvation_limit);
+            for (auto& consumer : consumers) {
+                consumer.second.msgs.set_starvation_limit(starvation_limit);
+            }
+            ordered = options.ordered;
+            if (!ordered) {
+                clear_lanes();
+            }
+            hedge_percentile = std::min(std::max(options.hedge_percentile, 0), 100);
+            if (hedge_percentile == 0) {
+                out_msgs.clear();
+            }
+        }
+        hedge_min_ms = options.hedge_min_ms;
+        critical_path = options.critical_path;
+        default_ttl_ms = options.ttl_ms;
+        PORK_LOCK(limits_mtx);
+        this->options = options;
+        not_full_cv.notify_all();  // the limits might have been raised
+    }
+
+    void MessageQueue::get_stats(QueueStats& stats)
+    {
+        {
+            PORK_LOCK(limits_mtx);
+            stats.n_messages = n_msgs;
+            stats.payload_bytes = payload_bytes;
+            stats.message_bytes = n_bytes;
+            stats.n_spilled = n_spilled;
+            stats.spilled_bytes = spilled_bytes;
+        }
+        {
+            PORK_LOCK(free_msgs_mtx);
+            release_delayed();
+            stats.n_free = n_ready();
+            stats.n_delayed = delayed_msgs.size();
+            stats.n_consumers = consumers.size();
+            stats.n_lanes = lanes.size();
+            stats.n_hedged = n_hedged;
+        }
+        {
+            PORK_RLOCK(rlock_, all_deps_mtx);
+            stats.n_dependencies = all_deps.size();
+        }
+        stats.dependency_bytes = dependency_bytes;
+        stats.n_dropped = n_dropped;
+        stats.n_rejected = n_rejected;
+        stats.n_expired = n_expired;
+    }
+
+    void MessageQueue::expire_messages()
+    {
+        int64_t now = now_ms();
+        int64_t hedge_after = hedge_percentile != 0 ? hedge_after_ms() : -1;
+        std::vector<id_t> stragglers;
+        {
+            PORK_LOCK(free_msgs_mtx);
+            // nobody fetching from several queues polls for the due messages
+            size_t n = n_ready();
+            release_delayed();
+            if (n_ready() > n) {
+                notify_ready();
+            }
+            for (auto iter = consumers.begin(); iter != consumers.end();) {
+                auto& consumer = iter->second;
+                if (consumer.n_fetching == 0
+                        && now - consumer.last_seen > CONSUMER_TIMEOUT_MS) {
+                    erase_consumer(iter++);
+                } else {
+                    ++iter;
+                }
+            }
+            // without enough samples to hedge by, only forget the messages
+            // surely done with
+            int64_t cutoff = now - (hedge_after < 0 ? CONSUMER_TIMEOUT_MS : hedge_after);
+            while (!out_msgs.empty() && out_msgs.front().first <= cutoff) {
+                if (hedge_after >= 0) {
+                    stragglers.push_back(out_msgs.front().second);
+                }
+                out_msgs.pop_front();
+            }
+        }
+        for (id_t id : stragglers) {
+            hedge(id, now - hedge_after);
+        }
+        std::vector<id_t> ids;
+        {
+            PORK_LOCK(expiring_msgs_mtx);
+            expiring_msgs.advance(now, [&ids] (id_t& id) { ids.push_back(id); });
+        }
+
+        for (id_t id : ids) {
+            InternalMessagePtr msg;
+            {
+                PORK_RLOCK(rlock_, all_msgs_mtx);
+                auto iter = all_msgs.find(id, IdCompare());
+                // already done with, or replaced by a message expiring later
+                if (iter == all_msgs.end() || iter->hedged
+                        || iter->expires_at == 0 || iter->expires_at > now) {
+                    continue;
+                }
+                auto expected = MessageState::QUEUING;
+                if (!iter->state.compare_exchange_strong(expected, MessageState::EXPIRED)) {
+                    continue;
+                }
+                msg.reset(&*iter);
+            }
+            finish_expiry(std::move(msg));
+        }
+    }
+
+    void MessageQueue::finish_expiry(InternalMessagePtr&& msg)
+    {
+        {
+            PORK_LOCK(all_msgs_mtx);
+            auto iter = all_msgs.find(msg->id, IdCompare());
+            if (iter == all_msgs.end() || &*iter != msg.get()) {
+                return;  // replaced, and released by then
+            }
+            all_msgs.erase(iter);
+        }
+        intrusive_ptr_release(msg.get());  // the reference held by all_msgs
+        release(*msg);
+        leave_lane(*msg);
+        ++n_expired;
+        if (msg->msg.__isset.resolve_dep) {
+            resolve(msg->msg.resolve_dep);
+        }
+        // nobody reads an expired message, free what it holds while the husk
+        // lingers in free_msgs or all_deps
+        std::string().swap(msg->msg.payload);
+        msg->shared_payload.reset();
+    }
+
+    void MessageQueue::notify_ready()
+    {
+        free_msgs_not_empty_cv.notify_all();
+        if (ready_signal) {
+            ready_signal->notify();
+        }
+    }
+
+    void MessageQueue::push_free_message(InternalMessagePtr&& msg)
+    {
+        PORK_LOCK(free_msgs_mtx);
+        size_t n_delayed = delayed_msgs.size();
+        int64_t next_due = n_delayed != 0 ? delayed_msgs.next_due_ms() : INT64_MAX;
+        ReadyQueue* ready = make_free(std::move(msg));
+        // the waiting threads have to wake up earlier for it
+        bool earlier_due = !delayed_msgs.empty() && delayed_msgs.next_due_ms() < next_due;
+        if ((ready != nullptr && ready->size() == 1) || earlier_due) {
             // must notify all here. consider multiple threads waiting while
             // multiple threads pushing msgs, and the pushing threads are
             // all scheduled before the (woken) waiting threads
-            free_msgs_not_empty_cv.notify_all();
+            notify_ready();
+        }
+    }
+
+    ReadyQueue* MessageQueue::make_free(InternalMessagePtr&& msg)
+    {
+        if (msg->state != MessageState::QUEUING) {
+            return nullptr;  // expired while waiting for its dependencies
+        }
+        if (msg->msg.__isset.not_before && msg->msg.not_before > now_ms()) {
+            release_delayed();
+            if (delayed_msgs.insert(msg->msg.not_before, std::move(msg))) {
+                return nullptr;
+            }
+        }
+        return make_ready(std::move(msg));
+    }
+
+    ReadyQueue* MessageQueue::make_ready(InternalMessagePtr&& msg)
+    {
+        if (msg->state != MessageState::QUEUING) {
+            return nullptr;  // expired while delayed, it must not take a lane
+        }
+        if (ordered && msg->msg.__isset.partition_key) {
+            auto inserted = lanes.emplace(msg->partition_hash, Lane());
+            Lane& lane = inserted.first->second;
+            if (!inserted.second) {  // another message of the key is out
+                InternalMessage* last = msg.get();
+                if (lane.last != nullptr) {
+                    lane.last->next_in_lane = std::move(msg);
+                } else {
+                    lane.first = std::move(msg);
+                }
+                lane.last = last;
+                return nullptr;
+            }
+            msg->holds_lane = true;
+        }
+        if (msg->resolves != nullptr && critical_path) {
+            msg->band = std::max(msg->band, dependants_band(msg->resolves->n_dependants));
+            auto& resolvers = msg->resolves->ready_resolvers;
+            if (msg->resolver_pos < 0) {
+                msg->resolver_pos = resolvers.size();
+                resolvers.push_back(msg);
+            }
+        }
+        ReadyQueue& ready = ready_queue_of(*msg);
+        ready.push(std::move(msg));
+        return &ready;
+    }
+
+    void MessageQueue::raise_resolvers(InternalDependency& dep)
+    {
+        int band = dependants_band(dep.n_dependants);
+        bool raised = false;
+        for (auto& msg : dep.ready_resolvers) {
+            if (msg->band < band && msg->state == MessageState::QUEUING) {
+                int old_band = msg->band;
+                msg->band = band;
+                ready_queue_of(*msg).raise(InternalMessagePtr(msg), old_band);
+                raised = true;
+            }
         }
+        if (raised) {
+            notify_ready();
+        }
+    }
+
+    void MessageQueue::forget_resolver(InternalMessage& msg)
+    {
+        if (msg.resolver_pos < 0) {
+            return;
+        }
+        auto& resolvers = msg.resolves->ready_resolvers;
+        if (size_t(msg.resolver_pos) != resolvers.size() - 1) {
+            resolvers[msg.resolver_pos] = std::move(resolvers.back());
+            resolvers[msg.resolver_pos]->resolver_pos = msg.resolver_pos;
+        }
+        resolvers.pop_back();
+        msg.resolver_pos = -1;
+    }
+
+    void MessageQueue::leave_lane(InternalMessage& msg)
+    {
+        if (!msg.msg.__isset.partition_key || !ordered) {
+            return;
+        }
+        PORK_LOCK(free_msgs_mtx);
+        if (!msg.holds_lane) {
+            return;
+        }
+        msg.holds_lane = false;
+        auto iter = lanes.find(msg.partition_hash);
+        if (iter == lanes.end()) {
+            return;
+        }
+        Lane& lane = iter->second;
+        while (lane.first) {
+            InternalMessagePtr next = std::move(lane.first);
+            lane.first = std::move(next->next_in_lane);
+            if (!lane.first) {
+                lane.last = nullptr;
+            }
+            if (next->state == MessageState::QUEUING) {  // skips the expired ones
+                next->holds_lane = true;
+                ReadyQueue& ready = ready_queue_of(*next);
+                ready.push(std::move(next));
+                if (ready.size() == 1) {
+                    notify_ready();
+                }
+                return;
+            }
+        }
+        lanes.erase(iter);
+    }
+
+    void MessageQueue::clear_lanes()
+    {
+        for (auto& lane : lanes) {
+            while (lane.second.first) {
+                InternalMessagePtr next = std::move(lane.second.first);
+                lane.second.first = std::move(next->next_in_lane);
+                if (next->state == MessageState::QUEUING) {
+                    ready_queue_of(*next).push(std::move(next));
+                }
+            }
+        }
+        if (!lanes.empty()) {
+            lanes.clear();
+            notify_ready();
+        }
+    }
+
+    void MessageQueue::release_delayed()
+    {
+        if (delayed_msgs.empty()) {
+            return;
+        }
+        size_t n_released = 0;
+        delayed_msgs.advance(now_ms(), [this, &n_released] (InternalMessagePtr& msg) {
+            n_released += make_ready(std::move(msg)) != nullptr;
+        });
+        if (n_released > 1) {
+            // the caller takes at most one of them
+            notify_ready();
+        }
+    }
+
+    ReadyQueue& MessageQueue::ready_queue_of(const InternalMessage& msg)
+    {
+        if (!msg.msg.__isset.partition_key || consumers.empty()) {
+            return free_msgs;
+        }
+        // the consumer with the highest score owns the key, so a consumer
+        // coming or going only moves the keys it wins or owned
+        Consumer* owner = nullptr;
+        uint64_t owner_score = 0;
+        for (auto& consumer : consumers) {
+            uint64_t score = mix64(msg.partition_hash ^ consumer.second.hash);
+            if (owner == nullptr || score > owner_score) {
+                owner = &consumer.second;
+                owner_score = score;
+            }
+        }
+        return owner->msgs;
+    }
+
+    ReadyQueue* MessageQueue::next_ready_queue(Consumer* consumer)
+    {
+        if (consumer == nullptr || consumer->msgs.empty()) {
+            return free_msgs.empty() ? nullptr : &free_msgs;
+        }
+        if (free_msgs.empty()) {
+            return &consumer->msgs;
+        }
+        // the higher priority first, then the older message
+        auto& own = consumer->msgs.peek();
+        auto& shared = free_msgs.peek();
+        if (own->band != shared->band) {
+            return own->band > shared->band ? &consumer->msgs : &free_msgs;
+        }
+        return own->id < shared->id ? &consumer->msgs : &free_msgs;
+    }
+
+    ReadyQueue& MessageQueue::fullest_ready_queue()
+    {
+        ReadyQueue* fullest = &free_msgs;
+        for (auto& consumer : consumers) {
+            if (consumer.second.msgs.size() > fullest->size()) {
+                fullest = &consumer.second.msgs;
+            }
+        }
+        return *fullest;
+    }
+
+    MessageQueue::Consumer* MessageQueue::find_consumer(const std::string& consumer_id)
+    {
+        if (consumer_id.empty()) {
+            return nullptr;
+        }
+        auto iter = consumers.find(consumer_id);
+        return iter == consumers.end() ? nullptr : &iter->second;
+    }
+
+    MessageQueue::ConsumerMap::iterator MessageQueue::add_consumer(
+            const std::string& consumer_id)
+    {
+        auto iter = consumers.emplace(consumer_id, Consumer()).first;
+        Consumer& consumer = iter->second;
+        consumer.hash = consumer_hash(consumer_id);
+        consumer.msgs.set_starvation_limit(starvation_limit);
+        consumer.msgs.set_counter(&n_ready_msgs);
+        consumer.last_seen = now_ms();
+
+        // the new consumer takes the keys it wins over from the others,
+        // nothing moves between them
+        std::vector<InternalMessagePtr> taken;
+        auto wins = [this, &consumer] (const InternalMessagePtr& msg) {
+            return msg->msg.__isset.partition_key && &ready_queue_of(*msg) == &consumer.msgs;
+        };
+        free_msgs.extract_if(wins, taken);
+        for (auto& other : consumers) {
+            if (&other.second != &consumer) {
+                other.second.msgs.extract_if(wins, taken);
+            }
+        }
+        for (auto& msg : taken) {
+            consumer.msgs.push(std::move(msg));
+        }
+        return iter;
+    }
+
+    void MessageQueue::erase_consumer(ConsumerMap::iterator iter)
+    {
+        std::vector<InternalMessagePtr> orphans;
+        iter->second.msgs.extract_if(
+                [] (const InternalMessagePtr&) { return true; }, orphans);
+        consumers.erase(iter);
+        for (auto& msg : orphans) {
+            ready_queue_of(*msg).push(std::move(msg));
+        }
+        if (!orphans.empty()) {
+            notify_ready();
+        }
+    }
+
+    InternalMessagePtr MessageQueue::take_in_progress(
+            id_t msg_id, MessageState new_state)
+    {
+        PORK_LOCK(all_msgs_mtx);
+        auto iter = all_msgs.find(msg_id, IdCompare());
+        if (iter == all_msgs.end()) {  // unknown, or already acked or failed
+            return nullptr;
+        }
+        if (iter->hedged && new_state == MessageState::FAILED) {
+            if (--iter->n_out > 0) {
+                return nullptr;  // the other attempt may still succeed
+            }
+            if (iter->state == MessageState::QUEUING) {
+                // the other attempt, yet to be taken, is the retry of this one.
+                // a hedged message is not hedged again
+                untrack(*iter);
+                return nullptr;
+            }
+        }
+        auto expected = MessageState::IN_PROGRESS;
+        if (!iter->state.compare_exchange_strong(expected, new_state)) {
+            // a hedged message is done with by its first attempt even while
+            // the second one is yet to be taken
+            if (!iter->hedged || expected != MessageState::QUEUING
+                    || !iter->state.compare_exchange_strong(expected, new_state)) {
+                return nullptr;
+            }
+        }
+        InternalMessage& msg = *iter;
+        all_msgs.erase(iter);
+        // takes over the reference held by all_msgs
+        return InternalMessagePtr(&msg, false);
+    }
+
+    int64_t MessageQueue::hedge_after_ms()
+    {
+        std::vector<int64_t> times;
+        {
+            PORK_LOCK(hedge_mtx);
+            if (out_times.size() < MIN_OUT_TIMES) {
+                return -1;
+            }
+            times = out_times;
+        }
+        auto nth = times.begin() + (times.size() - 1) * hedge_percentile / 100;
+        std::nth_element(times.begin(), nth, times.end());
+        return std::max<int64_t>(*nth, hedge_min_ms);
+    }
+
+    void MessageQueue::add_out_time(const InternalMessage& msg)
+    {
+        if (msg.out_at == 0) {
+            return;  // handed out before hedging was turned on
+        }
+        int64_t out_time = now_ms() - msg.out_at;
+        PORK_LOCK(hedge_mtx);
+        if (out_times.size() < N_OUT_TIMES) {
+            out_times.push_back(out_time);
+        } else {
+            out_times[next_out_time] = out_time;
+            next_out_time = (next_out_time + 1) % N_OUT_TIMES;
+        }
+    }
+
+    void MessageQueue::hedge(id_t msg_id, int64_t cutoff)
+    {
+        PORK_LOCK(free_msgs_mtx);
+        InternalMessagePtr msg;
+        {
+            // under the write lock, so that take_back and take_in_progress see
+            // hedged, n_out and the state change together
+            PORK_LOCK(all_msgs_mtx);
+            auto iter = all_msgs.find(msg_id, IdCompare());
+            // a spilled payload is dropped by the first ack, maybe while the other
+            // attempt reads it
+            if (iter == all_msgs.end() || iter->hedged || iter->spilled
+                    || iter->out_at > cutoff) {
+                return;
+            }
+            auto expected = MessageState::IN_PROGRESS;
+            if (!iter->state.compare_exchange_strong(expected, MessageState::QUEUING)) {
+                return;
+            }
+            iter->hedged = true;
+            msg.reset(&*iter);
+        }
+        ++n_hedged;
+        // to whoever asks first, the owner of its key might be the one stuck
+        free_msgs.push(std::move(msg));
+        if (free_msgs.size() == 1) {
+            notify_ready();
+        }
+    }
+
+    bool MessageQueue::admit(size_t n_msgs, size_t n_bytes, size_t payload_bytes,
+            bool spillable)
+    {
+        boost::unique_lock<boost::mutex> lock(limits_mtx);
+        auto deadline = boost::chrono::steady_clock::now()
+            + boost::chrono::milliseconds(options.block_ms);
+        bool spill = false;
+        while (!has_room(n_msgs, n_bytes)) {
+            if (options.overflow_policy == OverflowPolicy::DROP_OLDEST && drop_oldest()) {
+                continue;
+            }
+            // new messages are behind the older ones of their priority, or
+            // still waiting for their dependencies, so their payloads are the
+            // coldest
+            if (options.overflow_policy == OverflowPolicy::SPILL && spillable
+                    && payload_bytes > 0
+                    && has_room(n_msgs, n_bytes - payload_bytes)) {
+                spill = true;
+                break;
+            }
+            auto now = boost::chrono::steady_clock::now();
+            if (now >= deadline) {
+                ++n_rejected;
+                Overloaded e;
+                e.retry_after_ms = OVERLOADED_RETRY_AFTER_MS;
+                throw e;
+            }
+            ++n_blocked_producers;
+            not_full_cv.wait_until(lock, std::min(deadline,
+                        now + boost::chrono::milliseconds(BUDGET_POLL_MS)));
+            --n_blocked_producers;
+        }
+        if (spill) {
+            if (!spill_store) {
+                spill_store.reset(new SegmentStore(spill_dir, spill_prefix()));
+            }
+            n_bytes -= payload_bytes;
+            this->n_spilled += n_msgs;
+            this->spilled_bytes += payload_bytes;
+            payload_bytes = 0;
+        }
+        this->n_msgs += n_msgs;
+        this->n_bytes += n_bytes;
+        this->payload_bytes += payload_bytes;
+        budget->used_bytes += n_bytes;
+        return spill;
+    }
+
+    bool MessageQueue::has_room(size_t n_msgs, size_t n_bytes) const
+    {
+        // a group larger than the limits of the queue is not starved, but the
+        // broker-wide budget is a hard cap
+        bool queue_room = this->n_msgs == 0
+            || ((options.max_messages <= 0
+                        || this->n_msgs + n_msgs <= size_t(options.max_messages))
+                && (options.max_bytes <= 0
+                        || this->n_bytes + n_bytes <= size_t(options.max_bytes)));
+        int64_t max_budget = budget->max_bytes;
+        return queue_room && (max_budget <= 0
+                || budget->used_bytes + int64_t(n_bytes) <= max_budget);
+    }
+
+    void MessageQueue::cancel_spill(size_t n_msgs, size_t n_bytes, size_t spilled_bytes)
+    {
+        PORK_LOCK(limits_mtx);
+        this->n_msgs -= n_msgs;
+        this->n_bytes -= n_bytes;
+        this->n_spilled -= n_msgs;
+        this->spilled_bytes -= spilled_bytes;
+        budget->used_bytes -= n_bytes;
+        if (n_blocked_producers > 0) {
+            not_full_cv.notify_all();
+        }
+    }
+
+    void MessageQueue::cancel_admission(size_t n_msgs, size_t n_bytes,
+            size_t payload_bytes)
+    {
+        PORK_LOCK(limits_mtx);
+        this->n_msgs -= n_msgs;
+        this->n_bytes -= n_bytes;
+        this->payload_bytes -= payload_bytes;
+        budget->used_bytes -= n_bytes;
+        if (n_blocked_producers > 0) {
+            not_full_cv.notify_all();
+        }
+    }
+
+    void MessageQueue::release(const InternalMessage& msg)
+    {
+        PORK_LOCK(limits_mtx);
+        uncharge(msg);
+        if (n_blocked_producers > 0) {
+            not_full_cv.notify_all();
+        }
+    }
+
+    void MessageQueue::uncharge(const InternalMessage& msg)
+    {
+        --n_msgs;
+        n_bytes -= msg.n_bytes;
+        payload_bytes -= msg.payload_size();
+        budget->used_bytes -= msg.n_bytes;
+        if (msg.spilled) {
+            --n_spilled;
+            spilled_bytes -= msg.spill_loc.length;
+            spill_store->release(msg.spill_loc);
+        }
+    }
+
+    bool MessageQueue::drop_oldest()
+    {
+        InternalMessagePtr msg;
+        {
+            PORK_LOCK(free_msgs_mtx);
+            while (!msg) {
+                auto& ready = fullest_ready_queue();
+                if (ready.empty()) {
+                    return false;
+                }
+                msg = ready.pop_lowest();
+                forget_resolver(*msg);
+                auto expected = MessageState::QUEUING;
+                bool first_out = false;
+                if (msg->hedged) {
+                    // n_out only drops under all_msgs_mtx
+                    PORK_RLOCK(rlock_, all_msgs_mtx);
+                    first_out = msg->n_out > 0;
+                    if (first_out) {
+                        // only the second attempt is dropped, the first one is still out
+                        msg->state.compare_exchange_strong(expected, MessageState::IN_PROGRESS);
+                    }
+                }
+                if (first_out) {
+                    msg.reset();
+                } else if (!msg->state.compare_exchange_strong(expected, MessageState::FAILED)) {
+                    msg.reset();  // an expired husk
+                }
+            }
+        }
+        bool current = false;
+        {
+            PORK_LOCK(all_msgs_mtx);
+            auto iter = all_msgs.find(msg->id, IdCompare());
+            // a replaced message has been released already, it only held its lane
+            if (iter != all_msgs.end() && &*iter == msg.get()) {
+                all_msgs.erase(iter);
+                current = true;
+            }
+        }
+        if (!current) {
+            leave_lane(*msg);
+            return true;  // nothing freed, but one less to look at
+        }
+        intrusive_ptr_release(msg.get());  // the reference held by all_msgs
+        uncharge(*msg);
+        leave_lane(*msg);
+        ++n_dropped;
+        return true;
+    }
+
+    void MessageQueue::charge_dependency(const std::string& key)
+    {
+        size_t n_bytes = dependency_cost(key);
+        this->dependency_bytes += n_bytes;
+        budget->used_bytes += n_bytes;
     }
 
 } /* pork */
@@ -0,0 +1,173 @@
+#include <algorithm>
+#include <cerrno>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/lock_factories.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
+#include "broker/segment_store.h"
+#include "common.h"
+
+namespace pork {
+
+    static std::system_error sys_error(const std::string& what)
+    {
+        return std::system_error(errno, std::system_category(), what);
+    }
+
+    SegmentStore::SegmentStore(const std::string& dir, const std::string& prefix,
+            size_t segment_size): dir(dir), prefix(prefix), segment_size(segment_size) {}
+
+    SegmentStore::~SegmentStore()
+    {
+        for (auto& seg : segments) {
+            munmap(const_cast<char*>(seg.second.map), seg.second.size);
+            ::close(seg.second.fd);
+        }
+    }
+
+    SegmentStore::Location SegmentStore::append(const std::string& data)
+    {
+        Location loc;
+        loc.length = data.size();
+        if (data.empty()) {
+            return loc;
+        }
+
+        int fd;
+        {  // reserve the space, the write itself is done without the lock
+            PORK_LOCK(segments_mtx);
+            auto iter = segments.find(active_segment);
+            if (iter == segments.end()
+                    || iter->second.n_written + data.size() > iter->second.size) {
+                if (iter != segments.end() && iter->second.n_live == 0) {
+                    remove_segment(iter);
+                }
+                create_segment(std::max(segment_size, data.size()));
+            }
+            auto& seg = segments[active_segment];
+            loc.segment = active_segment;
+            loc.offset = seg.n_written;
+            seg.n_written += data.size();
+            seg.n_live += data.size();  // keeps the segment around while writing
+            fd = seg.fd;
+        }
+
+        const char* p = data.data();
+        size_t n_left = data.size();
+        off_t offset = loc.offset;
+        while (n_left > 0) {
+            ssize_t n = pwrite(fd, p, n_left, offset);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                auto e = sys_error("Failed to write segment");
+                release(loc);
+                throw e;
+            }
+            p += n;
+            n_left -= n;
+            offset += n;
+        }
+        return loc;
+    }
+
+    bool SegmentStore::read(const Location& loc, std::string& data)
+    {
+        if (loc.length == 0) {
+            data.clear();
+            return true;
+        }
+        // the shared lock keeps the segment mapped while copying
+        PORK_RLOCK(rlock_, segments_mtx);
+        auto iter = segments.find(loc.segment);
+        if (iter == segments.end()) {
+            return false;
+        }
+        data.assign(iter->second.map + loc.offset, loc.length);
+        return true;
+    }
+
+    void SegmentStore::prefetch(const Location& loc)
+    {
+        if (loc.length == 0) {
+            return;
+        }
+        PORK_RLOCK(rlock_, segments_mtx);
+        auto iter = segments.find(loc.segment);
+        if (iter == segments.end()) {
+            return;
+        }
+        static const size_t page_size = sysconf(_SC_PAGESIZE);
+        size_t begin = loc.offset / page_size * page_size;
+        madvise(const_cast<char*>(iter->second.map) + begin,
+                loc.offset + loc.length - begin, MADV_WILLNEED);
+    }
+
+    void SegmentStore::release(const Location& loc)
+    {
+        if (loc.length == 0) {
+            return;
+        }
+        PORK_LOCK(segments_mtx);
+        auto iter = segments.find(loc.segment);
+        if (iter == segments.end()) {
+            return;
+        }
+        iter->second.n_live -= loc.length;
+        if (iter->second.n_live == 0 && loc.segment != active_segment) {
+            remove_segment(iter);
+        }
+    }
+
+    size_t SegmentStore::n_segments()
+    {
+        PORK_RLOCK(rlock_, segments_mtx);
+        return segments.size();
+    }
+
+    SegmentStore::Segment& SegmentStore::create_segment(size_t size)
+    {
+        uint32_t id = next_segment++;
+        std::string path = dir + "/" + prefix + "." + std::to_string(id) + ".seg";
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            throw sys_error("Failed to create segment " + path);
+        }
+        // only the descriptor is needed from now on
+        unlink(path.c_str());
+        if (ftruncate(fd, size) < 0) {
+            auto e = sys_error("Failed to size segment " + path);
+            ::close(fd);
+            throw e;
+        }
+        void* map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            auto e = sys_error("Failed to map segment " + path);
+            ::close(fd);
+            throw e;
+        }
+
+        auto& seg = segments[id];
+        seg.fd = fd;
+        seg.map = static_cast<const char*>(map);
+        seg.size = size;
+        active_segment = id;
+        return seg;
+    }
+
+    void SegmentStore::remove_segment(std::map<uint32_t, Segment>::iterator iter)
+    {
+        munmap(const_cast<char*>(iter->second.map), iter->second.size);
+        ::close(iter->second.fd);
+        segments.erase(iter);
+    }
+
+} /* pork */
@@ -0,0 +1,492 @@
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <new>
+#include <string>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <boost/smart_ptr.hpp>
+#include <thrift/transport/TTransport.h>
+
+#include "common.h"
+#include "shm_transport.h"
+
+using apache::thrift::transport::TTransport;
+using apache::thrift::transport::TTransportException;
+
+namespace pork {
+
+    static const uint32_t SHM_MAGIC = 0x6b726f70;  // "pork"
+    static const int SHM_WAIT_MS = 100;  // how often a blocked side checks its peer
+
+    struct SegmentHeader {
+        alignas(64) uint32_t magic;
+        uint32_t ring_size;
+    };
+
+    struct TShmTransport::Ring {
+        // advanced by the writer
+        alignas(64) std::atomic<uint64_t> head;
+        std::atomic<uint32_t> head_seq;  // futex word, bumped on every publish
+        std::atomic<uint32_t> reader_waiting;
+        // advanced by the reader
+        alignas(64) std::atomic<uint64_t> tail;
+        std::atomic<uint32_t> tail_seq;  // futex word, bumped on every consume
+        std::atomic<uint32_t> writer_waiting;
+        alignas(64) std::atomic<uint32_t> closed;
+
+        Ring(): head(0), head_seq(0), reader_waiting(0),
+            tail(0), tail_seq(0), writer_waiting(0), closed(0) {}
+
+        uint8_t* data() { return reinterpret_cast<uint8_t*>(this + 1); }
+    };
+
+    static size_t ring_bytes(uint32_t ring_size)
+    {
+        size_t n = sizeof(TShmTransport::Ring) + ring_size;
+        return (n + 63) / 64 * 64;
+    }
+
+    static size_t segment_bytes(uint32_t ring_size)
+    {
+        return sizeof(SegmentHeader) + 2 * ring_bytes(ring_size);
+    }
+
+    // returns false on timeout
+    static bool futex_wait(std::atomic<uint32_t>& word, uint32_t val, int timeout_ms)
+    {
+        struct timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        // not FUTEX_PRIVATE_FLAG, the word is shared with another process
+        long ret = syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word),
+                FUTEX_WAIT, val, &ts, nullptr, 0);
+        return ret == 0 || errno != ETIMEDOUT;
+    }
+
+    static void futex_wake(std::atomic<uint32_t>& word)
+    {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word),
+                FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+    static TTransportException sys_error(
+            TTransportException::TTransportExceptionType type, const std::string& what)
+    {
+        return TTransportException(type, what + ": " + std::strerror(errno));
+    }
+
+    static sockaddr_un make_addr(const std::string& path)
+    {
+        sockaddr_un addr;
+        std::memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) {
+            throw TTransportException(TTransportException::BAD_ARGS,
+                    "Unix socket path too long: " + path);
+        }
+        std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+        return addr;
+    }
+
+    static void send_fd(int sock_fd, int fd)
+    {
+        char byte = 0;
+        iovec iov = {&byte, 1};
+        char ctrl[CMSG_SPACE(sizeof(int))];
+        std::memset(ctrl, 0, sizeof(ctrl));
+        msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof(ctrl);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        if (sendmsg(sock_fd, &msg, MSG_NOSIGNAL) != 1) {
+            throw sys_error(TTransportException::NOT_OPEN, "Failed to send memfd");
+        }
+    }
+
+    static int recv_fd(int sock_fd)
+    {
+        char byte;
+        iovec iov = {&byte, 1};
+        char ctrl[CMSG_SPACE(sizeof(int))];
+        msghdr msg;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof(ctrl);
+        if (recvmsg(sock_fd, &msg, MSG_CMSG_CLOEXEC) != 1) {
+            throw sys_error(TTransportException::NOT_OPEN, "Failed to receive memfd");
+        }
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS) {
+            throw TTransportException(TTransportException::CORRUPTED_DATA,
+                    "No memfd in shm handshake");
+        }
+        int fd;
+        std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+        return fd;
+    }
+
+    TShmTransport::TShmTransport(const std::string& socket_path, uint32_t ring_size):
+        socket_path(socket_path),
+        ring_size(ring_size)
+    {
+    }
+
+    TShmTransport::TShmTransport(int sock_fd, int mem_fd):
+        sock_fd(sock_fd),
+        mem_fd(mem_fd)
+    {
+        try {
+            // the client must not be able to shrink the segment under our
+            // mapping, that would kill the broker with SIGBUS
+            int seals = fcntl(mem_fd, F_GET_SEALS);
+            if (seals < 0) {
+                throw sys_error(TTransportException::NOT_OPEN, "Failed to get memfd seals");
+            }
+            if ((seals & (F_SEAL_SHRINK | F_SEAL_GROW)) != (F_SEAL_SHRINK | F_SEAL_GROW)) {
+                throw TTransportException(TTransportException::CORRUPTED_DATA,
+                        "Shm segment is not sealed");
+            }
+            struct stat st;
+            if (fstat(mem_fd, &st) != 0) {
+                throw sys_error(TTransportException::NOT_OPEN, "Failed to stat memfd");
+            }
+            map_segment(st.st_size, false);
+            char ack = 0;
+            if (::send(sock_fd, &ack, 1, MSG_NOSIGNAL) != 1) {
+                throw sys_error(TTransportException::NOT_OPEN, "Failed to ack shm handshake");
+            }
+        } catch (...) {
+            close();
+            throw;
+        }
+    }
+
+    TShmTransport::~TShmTransport()
+    {
+        close();
+    }
+
+    bool TShmTransport::isOpen()
+    {
+        return segment != nullptr;
+    }
+
+    bool TShmTransport::peek()
+    {
+        if (!isOpen()) {
+            return false;
+        }
+        uint64_t tail = in->tail.load(std::memory_order_relaxed);
+        while (in->head.load(std::memory_order_acquire) == tail) {
+            if (in->closed) {
+                return false;
+            }
+            uint32_t seq = in->head_seq.load();
+            in->reader_waiting = 1;
+            bool woken = in->head.load() != tail
+                || futex_wait(in->head_seq, seq, SHM_WAIT_MS);
+            in->reader_waiting = 0;
+            if (!woken && !peer_alive()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void TShmTransport::open()
+    {
+        if (isOpen()) {
+            return;
+        }
+        try {
+            mem_fd = memfd_create("pork-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+            if (mem_fd < 0) {
+                throw sys_error(TTransportException::NOT_OPEN, "Failed to create memfd");
+            }
+            size_t size = segment_bytes(ring_size);
+            if (ftruncate(mem_fd, size) != 0) {
+                throw sys_error(TTransportException::NOT_OPEN, "Failed to size memfd");
+            }
+            if (fcntl(mem_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) != 0) {
+                throw sys_error(TTransportException::NOT_OPEN, "Failed to seal memfd");
+            }
+            map_segment(size, true);
+
+            sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (sock_fd < 0) {
+                throw sys_error(TTransportException::NOT_OPEN, "Failed to create socket");
+            }
+            sockaddr_un addr = make_addr(socket_path);
+            if (connect(sock_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+                throw sys_error(TTransportException::NOT_OPEN,
+                        "Failed to connect to " + socket_path);
+            }
+            send_fd(sock_fd, mem_fd);
+            char ack;
+            if (::recv(sock_fd, &ack, 1, 0) != 1) {
+                throw sys_error(TTransportException::NOT_OPEN, "Shm handshake rejected");
+            }
+        } catch (...) {
+            close();
+            throw;
+        }
+    }
+
+    void TShmTransport::close()
+    {
+        if (segment != nullptr) {
+            if (out) {
+                out->closed = 1;
+                futex_wake(out->head_seq);  // peer reading
+            }
+            if (in) {
+                in->closed = 1;
+                futex_wake(in->tail_seq);  // peer writing
+            }
+            munmap(segment, segment_size);
+            segment = nullptr;
+            in = out = nullptr;
+        }
+        if (sock_fd >= 0) {
+            ::close(sock_fd);
+            sock_fd = -1;
+        }
+        if (mem_fd >= 0) {
+            ::close(mem_fd);
+            mem_fd = -1;
+        }
+    }
+
+    uint32_t TShmTransport::read(uint8_t* buf, uint32_t len)
+    {
+        if (!isOpen()) {
+            throw TTransportException(TTransportException::NOT_OPEN, "Shm transport not open");
+        }
+        if (!peek()) {
+            return 0;  // EOF
+        }
+
+        uint64_t tail = in->tail.load(std::memory_order_relaxed);
+        uint64_t head = in->head.load(std::memory_order_acquire);
+        if (head - tail > ring_size) {  // the peer can write anything there
+            throw TTransportException(TTransportException::CORRUPTED_DATA,
+                    "Shm ring overrun");
+        }
+        uint32_t n = static_cast<uint32_t>(std::min<uint64_t>(len, head - tail));
+        uint32_t offset = tail % ring_size;
+        uint32_t first = std::min(n, ring_size - offset);
+        std::memcpy(buf, in->data() + offset, first);
+        std::memcpy(buf + first, in->data(), n - first);
+
+        in->tail.store(tail + n, std::memory_order_release);
+        in->tail_seq.fetch_add(1);
+        if (in->writer_waiting) {
+            futex_wake(in->tail_seq);
+        }
+        return n;
+    }
+
+    void TShmTransport::write(const uint8_t* buf, uint32_t len)
+    {
+        if (!isOpen()) {
+            throw TTransportException(TTransportException::NOT_OPEN, "Shm transport not open");
+        }
+        while (len > 0) {
+            if (out->closed) {
+                throw TTransportException(TTransportException::END_OF_FILE,
+                        "Shm peer has closed the connection");
+            }
+            uint64_t tail = out->tail.load(std::memory_order_acquire);
+            if (pending_head - tail > ring_size) {
+                throw TTransportException(TTransportException::CORRUPTED_DATA,
+                        "Shm ring overrun");
+            }
+            uint64_t space = ring_size - (pending_head - tail);
+            if (space == 0) {  // let the reader drain what we have got so far
+                publish();
+                uint32_t seq = out->tail_seq.load();
+                out->writer_waiting = 1;
+                bool woken = out->tail.load() != tail
+                    || futex_wait(out->tail_seq, seq, SHM_WAIT_MS);
+                out->writer_waiting = 0;
+                if (!woken && !peer_alive()) {
+                    throw TTransportException(TTransportException::END_OF_FILE,
+                            "Shm peer is gone");
+                }
+                continue;
+            }
+
+            uint32_t n = static_cast<uint32_t>(std::min<uint64_t>(len, space));
+            uint32_t offset = pending_head % ring_size;
+            uint32_t first = std::min(n, ring_size - offset);
+            std::memcpy(out->data() + offset, buf, first);
+            std::memcpy(out->data(), buf + first, n - first);
+            pending_head += n;
+            buf += n;
+            len -= n;
+        }
+    }
+
+    void TShmTransport::flush()
+    {
+        if (isOpen()) {
+            publish();
+        }
+    }
+
+    void TShmTransport::map_segment(size_t size, bool init)
+    {
+        void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+        if (p == MAP_FAILED) {
+            throw sys_error(TTransportException::NOT_OPEN, "Failed to map shm segment");
+        }
+        segment = p;
+        segment_size = size;
+
+        auto header = static_cast<SegmentHeader*>(segment);
+        uint8_t* rings = static_cast<uint8_t*>(segment) + sizeof(SegmentHeader);
+        if (init) {  // client side: creates the rings, writes to the first one
+            header->magic = SHM_MAGIC;
+            header->ring_size = ring_size;
+            out = new (rings) Ring();
+            in = new (rings + ring_bytes(ring_size)) Ring();
+        } else {  // server side
+            // read once, the client may change the header at any time
+            ring_size = size < sizeof(SegmentHeader) ? 0 : header->ring_size;
+            if (ring_size == 0 || header->magic != SHM_MAGIC
+                    || size != segment_bytes(ring_size)) {
+                throw TTransportException(TTransportException::CORRUPTED_DATA,
+                        "Invalid shm segment");
+            }
+            in = reinterpret_cast<Ring*>(rings);
+            out = reinterpret_cast<Ring*>(rings + ring_bytes(ring_size));
+        }
+        pending_head = out->head.load();
+    }
+
+    void TShmTransport::publish()
+    {
+        if (out->head.load(std::memory_order_relaxed) == pending_head) {
+            return;
+        }
+        out->head.store(pending_head, std::memory_order_release);
+        out->head_seq.fetch_add(1);
+        if (out->reader_waiting) {
+            futex_wake(out->head_seq);
+        }
+    }
+
+    bool TShmTransport::peer_alive()
+    {
+        if (sock_fd < 0) {
+            return false;
+        }
+        pollfd pfd;
+        pfd.fd = sock_fd;
+        pfd.events = POLLRDHUP;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 0) < 0) {
+            return errno == EINTR;
+        }
+        return !(pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+    }
+
+    TShmServerTransport::TShmServerTransport(const std::string& socket_path):
+        socket_path(socket_path)
+    {
+    }
+
+    TShmServerTransport::~TShmServerTransport()
+    {
+        close();
+    }
+
+    void TShmServerTransport::listen()
+    {
+        listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0) {
+            throw sys_error(TTransportException::NOT_OPEN, "Failed to create socket");
+        }
+        sockaddr_un addr = make_addr(socket_path);
+        unlink(socket_path.c_str());  // left over by a previous broker
+        if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            throw sys_error(TTransportException::NOT_OPEN, "Failed to bind " + socket_path);
+        }
+        if (::listen(listen_fd, 128) != 0) {
+            throw sys_error(TTransportException::NOT_OPEN, "Failed to listen on " + socket_path);
+        }
+    }
+
+    void TShmServerTransport::interrupt()
+    {
+        if (listen_fd >= 0) {
+            shutdown(listen_fd, SHUT_RDWR);
+        }
+    }
+
+    void TShmServerTransport::close()
+    {
+        if (listen_fd >= 0) {
+            ::close(listen_fd);
+            listen_fd = -1;
+            unlink(socket_path.c_str());
+        }
+    }
+
+    boost::shared_ptr<TTransport> TShmServerTransport::acceptImpl()
+    {
+        if (listen_fd < 0) {
+            throw TTransportException(TTransportException::NOT_OPEN, "Not listening");
+        }
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            throw sys_error(errno == EINVAL
+                    ? TTransportException::INTERRUPTED : TTransportException::UNKNOWN,
+                    "Failed to accept shm connection");
+        }
+
+        int mem_fd;
+        try {
+            mem_fd = recv_fd(fd);
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        return boost::shared_ptr<TTransport>(new TShmTransport(fd, mem_fd));
+    }
+
+    bool is_local_host(const std::string& host)
+    {
+        if (host == "localhost" || host == "::1" || host.compare(0, 4, "127.") == 0) {
+            return true;
+        }
+        char hostname[HOST_NAME_MAX + 1];
+        if (gethostname(hostname, sizeof(hostname)) != 0) {
+            return false;
+        }
+        hostname[HOST_NAME_MAX] = '\0';
+        return host == hostname;
+    }
+
+} /* pork  */
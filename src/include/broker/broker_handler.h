@@ -2,12 +2,17 @@
 #define BROKER_HANDLER_H_S74ILY2B
 
 #include <atomic>
+#include <chrono>
 #include <string>
+#include <map>
 #include <memory>
 #include <unordered_map>
 #include <vector>
 
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
 #include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/thread.hpp>
 #include <zookeeper/zookeeper.h>
 
 #include "Broker.h"
@@ -18,8 +23,13 @@ namespace pork {
 
     class BrokerHandler: public BrokerIf {
         public:
+            // watches the workers registered under ZNODE_CONSUMERS, the messages
+            // out to one are made free again once its znode is gone
             BrokerHandler(zhandle_t* zk_handle);
+            // for running without zookeeper, e.g. embedded in a benchmark
+            explicit BrokerHandler(id_t block_id);
             BrokerHandler(const BrokerHandler&) = delete;
+            ~BrokerHandler();
             void getMessage(
                     Message& _return,
                     const std::string& queue_name,
@@ -33,15 +43,77 @@ namespace pork {
                     const std::string& queue_name,
                     const std::vector<Message>& messages,
                     const std::vector<Dependency>& deps) override;
+            void publish(
+                    std::vector<id_t>& _return,
+                    const std::vector<std::string>& queue_names,
+                    const Message& message,
+                    const int32_t n_copies,
+                    const std::vector<Dependency>& deps) override;
             void ack(const std::string& queue_name, const id_t msg_id) override;
             void fail(const std::string& queue_name, const id_t msg_id) override;
+            void ackAndGetMessage(
+                    Message& _return,
+                    const std::string& queue_name,
+                    const std::vector<Outcome>& outcomes,
+                    const std::string& consumer_id) override;
+            void ackAndGetAnyMessage(
+                    Message& _return,
+                    const std::vector<Subscription>& subscriptions,
+                    const std::vector<Outcome>& outcomes,
+                    const std::string& consumer_id) override;
+            void leaveQueue(
+                    const std::string& queue_name,
+                    const std::string& consumer_id) override;
+            void ackBatch(
+                    const std::string& queue_name,
+                    const std::vector<Outcome>& outcomes) override;
+            void releaseMessages(
+                    const std::string& queue_name,
+                    const std::vector<id_t>& msg_ids) override;
+            void configureQueue(
+                    const std::string& queue_name,
+                    const QueueOptions& options) override;
+            void getQueueStats(QueueStats& _return, const std::string& queue_name) override;
+            void getBrokerStats(BrokerStats& _return) override;
+            void setMemoryBudget(const int64_t max_bytes) override;
+
+            // for in-process callers, the contents of the messages are taken over
+            // instead of being copied
+            id_t addMessage(
+                    const std::string& queue_name,
+                    Message&& message,
+                    const std::vector<Dependency>& deps);
+            void addMessageGroup(
+                    std::vector<id_t>& _return,
+                    const std::string& queue_name,
+                    std::vector<Message>&& messages,
+                    const std::vector<Dependency>& deps);
+
+            // where queues created from now on spill payloads to
+            void set_spill_dir(const std::string& dir) { spill_dir = dir; }
 
         protected:
             // for testing
-            BrokerHandler():next_id(0) {}
+            BrokerHandler():next_id(0) { start_reaper(); }
             virtual std::shared_ptr<AbstractMessageQueue> create_mq();
+            // hands the consumers over to the reaper, which drops them from
+            // every queue
+            void consumers_gone(const std::vector<std::string>& consumer_ids);
+            // the consumers registered under ZNODE_CONSUMERS by the czxid of their
+            // znodes, arming a watch on it. false if zookeeper could not be asked
+            virtual bool get_consumers(std::map<std::string, int64_t>& consumers);
+            // the watcher of ZNODE_CONSUMERS, also told about the session
+            static void on_consumers_changed(zhandle_t* zh, int type, int state,
+                    const char* path, void* ctx);
 
             std::unordered_map<std::string, std::shared_ptr<AbstractMessageQueue>> queues;
+            // shared by all the queues
+            std::shared_ptr<MemoryBudget> memory_budget = std::make_shared<MemoryBudget>();
+            std::shared_ptr<ReadySignal> ready_signal = std::make_shared<ReadySignal>();
+            std::string spill_dir = "/tmp";
+
+            // how long ackAndGetAnyMessage waits for a message
+            static std::chrono::milliseconds FETCH_ANY_TIMEOUT;
 
         private:
             boost::upgrade_mutex queues_mtx;
@@ -49,9 +121,51 @@ namespace pork {
 
             std::shared_ptr<AbstractMessageQueue> ensure_queue(
                     const std::string& queue_name);
+            // as ensure_queue for each subscription, under a single lock
+            void ensure_queues(
+                    const std::vector<Subscription>& subscriptions,
+                    std::vector<std::shared_ptr<AbstractMessageQueue>>& qs);
             id_t get_next_id();
+            id_t push_message(
+                    const std::shared_ptr<AbstractMessageQueue>& q,
+                    Message&& msg,
+                    const std::vector<Dependency>& deps);
+            void push_message_group(
+                    std::vector<id_t>& ids,
+                    const std::shared_ptr<AbstractMessageQueue>& q,
+                    std::vector<Message>&& msgs,
+                    const std::vector<Dependency>& deps);
+            void init_next_id(id_t block_id);
+            // expires the messages of every queue in the background
+            void start_reaper();
+            // joins the reaper, if it is running
+            void stop_reaper();
+            void reap();
+            // (re)arms the watch on ZNODE_CONSUMERS, returning the consumers gone
+            // since the last time. a worker restarted with the same id counts as
+            // gone, whatever it fetched before the broker noticed is handed out
+            // again. must not be called from the zookeeper event thread, which
+            // its synchronous calls would wait for
+            std::vector<std::string> watch_consumers();
+            static void apply_outcomes(
+                    const std::shared_ptr<AbstractMessageQueue>& q,
+                    const std::vector<Outcome>& outcomes);
+
+            zhandle_t* zk_handle = nullptr;
+            // the czxid of the znode of each registered consumer, only touched
+            // by the reaper once started
+            std::map<std::string, int64_t> known_consumers;
+            // the watch could not be armed, the reaper tries again every round
+            bool rewatch_consumers = false;
 
-            zhandle_t* zk_handle;
+            boost::thread reaper;
+            boost::mutex reaper_mtx;
+            boost::condition_variable reaper_cv;
+            bool stopping = false;
+            // guarded by reaper_mtx
+            std::vector<std::string> lost_consumers;
+            bool consumers_changed = false;
+            static const int REAP_INTERVAL_MS = 100;
     };
 
 } /* pork  */
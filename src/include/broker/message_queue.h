@@ -1,71 +1,506 @@
 #ifndef MESSAGE_QUEUE_H_BYHAK68A
 #define MESSAGE_QUEUE_H_BYHAK68A
 
+#include <array>
 #include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
 #include <map>
 #include <memory>
-#include <list>
-#include <queue>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include <boost/chrono/duration.hpp>
+#include <boost/chrono/system_clocks.hpp>
+#include <boost/intrusive/set.hpp>
+#include <boost/smart_ptr/intrusive_ptr.hpp>
+#include <boost/smart_ptr/intrusive_ref_counter.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/shared_mutex.hpp>
 
+#include "broker/segment_store.h"
+#include "broker/timing_wheel.h"
 #include "proto_types.h"
 
 namespace pork {
 
-    enum class MessageState { QUEUING, IN_PROGRESS, FAILED, ACKED };
+    enum class MessageState { QUEUING, IN_PROGRESS, FAILED, ACKED, EXPIRED };
 
-    struct InternalMessage {
-        const std::shared_ptr<Message> msg;
+    struct InternalDependency;
+
+    // a payload kept once for all the copies of a published message
+    struct SharedPayload: public boost::intrusive_ref_counter<SharedPayload> {
+        std::string data;
+        size_t share = 0;  // of data charged to each copy
+        Compression::type compression = Compression::NONE;  // of data
+    };
+    typedef boost::intrusive_ptr<const SharedPayload> SharedPayloadPtr;
+
+    // allocated from a pool and reference counted in place, so that queuing a
+    // message costs a single (pooled) allocation on top of its payload
+    struct InternalMessage: public boost::intrusive_ref_counter<InternalMessage> {
+        // the hook and the id are kept together, so that walking all_msgs
+        // only touches one cache line per node
+        boost::intrusive::set_member_hook<> all_msgs_hook;
+        id_t id;
         std::atomic<MessageState> state;
-        std::atomic_int n_deps;
-        InternalMessage(
-                const std::shared_ptr<Message>& msg,
-                int n_deps = 0,
-                MessageState state = MessageState::QUEUING):
-            msg(msg), state(state), n_deps(n_deps) {}
+        std::atomic_int n_deps;  // number of dependencies not yet satisfied
+        size_t n_bytes = 0;  // charged to the queue
+        int64_t expires_at = 0;  // milliseconds since the epoch, 0 for never
+        uint64_t partition_hash = 0;  // of msg.partition_key, if it is set
+        // the priority band of the ready queues it goes to, guarded by
+        // free_msgs_mtx once the message is free
+        int band = 0;
+        // the dependency of its resolve_dep, only set for QueueOptions.critical_path
+        InternalDependency* resolves = nullptr;
+        // its index in resolves->ready_resolvers while there, guarded by free_msgs_mtx
+        int resolver_pos = -1;
+        // the message is the one out for its key in an ordered queue. guarded
+        // by free_msgs_mtx, as is next_in_lane
+        bool holds_lane = false;
+        boost::intrusive_ptr<InternalMessage> next_in_lane;
+        // when it was last handed out, guarded by free_msgs_mtx. a hedged
+        // message keeps the time of its first attempt
+        int64_t out_at = 0;
+        // handed out a second time while still out, see QueueOptions.hedge_percentile.
+        // an ack is then taken while it is queuing as well. set under the write
+        // lock of all_msgs_mtx
+        std::atomic<bool> hedged{false};
+        std::atomic_int n_out{0};  // attempts handed out and not failed or released
+        // the hash of the consumer it was last handed to, 0 for an anonymous
+        // one. set under free_msgs_mtx
+        std::atomic<uint64_t> taken_by{0};
+        bool spilled = false;  // the payload is in spill_loc instead of msg
+        SegmentStore::Location spill_loc;
+        SharedPayloadPtr shared_payload;  // in place of msg.payload, if set
+        // payloads of the joining messages that resolved its dependencies,
+        // see Message.join. guarded by all_deps_mtx until the message is free
+        std::vector<SharedPayloadPtr> joined;
+        Message msg;
+
+        InternalMessage(int n_deps = 0, MessageState state = MessageState::QUEUING):
+            id(0), state(state), n_deps(n_deps) {}
+
+        // charged to the queue
+        size_t payload_size() const {
+            return shared_payload ? shared_payload->share : msg.payload.size();
+        }
+
+        static void* operator new(size_t size);
+        static void operator delete(void* p);
+
+        friend bool operator<(const InternalMessage& a, const InternalMessage& b) {
+            return a.id < b.id;
+        }
     };
 
+    typedef boost::intrusive_ptr<InternalMessage> InternalMessagePtr;
+
     struct InternalDependency {
+        typedef std::pair<int, InternalMessagePtr> Dependant;
+
         std::atomic_int n_resolved;
-        std::list<std::shared_ptr<InternalMessage>> dependants;
+        // a min-heap on the number of resolutions each dependant is waiting for,
+        // so that an ack only touches the dependants it satisfies
+        std::vector<Dependant> dependants;
+        // payloads of the joining messages resolving it, in resolution order
+        std::vector<SharedPayloadPtr> results;
+        // the size of dependants, read without all_deps_mtx
+        std::atomic<size_t> n_dependants{0};
+        // the messages resolving it in the ready queues, to be raised along
+        // with n_dependants. guarded by free_msgs_mtx
+        std::vector<InternalMessagePtr> ready_resolvers;
         InternalDependency(int resolved = 0): n_resolved(resolved) {}
+
+        static bool heap_cmp(const Dependant& a, const Dependant& b) {
+            return a.first > b.first;
+        }
+    };
+
+    // free messages in a few priority bands, FIFO within each band, see
+    // InternalMessage.band. a message is taken from the highest non-empty band, unless starvation_limit
+    // messages in a row have been taken ahead of an older one, in which case
+    // the oldest message goes next
+    class ReadyQueue {
+        public:
+            static const int N_BANDS = 4;
+
+            void push(InternalMessagePtr&& msg);
+            // moves a message of the queue up to the band it has just been
+            // raised to from old_band. its old entry is left behind, stale
+            // and uncounted, to be skipped once it comes first
+            void raise(InternalMessagePtr&& msg, int old_band);
+            // the one pop() would return, the queue must not be empty
+            const InternalMessagePtr& peek() const;
+            InternalMessagePtr pop();
+            // the oldest message of the lowest band
+            InternalMessagePtr pop_lowest();
+            bool empty() const { return n_msgs == 0; }
+            size_t size() const { return n_msgs; }
+            void set_starvation_limit(int limit) { starvation_limit = limit; }
+            // keeps counter in step with the number of messages, as well as
+            // those of the other queues sharing it
+            void set_counter(std::atomic<size_t>* counter) { this->counter = counter; }
+            // moves the messages pred is true for to out, in push order within
+            // each band
+            template<typename Pred>
+            void extract_if(Pred pred, std::vector<InternalMessagePtr>& out);
+
+        private:
+            typedef std::pair<uint64_t, InternalMessagePtr> Entry;  // with push order
+
+            int next_band() const;
+            InternalMessagePtr pop_band(int band);
+            // drops the stale entries first in the band, so that the first
+            // entry of every band is a message of the band
+            void drop_stale(int band);
+            static bool is_stale(const Entry& entry, int band) {
+                return entry.second->band != band;
+            }
+
+            std::array<std::deque<Entry>, N_BANDS> bands;
+            unsigned non_empty_bands = 0;  // a bit for each band
+            size_t n_msgs = 0;
+            uint64_t n_pushed = 0;
+            int n_overtaking = 0;  // taken in a row ahead of an older message
+            int starvation_limit = 16;
+            std::atomic<size_t>* counter = nullptr;
+    };
+
+    template<typename Pred>
+    void ReadyQueue::extract_if(Pred pred, std::vector<InternalMessagePtr>& out)
+    {
+        for (int band = 0; band < N_BANDS; ++band) {
+            auto& q = bands[band];
+            size_t n_kept = 0;
+            size_t n_taken = 0;
+            for (auto& entry : q) {
+                if (is_stale(entry, band)) {
+                    continue;  // dropped along the way
+                }
+                if (pred(entry.second)) {
+                    out.push_back(std::move(entry.second));
+                    ++n_taken;
+                } else {
+                    if (&q[n_kept] != &entry) {
+                        q[n_kept] = std::move(entry);
+                    }
+                    ++n_kept;
+                }
+            }
+            n_msgs -= n_taken;
+            if (counter != nullptr) {
+                *counter -= n_taken;
+            }
+            q.erase(q.begin() + n_kept, q.end());
+            if (q.empty()) {
+                non_empty_bands &= ~(1u << band);
+            }
+        }
+    }
+
+    // bytes held by all the queues of a broker. the limit is checked and
+    // charged by each queue on its own, so concurrent adds to different
+    // queues may overshoot it slightly
+    struct MemoryBudget {
+        std::atomic<int64_t> max_bytes;  // 0 for unlimited
+        std::atomic<int64_t> used_bytes;
+        MemoryBudget(): max_bytes(0), used_bytes(0) {}
+    };
+
+    // wakes up the fetches waiting on several queues at once, whenever one of
+    // the queues sharing it gets a ready message
+    class ReadySignal {
+        public:
+            // the number of notifications so far
+            uint64_t version();
+            // false if there has been no notification since version by deadline
+            bool wait(uint64_t version, boost::chrono::steady_clock::time_point deadline);
+            // cheap while nobody is waiting
+            void notify();
+
+            // waiters must be counted in before taking the version, so that
+            // whatever is made ready after they last looked gets notified
+            std::atomic<int> n_waiters{0};
+
+        private:
+            uint64_t n_notified = 0;
+            boost::mutex mtx;
+            boost::condition_variable cv;
     };
 
     class AbstractMessageQueue {
         public:
-            virtual bool pop_free_message(Message& msg) = 0;
+            // a consumer_id joins the consumers of the queue, see
+            // ackAndGetMessage in proto.thrift
+            virtual bool pop_free_message(Message& msg,
+                    const std::string& consumer_id = "") = 0;
+            // as pop_free_message, without waiting. may miss a delayed message
+            // just due
+            virtual bool try_pop_free_message(Message& msg,
+                    const std::string& consumer_id = "") = 0;
+            // false if try_pop_free_message would surely find nothing, without
+            // locking the queue
+            virtual bool may_have_ready() const { return true; }
+            // the contents of msg are taken over by the queue. throws Overloaded
+            // if the queue stays full, in which case msg is left untouched
             virtual void push_message(
-                    const std::shared_ptr<Message>& msg,
+                    Message&& msg,
+                    const std::vector<Dependency>& deps) = 0;
+            // either all or none of msgs are pushed
+            virtual void push_message_group(
+                    std::vector<Message>&& msgs,
+                    const std::vector<Dependency>& deps) = 0;
+            // pushes a copy of msg for each of ids, with payload in place of
+            // msg.payload, either all or none of them. the payload is never
+            // spilled. if reserved, the room has been taken by reserve_copies
+            virtual void push_message_copies(
+                    const Message& msg,
+                    const SharedPayloadPtr& payload,
+                    const std::vector<id_t>& ids,
+                    const std::vector<Dependency>& deps,
+                    bool reserved = false) = 0;
+            // takes the room n_copies copies pushed by push_message_copies
+            // need, throwing Overloaded as it would. to be either used by it or
+            // given back by cancel_copies
+            virtual void reserve_copies(
+                    const Message& msg,
+                    const SharedPayloadPtr& payload,
+                    size_t n_copies,
+                    const std::vector<Dependency>& deps) = 0;
+            virtual void cancel_copies(
+                    const Message& msg,
+                    const SharedPayloadPtr& payload,
+                    size_t n_copies,
                     const std::vector<Dependency>& deps) = 0;
             virtual void ack(id_t msg_id) = 0;
+            // makes a message out for processing free again
+            virtual void requeue(id_t msg_id) = 0;
             virtual void fail(id_t msg_id) = 0;
+            // hands the partition keys of a consumer over to the others
+            virtual void remove_consumer(const std::string& consumer_id) = 0;
+            // the consumer is gone for good. as remove_consumer, and the messages
+            // it has out are made free again
+            virtual void drop_consumer(const std::string& consumer_id) = 0;
+            virtual void configure(const QueueOptions& options) = 0;
+            virtual void get_stats(QueueStats& stats) = 0;
+            // drops the queuing messages past their ttl and the consumers not
+            // heard from for a while, called periodically
+            virtual void expire_messages() = 0;
     };
 
     class MessageQueue: public AbstractMessageQueue {
         friend class BrokerMqTest;
 
         public:
-            MessageQueue() {}
+            MessageQueue(): MessageQueue(std::make_shared<MemoryBudget>()) {}
+            // payloads spilled by the SPILL policy go to segment files in
+            // spill_dir. ready_signal is notified along with the fetches
+            // waiting on this queue
+            explicit MessageQueue(const std::shared_ptr<MemoryBudget>& budget,
+                    const std::string& spill_dir = "/tmp",
+                    const std::shared_ptr<ReadySignal>& ready_signal = nullptr):
+                budget(budget), ready_signal(ready_signal), spill_dir(spill_dir) {
+                free_msgs.set_counter(&n_ready_msgs);
+            }
             MessageQueue(const MessageQueue&) = delete;
-            bool pop_free_message(Message& msg) override;
+            ~MessageQueue();
+            bool pop_free_message(Message& msg,
+                    const std::string& consumer_id = "") override;
+            bool try_pop_free_message(Message& msg,
+                    const std::string& consumer_id = "") override;
+            bool may_have_ready() const override { return n_ready_msgs != 0; }
             void push_message(
-                    const std::shared_ptr<Message>& msg,
+                    Message&& msg,
+                    const std::vector<Dependency>& deps) override;
+            void push_message_group(
+                    std::vector<Message>&& msgs,
+                    const std::vector<Dependency>& deps) override;
+            void push_message_copies(
+                    const Message& msg,
+                    const SharedPayloadPtr& payload,
+                    const std::vector<id_t>& ids,
+                    const std::vector<Dependency>& deps,
+                    bool reserved = false) override;
+            void reserve_copies(
+                    const Message& msg,
+                    const SharedPayloadPtr& payload,
+                    size_t n_copies,
+                    const std::vector<Dependency>& deps) override;
+            void cancel_copies(
+                    const Message& msg,
+                    const SharedPayloadPtr& payload,
+                    size_t n_copies,
                     const std::vector<Dependency>& deps) override;
             void ack(id_t msg_id) override;
+            void requeue(id_t msg_id) override;
             void fail(id_t msg_id) override;
+            void remove_consumer(const std::string& consumer_id) override;
+            void drop_consumer(const std::string& consumer_id) override;
+            void configure(const QueueOptions& options) override;
+            void get_stats(QueueStats& stats) override;
+            // an expired message may still be in free_msgs or waiting for its
+            // dependencies, but only as a husk without payload or charge
+            void expire_messages() override;
 
         private:
-            void push_free_message(const std::shared_ptr<InternalMessage>& msg);
+            typedef boost::intrusive::set<InternalMessage,
+                    boost::intrusive::member_hook<InternalMessage,
+                        boost::intrusive::set_member_hook<>,
+                        &InternalMessage::all_msgs_hook>> MessageIndex;
+
+            bool pop(Message& msg, const std::string& consumer_id,
+                    boost::chrono::steady_clock::time_point deadline);
+            // wakes up everyone waiting for a ready message
+            void notify_ready();
+            // spill_loc is where the payload has been spilled, if it has been
+            void insert_message(Message&& msg, const std::vector<Dependency>& deps,
+                    size_t n_bytes, const SegmentStore::Location* spill_loc,
+                    const SharedPayloadPtr& shared_payload = nullptr);
+            // a consumer of the queue, with the free messages of the partition
+            // keys it owns
+            struct Consumer {
+                uint64_t hash;  // of its id
+                ReadyQueue msgs;
+                int n_fetching = 0;
+                int64_t last_seen = 0;
+            };
+            typedef std::map<std::string, Consumer> ConsumerMap;
+
+            // the messages of a key waiting for the one out to be done with,
+            // in the order they became free. a lane only exists while one is out
+            struct Lane {
+                InternalMessagePtr first;
+                InternalMessage* last = nullptr;
+            };
 
-            std::queue<std::shared_ptr<InternalMessage>> free_msgs;
-            // change all shared_ptrs other than the following one to weak_ptrs?
-            std::map<id_t, std::shared_ptr<InternalMessage>> all_msgs;
-            std::map<std::string, std::unique_ptr<InternalDependency>> all_deps;
+            void push_free_message(InternalMessagePtr&& msg);
+            // puts a message whose dependencies are satisfied into the ready
+            // queue it belongs to, or delayed_msgs if it is not due yet. returns
+            // the ready queue, null if the message has not been made ready.
+            // free_msgs_mtx must be held
+            ReadyQueue* make_free(InternalMessagePtr&& msg);
+            // puts a free message that is due into its ready queue, unless it
+            // has to wait in its lane. free_msgs_mtx must be held
+            ReadyQueue* make_ready(InternalMessagePtr&& msg);
+            // raises the ready messages resolving dep to the band its dependants
+            // call for. free_msgs_mtx must be held
+            void raise_resolvers(InternalDependency& dep);
+            // drops a message taken from a ready queue from ready_resolvers.
+            // free_msgs_mtx must be held
+            void forget_resolver(InternalMessage& msg);
+            // lets the next message of the lane of msg out, if msg holds it
+            void leave_lane(InternalMessage& msg);
+            // lets every message waiting in a lane out. free_msgs_mtx must be held
+            void clear_lanes();
+            // the ready queue of the owner of the partition key of msg, by
+            // rendezvous hashing, free_msgs if msg has no key or there are no
+            // consumers. free_msgs_mtx must be held, as for the ones below
+            ReadyQueue& ready_queue_of(const InternalMessage& msg);
+            // where the consumer, null for an anonymous one, takes its next
+            // message from, null if there is nothing to take
+            ReadyQueue* next_ready_queue(Consumer* consumer);
+            ReadyQueue& fullest_ready_queue();
+            size_t n_ready() const { return n_ready_msgs; }
+            // null for an empty or unknown consumer_id
+            Consumer* find_consumer(const std::string& consumer_id);
+            ConsumerMap::iterator add_consumer(const std::string& consumer_id);
+            void erase_consumer(ConsumerMap::iterator iter);
+            // moves the messages due by now into free_msgs. free_msgs_mtx
+            // must be held
+            void release_delayed();
+            // makes an in-progress message free again, if taken_by, only if it was
+            // last handed to that consumer
+            void take_back(id_t msg_id, const uint64_t* taken_by);
+            // adds an in-progress message to taken_msgs, as handed to the
+            // consumer with hash, or drops it from there
+            void track(InternalMessage& msg, uint64_t hash);
+            void untrack(const InternalMessage& msg);
+            // removes an in-progress message, null if there is no such message.
+            // a failed hedged one is not removed while another attempt is out or
+            // yet to be taken
+            InternalMessagePtr take_in_progress(id_t msg_id, MessageState new_state);
+            // fails a message taken out whose spilled payload cannot be read
+            void drop_unreadable(InternalMessage& msg);
+            // the processing time the hedge_percentile is at, -1 while there are
+            // too few samples
+            int64_t hedge_after_ms();
+            // hands an in-progress message out again, unless it has been handed
+            // out after cutoff or already hedged
+            void hedge(id_t msg_id, int64_t cutoff);
+            // samples the processing time of an acked message, while hedging
+            void add_out_time(const InternalMessage& msg);
+            // counts in one more resolution of a dependency, freeing the
+            // dependants it satisfies. result is kept for them, if given
+            void resolve(const std::string& key,
+                    const SharedPayloadPtr& result = nullptr);
+            // the payload of an acked joining message, as a result. the message
+            // keeps the same charge
+            SharedPayloadPtr take_result(InternalMessage& msg);
+            // all_deps_mtx must be held exclusively
+            void keep_result(InternalDependency& dep, const SharedPayloadPtr& result);
+            // hands the results of the first n resolutions of dep to msg,
+            // dropping them from dep once nobody else waits for them
+            void join_results(InternalDependency& dep, int n, InternalMessage& msg);
+            // removes a message already set to EXPIRED from all_msgs and
+            // resolves its dependency
+            void finish_expiry(InternalMessagePtr&& msg);
+
+            // waits for room for the given messages, or makes some according to
+            // the overflow policy, and reserves it. true if the payloads are to
+            // be spilled, in which case they are not charged. never so unless
+            // spillable
+            bool admit(size_t n_msgs, size_t n_bytes, size_t payload_bytes,
+                    bool spillable = true);
+            bool has_room(size_t n_msgs, size_t n_bytes) const;
+            // takes back an admission whose payloads failed to spill
+            void cancel_spill(size_t n_msgs, size_t n_bytes, size_t spilled_bytes);
+            // takes back an admission of messages not pushed after all
+            void cancel_admission(size_t n_msgs, size_t n_bytes, size_t payload_bytes);
+            void release(const InternalMessage& msg);
+            // limits_mtx must be held
+            void uncharge(const InternalMessage& msg);
+            bool drop_oldest();
+            void charge_dependency(const std::string& key);
+
+            // free messages without a partition key, and those with one while
+            // there are no consumers
+            ReadyQueue free_msgs;
+            ConsumerMap consumers;
+            int starvation_limit = 16;
+            // by partition_hash. keys colliding share a lane, which only costs
+            // them some parallelism
+            std::unordered_map<uint64_t, Lane> lanes;
+            // in all the ready queues, read without the lock by may_have_ready
+            std::atomic<size_t> n_ready_msgs{0};
+            std::atomic<bool> ordered{false};
+            std::atomic<int> hedge_percentile{0};
+            std::atomic<int> hedge_min_ms{0};
+            std::atomic<bool> critical_path{false};
+            // ids of the in-progress messages of each named consumer, by its
+            // hash, so that dropping a consumer only visits its own
+            std::unordered_map<uint64_t, std::unordered_set<id_t>> taken_msgs;
+            boost::mutex taken_msgs_mtx;
+            // ids of the messages out, by out_at, while hedging. guarded by
+            // free_msgs_mtx
+            std::deque<std::pair<int64_t, id_t>> out_msgs;
+            // recent processing times, a ring guarded by hedge_mtx
+            std::vector<int64_t> out_times;
+            size_t next_out_time = 0;
+            boost::mutex hedge_mtx;
+            // free messages with a not_before in the future, by their not_before
+            TimingWheel<InternalMessagePtr> delayed_msgs{DELAY_TICK_MS, DELAY_SLOTS};
+            // ids of the messages with a ttl, by their expires_at
+            TimingWheel<id_t> expiring_msgs{DELAY_TICK_MS, DELAY_SLOTS};
+            boost::mutex expiring_msgs_mtx;
+            // holds a reference to every message, taken with intrusive_ptr_add_ref
+            MessageIndex all_msgs;
+            std::map<std::string, InternalDependency> all_deps;
 
             boost::mutex free_msgs_mtx;
             boost::condition_variable free_msgs_not_empty_cv;
@@ -73,7 +508,43 @@ namespace pork {
             boost::upgrade_mutex all_msgs_mtx;
             boost::upgrade_mutex all_deps_mtx;
 
+            // the accounting of messages not yet acked or failed, guarded by limits_mtx
+            QueueOptions options;
+            size_t n_msgs = 0;
+            size_t n_bytes = 0;
+            size_t payload_bytes = 0;
+            size_t n_spilled = 0;
+            size_t spilled_bytes = 0;
+            int n_blocked_producers = 0;
+            boost::mutex limits_mtx;
+            boost::condition_variable not_full_cv;
+
+            std::atomic<size_t> dependency_bytes{0};
+            std::atomic<int64_t> n_dropped{0};
+            std::atomic<int64_t> n_rejected{0};
+            std::atomic<int64_t> n_expired{0};
+            std::atomic<int64_t> n_hedged{0};
+            std::atomic<int> default_ttl_ms{0};
+            std::shared_ptr<MemoryBudget> budget;
+            std::shared_ptr<ReadySignal> ready_signal;
+
+            std::string spill_dir;
+            // created by the first spill, under limits_mtx
+            std::unique_ptr<SegmentStore> spill_store;
+
             static boost::chrono::milliseconds POP_FREE_TIMEOUT;
+            // a round of delayed_msgs is about 40 seconds
+            static const int DELAY_TICK_MS = 10;
+            static const size_t DELAY_SLOTS = 4096;
+            static const int OVERLOADED_RETRY_AFTER_MS = 100;
+            // a consumer not fetching for this long is assumed gone
+            static const int CONSUMER_TIMEOUT_MS = 15000;
+            // processing times kept for hedging, and how many are needed first
+            static const size_t N_OUT_TIMES = 256;
+            static const size_t MIN_OUT_TIMES = 32;
+            // how often a blocked producer checks the broker-wide budget,
+            // which is freed by other queues without notifying this one
+            static const int BUDGET_POLL_MS = 10;
     };
 
 } /* pork  */
@@ -0,0 +1,71 @@
+#ifndef SEGMENT_STORE_H_M4TQ7ZUE
+#define SEGMENT_STORE_H_M4TQ7ZUE
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include <boost/thread/shared_mutex.hpp>
+
+namespace pork {
+
+    // Append-only files holding spilled payloads. Each segment is written
+    // with pwrite and read back through a read-only shared mapping, so the
+    // page cache, not the heap, holds whatever is being read. A segment is
+    // removed once it is full and every payload in it has been released.
+    //
+    // Segment files are unlinked as soon as they are created, nothing is
+    // left behind if the broker dies.
+    class SegmentStore {
+        public:
+            struct Location {
+                uint32_t segment = 0;
+                uint32_t length = 0;
+                uint64_t offset = 0;
+            };
+
+            static const size_t DEFAULT_SEGMENT_SIZE = 64 << 20;
+
+            // segment files are created in dir, with names starting with prefix
+            SegmentStore(const std::string& dir, const std::string& prefix,
+                    size_t segment_size = DEFAULT_SEGMENT_SIZE);
+            SegmentStore(const SegmentStore&) = delete;
+            ~SegmentStore();
+
+            // throws std::system_error if the data cannot be written
+            Location append(const std::string& data);
+            // false if the segment of loc is gone, which only happens once
+            // loc has been released
+            bool read(const Location& loc, std::string& data);
+            // hints that loc is about to be read
+            void prefetch(const Location& loc);
+            void release(const Location& loc);
+            size_t n_segments();
+
+        private:
+            struct Segment {
+                int fd = -1;
+                const char* map = nullptr;
+                size_t size = 0;
+                size_t n_written = 0;  // including writes still in flight
+                size_t n_live = 0;  // bytes not yet released
+            };
+
+            Segment& create_segment(size_t size);
+            // segments_mtx must be held exclusively
+            void remove_segment(std::map<uint32_t, Segment>::iterator iter);
+
+            std::string dir;
+            std::string prefix;
+            size_t segment_size;
+
+            std::map<uint32_t, Segment> segments;
+            uint32_t active_segment = 0;  // the one being appended to
+            uint32_t next_segment = 1;
+            boost::upgrade_mutex segments_mtx;
+    };
+
+} /* pork */
+
+#endif /* end of include guard: SEGMENT_STORE_H_M4TQ7ZUE */
@@ -0,0 +1,122 @@
+#ifndef TIMING_WHEEL_H_C5RW0KQN
+#define TIMING_WHEEL_H_C5RW0KQN
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace pork {
+
+    // A hashed timing wheel. An item due at time t goes to slot
+    // ceil(t / tick_ms) % n_slots, and advancing the wheel only visits the
+    // slots of the ticks passed since the last advance, so inserting is O(1)
+    // and releasing is O(1) amortized as long as most items are due within a
+    // round of the wheel. Items due further away stay in their slot for more
+    // rounds.
+    //
+    // Not thread safe. Times are in milliseconds, from any fixed origin.
+    template<typename T>
+    class TimingWheel {
+        public:
+            TimingWheel(int64_t tick_ms, size_t n_slots);
+            TimingWheel(const TimingWheel&) = delete;
+
+            // false if item is already due, in which case it is left untouched
+            bool insert(int64_t due_ms, T&& item);
+            // passes every item due by now_ms to f, in order of their due
+            // ticks unless the wheel has not been advanced for a whole round
+            template<typename F>
+            void advance(int64_t now_ms, F f);
+
+            // when advance will next release something, the wheel must not be
+            // empty. only walks the slots while the earliest item is unknown
+            int64_t next_due_ms() const;
+
+            size_t size() const { return n_items; }
+            bool empty() const { return n_items == 0; }
+            int64_t tick_ms() const { return tick; }
+
+        private:
+            typedef std::pair<int64_t, T> Entry;  // with its due tick
+
+            int64_t tick;
+            std::vector<std::vector<Entry>> slots;
+            int64_t current_tick = 0;  // everything up to this tick is released
+            size_t n_items = 0;
+            // the earliest due tick, known while past current_tick
+            mutable int64_t next_due_tick = 0;
+    };
+
+    template<typename T>
+    TimingWheel<T>::TimingWheel(int64_t tick_ms, size_t n_slots):
+        tick(tick_ms), slots(n_slots) {}
+
+    template<typename T>
+    bool TimingWheel<T>::insert(int64_t due_ms, T&& item)
+    {
+        int64_t due_tick = (due_ms + tick - 1) / tick;
+        if (due_tick <= current_tick) {
+            return false;
+        }
+        slots[due_tick % slots.size()].emplace_back(due_tick, std::move(item));
+        ++n_items;
+        if (next_due_tick > current_tick && due_tick < next_due_tick) {
+            next_due_tick = due_tick;
+        }
+        return true;
+    }
+
+    template<typename T>
+    int64_t TimingWheel<T>::next_due_ms() const
+    {
+        if (next_due_tick <= current_tick) {
+            // an item in the slot of a later tick is due no earlier than it
+            int64_t earliest = INT64_MAX;
+            for (int64_t t = current_tick + 1;
+                    t <= current_tick + int64_t(slots.size()) && earliest > t; ++t) {
+                for (auto& entry : slots[t % slots.size()]) {
+                    earliest = std::min(earliest, entry.first);
+                }
+            }
+            next_due_tick = earliest;
+        }
+        return next_due_tick * tick;
+    }
+
+    template<typename T>
+    template<typename F>
+    void TimingWheel<T>::advance(int64_t now_ms, F f)
+    {
+        int64_t now_tick = now_ms / tick;
+        if (now_tick <= current_tick) {
+            return;
+        }
+        // a whole round visits every slot once
+        int64_t n_ticks = std::min<int64_t>(now_tick - current_tick, slots.size());
+        for (int64_t t = now_tick - n_ticks + 1; t <= now_tick; ++t) {
+            if (n_items == 0) {
+                break;
+            }
+            auto& slot = slots[t % slots.size()];
+            size_t n_kept = 0;
+            for (auto& entry : slot) {
+                if (entry.first <= now_tick) {
+                    f(entry.second);
+                    --n_items;
+                } else {
+                    if (&slot[n_kept] != &entry) {
+                        slot[n_kept] = std::move(entry);
+                    }
+                    ++n_kept;
+                }
+            }
+            slot.erase(slot.begin() + n_kept, slot.end());
+        }
+        current_tick = now_tick;
+    }
+
+} /* pork */
+
+#endif /* end of include guard: TIMING_WHEEL_H_C5RW0KQN */
@@ -9,9 +9,13 @@
 using namespace boost::log::trivial;
 
 namespace pork {
-    static const char* ZNODE_PATHS_TO_CREATE[] = {"/pork", "/pork/broker", "/pork/id"};
+    static const char* ZNODE_PATHS_TO_CREATE[] = {
+        "/pork", "/pork/broker", "/pork/id", "/pork/consumers"};
     static const char* ZNODE_BROKER_ADDR = "/pork/broker/addr";
+    static const char* ZNODE_BROKER_SHM_PATH = "/pork/broker/shm";
     static const char* ZNODE_ID_BLOCK_PREFIX = "/pork/id/block";
+    // an ephemeral child named by its consumer_id for every running worker
+    static const char* ZNODE_CONSUMERS = "/pork/consumers";
 }
 
 #define LOG_DEBUG BOOST_LOG_TRIVIAL(debug)
@@ -0,0 +1,23 @@
+#ifndef COMPRESSION_H_W7NB3FXD
+#define COMPRESSION_H_W7NB3FXD
+
+#include "proto_types.h"
+
+namespace pork {
+
+    // whether this build can encode and decode payloads with codec
+    bool compression_supported(Compression::type codec);
+
+    // compresses msg.payload in place and sets msg.compression, unless the
+    // payload is already compressed or would not get any smaller, in which
+    // case false is returned. level 0 means the default of the codec.
+    // throws std::invalid_argument if codec is not supported
+    bool compress_payload(Message& msg, Compression::type codec, int level = 0);
+
+    // restores the payload of a message compressed by compress_payload, and
+    // those it joined. throws std::runtime_error if one cannot be decoded
+    void decompress_payload(Message& msg);
+
+} /* pork */
+
+#endif /* end of include guard: COMPRESSION_H_W7NB3FXD */
@@ -6,6 +6,8 @@
 #include <cstddef>
 #include <mutex>
 #include <queue>
+#include <stdexcept>
+#include <vector>
 
 namespace pork {
 
@@ -17,9 +19,16 @@ namespace pork {
 
             void put(const T& data);
             T pop(int wait_ms = -1);
+            // pops up to max_n items into out, waiting for the first one as pop
+            // does, then for up to linger_ms for the others
+            void pop_batch(std::vector<T>& out, size_t max_n,
+                    int linger_ms = 0, int wait_ms = -1);
+            void set_water_marks(size_t low_water_mark, size_t high_water_mark);
 
             std::unique_lock<std::mutex> wait_till_high(bool hold = false);
             std::unique_lock<std::mutex> wait_till_low(bool hold = false);
+            // false if the queue is still above its low water mark after wait_ms
+            bool wait_till_low_for(int wait_ms);
 
             size_t size() const { return _q.size(); }
             bool empty() const { return _q.empty(); }
@@ -51,6 +60,24 @@ namespace pork {
         }
     }
 
+    template<typename T>
+    void FlowControlQueue<T>::set_water_marks(size_t low_water_mark, size_t high_water_mark)
+    {
+        if (low_water_mark >= high_water_mark) {
+            throw std::runtime_error(
+                    "low_water_mark must be greater than high_water_mark");
+        }
+        std::unique_lock<std::mutex> _lock(_mtx);
+        _low_water_mark = low_water_mark;
+        _high_water_mark = high_water_mark;
+        if (low()) {
+            _cv_low.notify_all();
+        }
+        if (high()) {
+            _cv_high.notify_all();
+        }
+    }
+
     template<typename T>
     void FlowControlQueue<T>::put(const T& data)
     {
@@ -84,6 +111,49 @@ namespace pork {
         return data;
     }
 
+    template<typename T>
+    void FlowControlQueue<T>::pop_batch(std::vector<T>& out, size_t max_n,
+            int linger_ms, int wait_ms)
+    {
+        out.clear();
+        std::unique_lock<std::mutex> _lock(_mtx);
+        if (wait_ms < 0) {
+            while (empty()) {
+                _cv_not_empty.wait(_lock);
+            }
+        } else {
+            if (!_cv_not_empty.wait_for(_lock, std::chrono::milliseconds(wait_ms),
+                    [this] () { return !empty(); })) {
+                throw Timeout();
+            }
+        }
+        std::chrono::steady_clock::time_point deadline;
+        while (true) {
+            while (!empty() && out.size() < max_n) {
+                out.push_back(std::move(_q.front()));
+                _q.pop();
+            }
+            if (out.size() >= max_n || linger_ms <= 0) {
+                break;
+            }
+            if (deadline == std::chrono::steady_clock::time_point()) {
+                deadline = std::chrono::steady_clock::now()
+                    + std::chrono::milliseconds(linger_ms);
+            }
+            // let the producer refill while lingering
+            if (low()) {
+                _cv_low.notify_all();
+            }
+            if (!_cv_not_empty.wait_until(_lock, deadline,
+                    [this] () { return !empty(); })) {
+                break;
+            }
+        }
+        if (low()) {
+            _cv_low.notify_all();
+        }
+    }
+
     template<typename T>
     std::unique_lock<std::mutex> FlowControlQueue<T>::wait_till_high(bool hold)
     {
@@ -104,6 +174,14 @@ namespace pork {
         return hold ? std::move(_lock) : std::unique_lock<std::mutex>();
     }
 
+    template<typename T>
+    bool FlowControlQueue<T>::wait_till_low_for(int wait_ms)
+    {
+        std::unique_lock<std::mutex> _lock(_mtx);
+        return _cv_low.wait_for(_lock, std::chrono::milliseconds(wait_ms),
+                [this] () { return low(); });
+    }
+
 } /* pork  */
 
 #endif /* end of include guard: FLOW_CONTROL_QUEUE_H_SJ08BHB6 */
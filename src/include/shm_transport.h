@@ -0,0 +1,88 @@
+#ifndef SHM_TRANSPORT_H_Q2MZ8RDK
+#define SHM_TRANSPORT_H_Q2MZ8RDK
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <boost/smart_ptr/shared_ptr.hpp>
+#include <thrift/transport/TServerTransport.h>
+#include <thrift/transport/TVirtualTransport.h>
+
+namespace pork {
+
+    // A pair of single-producer single-consumer byte rings living in a memfd
+    // shared by a worker and the broker on the same host. The memfd is handed
+    // to the broker over a unix domain socket, which then only serves to
+    // detect the death of the peer. Blocked readers and writers sleep on
+    // futexes in the shared segment.
+    //
+    // Written bytes are published to the reader on flush(), or when the ring
+    // is full, so no TBufferedTransport is needed on top of it.
+    class TShmTransport: public apache::thrift::transport::TVirtualTransport<TShmTransport> {
+        friend class TShmServerTransport;
+
+        public:
+            static const uint32_t DEFAULT_RING_SIZE = 4 << 20;
+
+            // client side, connects to the broker listening on socket_path
+            TShmTransport(const std::string& socket_path,
+                    uint32_t ring_size = DEFAULT_RING_SIZE);
+            TShmTransport(const TShmTransport&) = delete;
+            ~TShmTransport();
+
+            bool isOpen() override;
+            bool peek() override;
+            void open() override;
+            void close() override;
+            uint32_t read(uint8_t* buf, uint32_t len);
+            void write(const uint8_t* buf, uint32_t len);
+            void flush() override;
+
+            struct Ring;
+
+        private:
+            // server side, takes over an accepted socket and the received memfd
+            TShmTransport(int sock_fd, int mem_fd);
+
+            void map_segment(size_t size, bool init);
+            void publish();
+            void wait_on(std::atomic<uint32_t>& seq, uint32_t old_seq);
+            bool peer_alive();
+
+            std::string socket_path;
+            uint32_t ring_size;
+            int sock_fd = -1;
+            int mem_fd = -1;
+            void* segment = nullptr;
+            size_t segment_size = 0;
+            Ring* in = nullptr;
+            Ring* out = nullptr;
+            uint64_t pending_head = 0;  // written but not yet published
+    };
+
+    class TShmServerTransport: public apache::thrift::transport::TServerTransport {
+        public:
+            TShmServerTransport(const std::string& socket_path);
+            TShmServerTransport(const TShmServerTransport&) = delete;
+            ~TShmServerTransport();
+
+            void listen() override;
+            void interrupt() override;
+            void close() override;
+
+        protected:
+            boost::shared_ptr<apache::thrift::transport::TTransport> acceptImpl() override;
+
+        private:
+            std::string socket_path;
+            int listen_fd = -1;
+    };
+
+    // whether host refers to the machine we are running on
+    bool is_local_host(const std::string& host);
+
+} /* pork  */
+
+#endif /* end of include guard: SHM_TRANSPORT_H_Q2MZ8RDK */
@@ -2,10 +2,14 @@
 #define WORKER_H_LGDNAVV3
 
 #include <atomic>
+#include <condition_variable>
 #include <cstddef>
+#include <functional>
 #include <string>
+#include <unordered_map>
 #include <vector>
 #include <memory>
+#include <mutex>
 
 #include <boost/smart_ptr/shared_ptr.hpp>
 #include <thrift/transport/TTransport.h>
@@ -20,18 +24,81 @@ using apache::thrift::transport::TTransport;
 
 namespace pork {
 
+    class BrokerHandler;
+
     class BaseWorker {
         friend class TestingWorker;
         friend class WorkerTest;
 
         public:
+            // the worker is registered in zookeeper while it runs, so that the
+            // broker takes back the messages it has out as soon as its session
+            // is lost
             BaseWorker(const std::vector<std::string> &zk_servers,
                     const std::string& queue_name);
+            // connects to the broker directly, without looking it up in zookeeper.
+            // shared memory is used if shm_path is given and the broker is local
+            BaseWorker(const std::string& broker_host, uint16_t broker_port,
+                    const std::string& queue_name, const std::string& shm_path = "");
+            // runs against a broker living in the same process. defined in
+            // embedded_worker.cc, link the worker-embedded library for it
+            BaseWorker(const std::shared_ptr<BrokerHandler>& broker,
+                    const std::string& queue_name);
             BaseWorker(const BaseWorker&) = delete;
             virtual ~BaseWorker();
             void run();
+            // run returns once the messages being processed are done and their
+            // outcomes sent
             void stop();
+            // the payload of msg has been decompressed if it was compressed, as
+            // have those in msg.joined.
+            // msg.queue_name is set if the worker subscribes to several queues
             virtual bool process_message(const Message &msg) = 0;
+            // processes the messages at once, returning whether each one is
+            // acked. calls process_message on each of them unless overridden.
+            // see set_batching
+            virtual std::vector<bool> process_messages(const std::vector<Message>& msgs);
+            // starts processing msg, calling done exactly once, from any thread,
+            // with whether it is acked. msg is the handler's own, to be moved
+            // wherever the processing goes on. calls process_message then done
+            // unless overridden. see set_concurrency
+            virtual void process_message_async(
+                    Message msg, std::function<void(bool)> done);
+
+            // fetches from queue_name too, along with the queue the worker was
+            // created for, which has a weight of 1 unless subscribed to again.
+            // while several queues have messages, each one gets its weight's
+            // share of the fetches. call it before run
+            void subscribe(const std::string& queue_name, int weight = 1);
+
+            // compresses the payloads emitted to queue_name with codec, unless
+            // they are smaller than min_bytes. not thread safe, call it before
+            // emitting. throws std::invalid_argument if codec is not supported
+            void set_compression(const std::string& queue_name,
+                    Compression::type codec, size_t min_bytes = 256, int level = 0);
+
+            // hands process_messages up to max_messages at a time, waiting up to
+            // linger_ms for a batch to fill once it has a message. as many
+            // messages are fetched ahead. call it before run
+            void set_batching(size_t max_messages, int linger_ms = 0);
+
+            // keeps up to max_in_flight messages in process_message_async at
+            // once, started from n_threads threads, and fetches as many ahead.
+            // process_messages is not used then, and process_message must be
+            // thread safe if n_threads is more than 1. call it before run
+            void set_concurrency(size_t max_in_flight, size_t n_threads = 1);
+
+            // on stop, hands the messages fetched ahead but not yet processed
+            // back to the broker, which gives them to other workers right away.
+            // otherwise they stay out: a broker using zookeeper takes them back
+            // once the worker's znode is gone, one without keeps them out until
+            // it restarts. call it before run
+            void set_drain_on_stop(bool drain) { drain_on_stop = drain; }
+
+            // messages with the same partition key go to the same consumer of a
+            // queue. a worker keeping its id across restarts gets its keys back.
+            // call it before run
+            void set_consumer_id(const std::string& id) { consumer_id = id; }
 
         protected:
             id_t emit(
@@ -42,36 +109,121 @@ namespace pork {
                     const std::string &queue_name,
                     const std::vector<Message>& msgs,
                     const std::vector<Dependency>& deps) const;
+            // moves the messages into an embedded broker, copies otherwise
+            id_t emit(
+                    const std::string& queue_name,
+                    Message&& msg,
+                    const std::vector<Dependency>& deps) const;
+            std::vector<id_t> emit(
+                    const std::string &queue_name,
+                    std::vector<Message>&& msgs,
+                    const std::vector<Dependency>& deps) const;
+            // emits n_copies of msg to each of the queues, sending and storing
+            // its payload only once. the payload is compressed as for the first
+            // of the queues that compresses it. returns n_copies ids per queue
+            std::vector<id_t> publish(
+                    const std::vector<std::string>& queue_names,
+                    const Message& msg,
+                    int n_copies,
+                    const std::vector<Dependency>& deps) const;
 
         private:
             static zhandle_t* get_zk_handle(const std::vector<std::string>& zk_hosts);
-            void init_broker_client(const std::string& host, uint16_t port, bool fetch);
+            // unique among the workers of all hosts
+            static std::string default_consumer_id();
+            void init_broker_client(const std::string& host, uint16_t port,
+                    const std::string& shm_path, bool fetch);
             void get_broker_address(std::string& host, uint16_t& port) const;
+            void get_broker_shm_path(std::string& shm_path) const;
+            // the ephemeral znode of consumer_id under ZNODE_CONSUMERS, if there
+            // is zookeeper
+            void register_consumer();
+            void unregister_consumer();
             void process();
+            // as process, a message at a time through process_message_async
+            void process_async();
+            void finish_in_flight();
+            // sizes msg_buffer for the batches or messages in flight
+            void resize_buffer();
+            void report(const Message& msg, bool acked);
+            void report(const std::vector<Message>& msgs, const std::vector<bool>& acked);
+            // no lock taken
+            void add_outcome(const Message& msg, bool acked);
+            void take_outcomes(std::vector<Outcome>& outcomes) const;
+            void flush_outcomes() const;
+            // releases what is left in msg_buffer
+            void release_buffered();
+            // calls add until the broker accepts the messages, backing off
+            // while the target queue is overloaded
+            template<typename F>
+            auto add_with_backoff(const F& add) const -> decltype(add());
+            // send without compressing
+            id_t add_message(
+                    const std::string& queue_name,
+                    const Message& msg,
+                    const std::vector<Dependency>& deps) const;
+            std::vector<id_t> add_message_group(
+                    const std::string& queue_name,
+                    const std::vector<Message>& msgs,
+                    const std::vector<Dependency>& deps) const;
+            // whether msg is to be compressed before being added to queue_name
+            bool should_compress(const std::string& queue_name, const Message& msg) const;
+            void compress(const std::string& queue_name, Message& msg) const;
+
+            struct CompressionOptions {
+                Compression::type codec;
+                size_t min_bytes;
+                int level;
+            };
 
             std::atomic_bool running;
             zhandle_t* zk_handle = nullptr;
             std::string queue_name;
+            std::string consumer_id = default_consumer_id();
+            // empty unless the worker fetches from more than its own queue
+            std::vector<Subscription> subscriptions;
             FlowControlQueue<Message> msg_buffer;
+            size_t max_batch = 1;
+            int batch_linger_ms = 0;
+            size_t max_in_flight = 1;
+            size_t n_process_threads = 1;
+            size_t n_in_flight = 0;
+            std::mutex in_flight_mtx;
+            std::condition_variable in_flight_cv;
+            bool drain_on_stop = false;
             std::shared_ptr<BrokerIf> broker_fetch;
             boost::shared_ptr<TTransport> broker_fetch_transport;
             std::shared_ptr<BrokerIf> broker_process;
             boost::shared_ptr<TTransport> broker_process_transport;
-            id_t last_msg_id = -1;
+            // the client is shared by the processing threads and the callbacks
+            // of process_message_async
+            mutable std::mutex broker_process_mtx;
+            // set by the embedded constructor, these move the messages into
+            // the broker instead of copying them
+            std::function<id_t(const std::string&, Message&&,
+                    const std::vector<Dependency>&)> embedded_add;
+            std::function<void(std::vector<id_t>&, const std::string&,
+                    std::vector<Message>&&, const std::vector<Dependency>&)> embedded_add_group;
+            // outcomes not yet reported, they are sent along with the next fetch
+            mutable std::vector<Outcome> pending_outcomes;
+            mutable std::mutex pending_outcomes_mtx;
+            // by the name of the queue emitted to
+            std::unordered_map<std::string, CompressionOptions> compression;
 
             static const int zk_recv_timeout = 3000;
             static const int buf_low_water_mark = 3;
             static const int buf_high_water_mark = 5;
+            static const int max_backoff_ms = 1000;
 
             // for testing
             BaseWorker(const std::string& queue_name,
                     const std::shared_ptr<BrokerIf>& broker_fetch,
                     const std::shared_ptr<BrokerIf>& broker_process):
                 running(false),
-                broker_fetch(broker_fetch),
-                broker_process(broker_process),
+                queue_name(queue_name),
                 msg_buffer(buf_low_water_mark, buf_high_water_mark),
-                queue_name(queue_name) {}
+                broker_fetch(broker_fetch),
+                broker_process(broker_process) {}
     };
 
 }
@@ -9,19 +9,150 @@ struct Dependency {
   2: i32 n,
 }
 
+// how a payload is encoded, decoded by the consuming worker
+enum Compression {
+  NONE,
+  LZ4,  // the uncompressed size as a little-endian u32, then an lz4 block
+  ZSTD,  // a zstd frame
+}
+
 struct Message {
   1: optional id_t id,
   2: optional string resolve_dep,
   3: MessageType type,
   4: binary payload,
+  5: optional i32 priority = 0,  // 0 to 3, higher ones are fetched first
+  // milliseconds since the epoch, the message is not handed out before then
+  6: optional i64 not_before,
+  // dropped if not fetched within this many milliseconds after being added,
+  // 0 for never. overrides QueueOptions.ttl_ms
+  7: optional i32 ttl_ms,
+  8: optional Compression compression = Compression.NONE,
+  // messages with the same key are handed to the same consumer of the queue
+  // for as long as the consumers stay the same, see ackAndGetMessage
+  9: optional string partition_key,
+  10: optional string queue_name,  // set when fetched by ackAndGetAnyMessage
+  // with resolve_dep, the payload is kept by the broker once the message is
+  // acked, and handed to the dependants of resolve_dep in joined. it is kept
+  // until the dependants waiting at the time are satisfied
+  11: optional bool join = false,
+  // set when fetched, the payloads of the first n joining messages to resolve
+  // each of the dependencies, grouped by dependency in the order they were
+  // satisfied. an expired resolver leaves no payload
+  12: optional list<binary> joined,
+  // set along with joined, how each of its payloads is encoded
+  13: optional list<Compression> joined_compression,
+}
+
+// what became of a message handed out to a worker
+struct Outcome {
+  1: id_t msg_id,
+  2: bool acked,  // failed if false
+  3: optional string queue_name,  // required by ackAndGetAnyMessage
+}
+
+// a queue fetched from by ackAndGetAnyMessage
+struct Subscription {
+  1: string queue_name,
+  // the share of the fetches the queue gets while others have messages too.
+  // taken as 1 if not positive
+  2: i32 weight = 1,
+}
+
+// what a queue does when one of its limits or the broker's memory budget is hit
+enum OverflowPolicy {
+  REJECT,  // wait for up to block_ms, then throw Overloaded
+  DROP_OLDEST,  // drop the oldest free messages of the lowest priority as if they had failed
+  SPILL,  // keep the payloads of new messages on disk until they are fetched
+}
+
+// limits of a queue, 0 for unlimited
+struct QueueOptions {
+  1: i64 max_messages = 0,  // messages added but not yet acked or failed
+  2: i64 max_bytes = 0,  // bytes held by these messages, see QueueStats.message_bytes
+  3: i32 block_ms = 0,  // how long adding to a full queue waits before Overloaded
+  4: OverflowPolicy overflow_policy = OverflowPolicy.REJECT,
+  // how many messages in a row may be fetched ahead of an older one of lower
+  // priority before the oldest free message goes first, 0 for never
+  5: i32 starvation_limit = 16,
+  // for messages without their own ttl_ms. an expired message resolves its
+  // resolve_dep, so its dependants are not stuck
+  6: i32 ttl_ms = 0,
+  // messages with the same partition_key are handed out one at a time, in the
+  // order they become free. the next one waits until the previous one is
+  // acked, failed, dropped or expired
+  7: bool ordered = false,
+  // a message out for longer than this percentile of the recent processing
+  // times, and at least hedge_min_ms, is handed to another worker as well,
+  // once. the first ack counts, a fail only does if no other attempt is out.
+  // 0 for never, spilled messages are never hedged
+  8: i32 hedge_percentile = 0,
+  9: i32 hedge_min_ms = 0,
+  // a free message is fetched as if its priority were raised by the number of
+  // messages waiting for its resolve_dep: 1 for one, 2 for two or three, 3 for
+  // more. an explicit priority above that is kept
+  10: bool critical_path = false,
+}
+
+struct QueueStats {
+  1: i64 n_messages,  // added but not yet acked or failed
+  2: i64 n_free,  // ready to be fetched
+  3: i64 n_dependencies,  // dependency keys, these are never freed
+  4: i64 payload_bytes,
+  5: i64 message_bytes,  // payloads plus per-message bookkeeping
+  6: i64 dependency_bytes,
+  7: i64 n_dropped,
+  8: i64 n_rejected,  // adds failed with Overloaded
+  9: i64 n_spilled,  // messages with their payloads on disk
+  10: i64 spilled_bytes,  // not included in payload_bytes
+  11: i64 n_delayed,  // free but not due yet, see Message.not_before
+  12: i64 n_expired,
+  13: i32 n_consumers,  // fetching with a consumer_id, see ackAndGetMessage
+  14: i64 n_lanes,  // partition keys with a message out, see QueueOptions.ordered
+  15: i64 n_hedged,  // see QueueOptions.hedge_percentile
+}
+
+struct BrokerStats {
+  1: i64 memory_budget,  // 0 for unlimited
+  2: i64 used_bytes,  // message and dependency bytes of all the queues
+  3: map<string, QueueStats> queues,
 }
 
 exception Timeout {}
 
+// the queue is full, back off and retry
+exception Overloaded {
+  1: i32 retry_after_ms,
+}
+
 service Broker {
   Message getMessage(1: string queue_name, 2: id_t last_msg) throws (1:Timeout e),
-  id_t addMessage(1: string queue_name, 2: Message message, 3: list<Dependency> deps),
-  list<id_t> addMessageGroup(1: string queue_name, 2: list<Message> messages, 3: list<Dependency> deps),
+  id_t addMessage(1: string queue_name, 2: Message message, 3: list<Dependency> deps) throws (1:Overloaded e),
+  list<id_t> addMessageGroup(1: string queue_name, 2: list<Message> messages, 3: list<Dependency> deps) throws (1:Overloaded e),
+  // adds n_copies of the message to each of the queues, keeping the payload
+  // once for them all. the ids are n_copies for each queue, in the order of
+  // queue_names. either all or none of the copies are added, a queue throwing
+  // Overloaded leaves the others untouched
+  list<id_t> publish(1: list<string> queue_names, 2: Message message, 3: i32 n_copies, 4: list<Dependency> deps) throws (1:Overloaded e),
   oneway void ack(1: string queue_name, 2: id_t msg_id),
   oneway void fail(1: string queue_name, 2: id_t msg_id),
+  // applies the outcomes of previously fetched messages, then fetches the next one.
+  // a consumer_id joins the consumers of the queue, which share the partition
+  // keys between them. without one only messages without a key are fetched,
+  // unless the queue has no consumers at all
+  Message ackAndGetMessage(1: string queue_name, 2: list<Outcome> outcomes, 3: string consumer_id) throws (1:Timeout e),
+  // as ackAndGetMessage, from whichever of the queues has a message first.
+  // when several have, each is picked in proportion to its weight
+  Message ackAndGetAnyMessage(1: list<Subscription> subscriptions, 2: list<Outcome> outcomes, 3: string consumer_id) throws (1:Timeout e),
+  // hands the partition keys of a consumer over to the others
+  oneway void leaveQueue(1: string queue_name, 2: string consumer_id),
+  oneway void ackBatch(1: string queue_name, 2: list<Outcome> outcomes),
+  // hands fetched messages back unprocessed, to be fetched again right away,
+  // e.g. by another worker while this one shuts down
+  oneway void releaseMessages(1: string queue_name, 2: list<id_t> msg_ids),
+  void configureQueue(1: string queue_name, 2: QueueOptions options),
+  QueueStats getQueueStats(1: string queue_name),
+  BrokerStats getBrokerStats(),
+  // bytes all the queues may hold together, 0 for unlimited
+  void setMemoryBudget(1: i64 max_bytes),
 }
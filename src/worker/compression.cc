@@ -0,0 +1,200 @@
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#ifdef PORK_WITH_LZ4
+#include <lz4.h>
+#endif
+#ifdef PORK_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compression.h"
+#include "proto_types.h"
+
+namespace pork {
+
+    namespace {
+        const size_t LZ4_HEADER_SIZE = 4;  // the uncompressed size
+        // lz4 cannot do better than this, a larger size in the header means
+        // the payload is corrupted
+        const size_t LZ4_MAX_RATIO = 255;
+
+#ifdef PORK_WITH_LZ4
+        bool lz4_compress(const std::string& src, std::string& dst, int level)
+        {
+            if (src.size() > size_t(LZ4_MAX_INPUT_SIZE)) {
+                return false;
+            }
+            dst.resize(LZ4_HEADER_SIZE + LZ4_compressBound(src.size()));
+            uint32_t n = src.size();
+            for (size_t i = 0; i < LZ4_HEADER_SIZE; ++i) {
+                dst[i] = static_cast<char>(n >> (8 * i));
+            }
+            // for lz4 a higher level trades ratio for speed
+            int n_compressed = LZ4_compress_fast(src.data(), &dst[LZ4_HEADER_SIZE],
+                    src.size(), dst.size() - LZ4_HEADER_SIZE, level > 0 ? level : 1);
+            if (n_compressed <= 0) {
+                return false;
+            }
+            dst.resize(LZ4_HEADER_SIZE + n_compressed);
+            return true;
+        }
+
+        void lz4_decompress(const std::string& src, std::string& dst)
+        {
+            if (src.size() < LZ4_HEADER_SIZE) {
+                throw std::runtime_error("Truncated lz4 payload");
+            }
+            uint32_t n = 0;
+            for (size_t i = 0; i < LZ4_HEADER_SIZE; ++i) {
+                n |= uint32_t(static_cast<uint8_t>(src[i])) << (8 * i);
+            }
+            if (n > (src.size() - LZ4_HEADER_SIZE) * LZ4_MAX_RATIO) {
+                throw std::runtime_error("Corrupted lz4 payload");
+            }
+            dst.resize(n);
+            int n_decompressed = LZ4_decompress_safe(src.data() + LZ4_HEADER_SIZE,
+                    &dst[0], src.size() - LZ4_HEADER_SIZE, n);
+            if (n_decompressed < 0 || uint32_t(n_decompressed) != n) {
+                throw std::runtime_error("Corrupted lz4 payload");
+            }
+        }
+#endif
+
+#ifdef PORK_WITH_ZSTD
+        // creating a context costs more than compressing a small payload,
+        // each thread keeps its own
+        struct ZstdContexts {
+            ~ZstdContexts() {
+                ZSTD_freeCCtx(cctx);
+                ZSTD_freeDCtx(dctx);
+            }
+            ZSTD_CCtx* cctx = ZSTD_createCCtx();
+            ZSTD_DCtx* dctx = ZSTD_createDCtx();
+        };
+
+        ZstdContexts& zstd_contexts()
+        {
+            static thread_local ZstdContexts contexts;
+            return contexts;
+        }
+
+        bool zstd_compress(const std::string& src, std::string& dst, int level)
+        {
+            dst.resize(ZSTD_compressBound(src.size()));
+            size_t n = ZSTD_compressCCtx(zstd_contexts().cctx,
+                    &dst[0], dst.size(), src.data(), src.size(),
+                    level > 0 ? level : ZSTD_CLEVEL_DEFAULT);
+            if (ZSTD_isError(n)) {
+                return false;
+            }
+            dst.resize(n);
+            return true;
+        }
+
+        void zstd_decompress(const std::string& src, std::string& dst)
+        {
+            unsigned long long n = ZSTD_getFrameContentSize(src.data(), src.size());
+            if (n == ZSTD_CONTENTSIZE_ERROR || n == ZSTD_CONTENTSIZE_UNKNOWN) {
+                throw std::runtime_error("Corrupted zstd payload");
+            }
+            dst.resize(n);
+            size_t n_decompressed = ZSTD_decompressDCtx(zstd_contexts().dctx,
+                    &dst[0], n, src.data(), src.size());
+            if (ZSTD_isError(n_decompressed) || n_decompressed != n) {
+                throw std::runtime_error("Corrupted zstd payload");
+            }
+        }
+#endif
+
+        void decompress(std::string& payload, Compression::type codec)
+        {
+            std::string decompressed;
+            switch (codec) {
+#ifdef PORK_WITH_LZ4
+                case Compression::LZ4:
+                    lz4_decompress(payload, decompressed);
+                    break;
+#endif
+#ifdef PORK_WITH_ZSTD
+                case Compression::ZSTD:
+                    zstd_decompress(payload, decompressed);
+                    break;
+#endif
+                default:
+                    throw std::runtime_error("Unsupported compression codec");
+            }
+            payload.swap(decompressed);
+        }
+    }
+
+    bool compression_supported(Compression::type codec)
+    {
+        switch (codec) {
+            case Compression::NONE:
+                return true;
+#ifdef PORK_WITH_LZ4
+            case Compression::LZ4:
+                return true;
+#endif
+#ifdef PORK_WITH_ZSTD
+            case Compression::ZSTD:
+                return true;
+#endif
+            default:
+                return false;
+        }
+    }
+
+    bool compress_payload(Message& msg, Compression::type codec, int level)
+    {
+        if (!compression_supported(codec)) {
+            throw std::invalid_argument("Unsupported compression codec");
+        }
+        if (codec == Compression::NONE || msg.compression != Compression::NONE) {
+            return false;
+        }
+
+        std::string compressed;
+        bool ok = false;
+        switch (codec) {
+#ifdef PORK_WITH_LZ4
+            case Compression::LZ4:
+                ok = lz4_compress(msg.payload, compressed, level);
+                break;
+#endif
+#ifdef PORK_WITH_ZSTD
+            case Compression::ZSTD:
+                ok = zstd_compress(msg.payload, compressed, level);
+                break;
+#endif
+            default:
+                break;
+        }
+        if (!ok || compressed.size() >= msg.payload.size()) {
+            return false;
+        }
+        msg.payload.swap(compressed);
+        msg.__set_compression(codec);
+        return true;
+    }
+
+    void decompress_payload(Message& msg)
+    {
+        if (msg.compression != Compression::NONE) {
+            decompress(msg.payload, msg.compression);
+            msg.__set_compression(Compression::NONE);
+        }
+        size_t n = std::min(msg.joined.size(), msg.joined_compression.size());
+        for (size_t i = 0; i < n; ++i) {
+            if (msg.joined_compression[i] != Compression::NONE) {
+                decompress(msg.joined[i], msg.joined_compression[i]);
+                msg.joined_compression[i] = Compression::NONE;
+            }
+        }
+    }
+
+} /* pork */
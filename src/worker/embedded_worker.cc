@@ -0,0 +1,30 @@
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "broker/broker_handler.h"
+#include "proto_types.h"
+#include "worker.h"
+
+namespace pork {
+
+    BaseWorker::BaseWorker(const std::shared_ptr<BrokerHandler>& broker,
+            const std::string& queue_name):
+        running(false),
+        queue_name(queue_name),
+        msg_buffer(buf_low_water_mark, buf_high_water_mark),
+        broker_fetch(broker),
+        broker_process(broker)
+    {
+        embedded_add = [broker] (const std::string& queue_name, Message&& msg,
+                const std::vector<Dependency>& deps) {
+            return broker->addMessage(queue_name, std::move(msg), deps);
+        };
+        embedded_add_group = [broker] (std::vector<id_t>& new_msg_ids,
+                const std::string& queue_name, std::vector<Message>&& msgs,
+                const std::vector<Dependency>& deps) {
+            broker->addMessageGroup(new_msg_ids, queue_name, std::move(msgs), deps);
+        };
+    }
+
+} /* pork */
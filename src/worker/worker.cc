@@ -1,9 +1,18 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <map>
+#include <stdexcept>
 #include <string>
 #include <tuple>
 #include <vector>
 #include <memory>
+#include <mutex>
 #include <thread>
 
+#include <unistd.h>
+
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/smart_ptr.hpp>
@@ -14,26 +23,46 @@
 
 #include "Broker.h"
 #include "common.h"
+#include "compression.h"
 #include "flow_control_queue.h"
 #include "proto_types.h"
+#include "shm_transport.h"
 #include "worker.h"
 
 namespace tft = apache::thrift;
 
 namespace pork {
 
+    // std::min takes it by reference
+    const int BaseWorker::max_backoff_ms;
+
     BaseWorker::BaseWorker(const std::vector<std::string>& zk_hosts,
             const std::string& queue_name):
         running(false),
         zk_handle(get_zk_handle(zk_hosts)),
-        msg_buffer(buf_low_water_mark, buf_high_water_mark),
-        queue_name(queue_name)
+        queue_name(queue_name),
+        msg_buffer(buf_low_water_mark, buf_high_water_mark)
     {
         std::string host;
         uint16_t port;
         get_broker_address(host, port);
-        init_broker_client(host, port, true);
-        init_broker_client(host, port, false);
+        std::string shm_path;
+        if (is_local_host(host)) {
+            get_broker_shm_path(shm_path);
+        }
+        init_broker_client(host, port, shm_path, true);
+        init_broker_client(host, port, shm_path, false);
+    }
+
+    BaseWorker::BaseWorker(const std::string& broker_host, uint16_t broker_port,
+            const std::string& queue_name, const std::string& shm_path):
+        running(false),
+        queue_name(queue_name),
+        msg_buffer(buf_low_water_mark, buf_high_water_mark)
+    {
+        std::string local_shm_path = is_local_host(broker_host) ? shm_path : "";
+        init_broker_client(broker_host, broker_port, local_shm_path, true);
+        init_broker_client(broker_host, broker_port, local_shm_path, false);
     }
 
     BaseWorker::~BaseWorker()
@@ -56,12 +85,35 @@ namespace pork {
                 hosts_str.c_str(), nullptr, zk_recv_timeout, nullptr, nullptr, 0);
     }
 
-    void BaseWorker::init_broker_client(const std::string& host, uint16_t port, bool fetch)
+    std::string BaseWorker::default_consumer_id()
     {
-        boost::shared_ptr<tft::transport::TTransport> socket(
-                new tft::transport::TSocket(host, port));
-        boost::shared_ptr<tft::transport::TTransport> transport(
-                new tft::transport::TBufferedTransport(socket));
+        static std::atomic<int> n_workers(0);
+        char host[256] = "";
+        gethostname(host, sizeof(host) - 1);
+        return std::string(host) + ":" + std::to_string(getpid())
+            + ":" + std::to_string(n_workers++);
+    }
+
+    void BaseWorker::init_broker_client(const std::string& host, uint16_t port,
+            const std::string& shm_path, bool fetch)
+    {
+        boost::shared_ptr<tft::transport::TTransport> transport;
+        if (!shm_path.empty()) {
+            // the shm rings do the buffering, no TBufferedTransport needed
+            transport.reset(new TShmTransport(shm_path));
+            try {
+                transport->open();
+            } catch (const tft::transport::TTransportException& e) {
+                LOG_WARNING << "Failed to connect to the broker via shared memory, "
+                    << "falling back to tcp: " << e.what();
+                transport.reset();
+            }
+        }
+        if (!transport) {
+            boost::shared_ptr<tft::transport::TTransport> socket(
+                    new tft::transport::TSocket(host, port));
+            transport.reset(new tft::transport::TBufferedTransport(socket));
+        }
         boost::shared_ptr<tft::protocol::TProtocol> protocol(
                 new tft::protocol::TBinaryProtocol(transport));
         if (fetch) {
@@ -86,25 +138,116 @@ namespace pork {
         host.erase(semicolon_pos);
     }
 
+    void BaseWorker::get_broker_shm_path(std::string& shm_path) const
+    {
+        char buf[256];
+        int buf_size = sizeof(buf);
+        int ret = zoo_get(zk_handle, ZNODE_BROKER_SHM_PATH,
+                0, buf, &buf_size, nullptr);
+        if (ret == ZOK && buf_size > 0) {
+            shm_path.assign(buf, buf_size);
+        } else {
+            shm_path.clear();  // broker without shm support
+        }
+    }
+
     void BaseWorker::run()
     {
         if (running) {
             return;
         }
         running = true;
-        std::thread processing_thread(&BaseWorker::process, this);
+        register_consumer();
+        std::vector<std::thread> processing_threads;
+        for (size_t i = 0; i < n_process_threads; ++i) {
+            processing_threads.emplace_back(max_in_flight > 1
+                    ? &BaseWorker::process_async : &BaseWorker::process, this);
+        }
         while (running) {
-            msg_buffer.wait_till_low();
+            // timed, so a stop is noticed while the buffer is full
+            if (!msg_buffer.wait_till_low_for(100) || !running) {
+                continue;
+            }
             Message new_msg;
+            std::vector<Outcome> outcomes;
+            take_outcomes(outcomes);
             try {
-                broker_fetch->getMessage(new_msg, queue_name, last_msg_id);
+                if (subscriptions.empty()) {
+                    broker_fetch->ackAndGetMessage(new_msg, queue_name, outcomes, consumer_id);
+                } else {
+                    broker_fetch->ackAndGetAnyMessage(
+                            new_msg, subscriptions, outcomes, consumer_id);
+                }
             } catch (const Timeout&) {
                 continue;
             }
             msg_buffer.put(new_msg);
-            last_msg_id = new_msg.id;
         }
-        processing_thread.join();
+        for (auto& t : processing_threads) {
+            t.join();
+        }
+        {
+            std::unique_lock<std::mutex> lock(in_flight_mtx);
+            in_flight_cv.wait(lock, [this] () { return n_in_flight == 0; });
+        }
+        if (drain_on_stop) {
+            release_buffered();
+        }
+        flush_outcomes();
+        if (subscriptions.empty()) {
+            broker_fetch->leaveQueue(queue_name, consumer_id);
+        }
+        for (auto& sub : subscriptions) {
+            broker_fetch->leaveQueue(sub.queue_name, consumer_id);
+        }
+        unregister_consumer();
+    }
+
+    void BaseWorker::register_consumer()
+    {
+        if (!zk_handle) {
+            return;
+        }
+        std::string path = std::string(ZNODE_CONSUMERS) + "/" + consumer_id;
+        int ret = zoo_create(zk_handle, path.c_str(), nullptr, -1,
+                &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL, nullptr, 0);
+        if (ret == ZNODEEXISTS) {
+            // left by an earlier run with the same id whose session has not
+            // expired yet, its messages are taken back along with the znode
+            zoo_delete(zk_handle, path.c_str(), -1);
+            ret = zoo_create(zk_handle, path.c_str(), nullptr, -1,
+                    &ZOO_OPEN_ACL_UNSAFE, ZOO_EPHEMERAL, nullptr, 0);
+        }
+        if (ret != ZOK) {
+            LOG_WARNING << "Failed to register consumer " << consumer_id
+                << ", its messages stay out if it dies: " << zerror(ret);
+        }
+    }
+
+    void BaseWorker::unregister_consumer()
+    {
+        if (zk_handle) {
+            std::string path = std::string(ZNODE_CONSUMERS) + "/" + consumer_id;
+            zoo_delete(zk_handle, path.c_str(), -1);
+        }
+    }
+
+    void BaseWorker::subscribe(const std::string& queue_name, int weight)
+    {
+        if (subscriptions.empty()) {
+            subscriptions.emplace_back();
+            subscriptions.back().queue_name = this->queue_name;
+            subscriptions.back().weight = 1;
+        }
+        for (auto& sub : subscriptions) {
+            if (sub.queue_name == queue_name) {
+                sub.weight = weight;
+                return;
+            }
+        }
+        subscriptions.emplace_back();
+        subscriptions.back().queue_name = queue_name;
+        subscriptions.back().weight = weight;
     }
 
     void BaseWorker::stop()
@@ -112,37 +255,362 @@ namespace pork {
         running = false;
     }
 
+    void BaseWorker::set_batching(size_t max_messages, int linger_ms)
+    {
+        max_batch = std::max<size_t>(max_messages, 1);
+        batch_linger_ms = linger_ms;
+        resize_buffer();
+    }
+
+    void BaseWorker::set_concurrency(size_t max_in_flight, size_t n_threads)
+    {
+        this->max_in_flight = std::max<size_t>(max_in_flight, 1);
+        n_process_threads = std::min(std::max<size_t>(n_threads, 1), this->max_in_flight);
+        resize_buffer();
+    }
+
+    void BaseWorker::resize_buffer()
+    {
+        // keep a batch worth, or as many as are in flight, of messages fetched
+        size_t low = std::max<size_t>(buf_low_water_mark, std::max(max_batch, max_in_flight));
+        msg_buffer.set_water_marks(low, low + buf_high_water_mark - buf_low_water_mark);
+    }
+
+    std::vector<bool> BaseWorker::process_messages(const std::vector<Message>& msgs)
+    {
+        std::vector<bool> acked;
+        acked.reserve(msgs.size());
+        for (auto& msg : msgs) {
+            acked.push_back(process_message(msg));
+        }
+        return acked;
+    }
+
     void BaseWorker::process()
     {
+        std::vector<Message> batch;
+        std::vector<Message> msgs;
         while (running) {
             try {
-                Message msg = msg_buffer.pop(1000);
-                if (process_message(msg)) {
-                    broker_process->ack(queue_name, msg.id);
-                } else {
-                    broker_process->fail(queue_name, msg.id);
+                msg_buffer.pop_batch(batch, max_batch, batch_linger_ms, 1000);
+            } catch (const decltype(msg_buffer)::Timeout&) {
+                continue;
+            }
+            msgs.clear();
+            for (auto& msg : batch) {
+                try {
+                    decompress_payload(msg);
+                } catch (const std::exception& e) {
+                    LOG_WARNING << "Failed to decompress message " << msg.id
+                        << ": " << e.what();
+                    report(msg, false);
+                    continue;
                 }
+                msgs.push_back(std::move(msg));
+            }
+            if (msgs.empty()) {
+                continue;
+            }
+            auto acked = process_messages(msgs);
+            if (acked.size() != msgs.size()) {
+                LOG_WARNING << "process_messages returned " << acked.size()
+                    << " outcomes for " << msgs.size() << " messages";
+                acked.resize(msgs.size(), false);  // the missing ones failed
+            }
+            report(msgs, acked);
+        }
+    }
+
+    void BaseWorker::process_message_async(
+            Message msg, std::function<void(bool)> done)
+    {
+        done(process_message(msg));
+    }
+
+    void BaseWorker::process_async()
+    {
+        while (running) {
+            {
+                std::unique_lock<std::mutex> lock(in_flight_mtx);
+                if (!in_flight_cv.wait_for(lock, std::chrono::milliseconds(1000),
+                            [this] () { return n_in_flight < max_in_flight; })) {
+                    continue;
+                }
+                ++n_in_flight;
+            }
+            Message msg;
+            try {
+                msg = msg_buffer.pop(1000);
             } catch (const decltype(msg_buffer)::Timeout&) {
-                // do nothing
+                finish_in_flight();
+                continue;
+            }
+            try {
+                decompress_payload(msg);
+            } catch (const std::exception& e) {
+                LOG_WARNING << "Failed to decompress message " << msg.id
+                    << ": " << e.what();
+                report(msg, false);
+                finish_in_flight();
+                continue;
+            }
+            // what report needs, without the payload
+            Message header;
+            header.__set_id(msg.id);
+            if (msg.__isset.queue_name) {
+                header.__set_queue_name(msg.queue_name);
+            }
+            process_message_async(std::move(msg), [this, header] (bool acked) {
+                report(header, acked);
+                finish_in_flight();
+            });
+        }
+    }
+
+    void BaseWorker::finish_in_flight()
+    {
+        std::lock_guard<std::mutex> lock(in_flight_mtx);
+        --n_in_flight;
+        in_flight_cv.notify_all();
+    }
+
+    void BaseWorker::report(const Message& msg, bool acked)
+    {
+        {
+            std::lock_guard<std::mutex> lock(pending_outcomes_mtx);
+            add_outcome(msg, acked);
+        }
+        // the fetching thread only calls the broker once the buffer runs low,
+        // and is probably waiting on an empty queue once the buffer is empty.
+        // don't keep the dependants of these messages waiting until then
+        if (msg_buffer.empty()) {
+            flush_outcomes();
+        }
+    }
+
+    void BaseWorker::report(const std::vector<Message>& msgs, const std::vector<bool>& acked)
+    {
+        {
+            std::lock_guard<std::mutex> lock(pending_outcomes_mtx);
+            for (size_t i = 0; i < msgs.size(); ++i) {
+                add_outcome(msgs[i], acked[i]);
+            }
+        }
+        // as a single report, all of them in one ackBatch
+        if (msg_buffer.empty()) {
+            flush_outcomes();
+        }
+    }
+
+    void BaseWorker::add_outcome(const Message& msg, bool acked)
+    {
+        pending_outcomes.emplace_back();
+        pending_outcomes.back().msg_id = msg.id;
+        pending_outcomes.back().acked = acked;
+        if (msg.__isset.queue_name) {
+            pending_outcomes.back().__set_queue_name(msg.queue_name);
+        }
+    }
+
+    void BaseWorker::take_outcomes(std::vector<Outcome>& outcomes) const
+    {
+        std::lock_guard<std::mutex> lock(pending_outcomes_mtx);
+        outcomes.swap(pending_outcomes);
+    }
+
+    void BaseWorker::flush_outcomes() const
+    {
+        std::vector<Outcome> outcomes;
+        take_outcomes(outcomes);
+        if (outcomes.empty()) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(broker_process_mtx);
+        if (subscriptions.empty()) {
+            broker_process->ackBatch(queue_name, outcomes);
+            return;
+        }
+        std::map<std::string, std::vector<Outcome>> by_queue;
+        for (auto& outcome : outcomes) {
+            by_queue[outcome.queue_name].push_back(outcome);
+        }
+        for (auto& batch : by_queue) {
+            broker_process->ackBatch(batch.first, batch.second);
+        }
+    }
+
+    void BaseWorker::release_buffered()
+    {
+        std::vector<Message> msgs;
+        try {
+            msg_buffer.pop_batch(msgs, std::numeric_limits<size_t>::max(), 0, 0);
+        } catch (const decltype(msg_buffer)::Timeout&) {
+            return;  // nothing left
+        }
+        std::map<std::string, std::vector<id_t>> by_queue;
+        for (auto& msg : msgs) {
+            by_queue[msg.__isset.queue_name ? msg.queue_name : queue_name].push_back(msg.id);
+        }
+        std::lock_guard<std::mutex> lock(broker_process_mtx);
+        for (auto& batch : by_queue) {
+            broker_process->releaseMessages(batch.first, batch.second);
+        }
+    }
+
+    template<typename F>
+    auto BaseWorker::add_with_backoff(const F& add) const -> decltype(add())
+    {
+        int backoff_ms = 0;
+        while (true) {
+            try {
+                return add();
+            } catch (const Overloaded& e) {
+                // the queue might be waiting for our own outcomes to drain
+                flush_outcomes();
+                backoff_ms = std::min(max_backoff_ms,
+                        std::max(e.retry_after_ms, backoff_ms * 2));
+                std::this_thread::sleep_for(std::chrono::milliseconds(backoff_ms));
             }
         }
     }
 
+    void BaseWorker::set_compression(const std::string& queue_name,
+            Compression::type codec, size_t min_bytes, int level)
+    {
+        if (!compression_supported(codec)) {
+            throw std::invalid_argument("Unsupported compression codec");
+        }
+        compression[queue_name] = CompressionOptions{codec, min_bytes, level};
+    }
+
+    bool BaseWorker::should_compress(
+            const std::string& queue_name, const Message& msg) const
+    {
+        auto iter = compression.find(queue_name);
+        return iter != compression.end()
+            && iter->second.codec != Compression::NONE
+            && msg.compression == Compression::NONE
+            && msg.payload.size() >= iter->second.min_bytes;
+    }
+
+    void BaseWorker::compress(const std::string& queue_name, Message& msg) const
+    {
+        if (should_compress(queue_name, msg)) {
+            auto& options = compression.find(queue_name)->second;
+            compress_payload(msg, options.codec, options.level);
+        }
+    }
+
     id_t BaseWorker::emit(
             const std::string &queue_name,
             const Message &msg,
             const std::vector<Dependency> &deps) const
     {
-        return broker_process->addMessage(queue_name, msg, deps);
+        if (should_compress(queue_name, msg)) {
+            Message compressed(msg);
+            compress(queue_name, compressed);
+            return add_message(queue_name, compressed, deps);
+        }
+        return add_message(queue_name, msg, deps);
     }
 
     std::vector<id_t> BaseWorker::emit(
             const std::string &queue_name,
             const std::vector<Message> &msgs,
             const std::vector<Dependency> &deps) const
+    {
+        for (auto& msg : msgs) {
+            if (should_compress(queue_name, msg)) {
+                std::vector<Message> compressed(msgs);
+                for (auto& msg : compressed) {
+                    compress(queue_name, msg);
+                }
+                return add_message_group(queue_name, compressed, deps);
+            }
+        }
+        return add_message_group(queue_name, msgs, deps);
+    }
+
+    id_t BaseWorker::emit(
+            const std::string& queue_name,
+            Message&& msg,
+            const std::vector<Dependency>& deps) const
+    {
+        compress(queue_name, msg);
+        if (embedded_add) {
+            // an overloaded queue leaves msg untouched, so it can be retried
+            return add_with_backoff([&] () {
+                return embedded_add(queue_name, std::move(msg), deps);
+            });
+        }
+        return add_message(queue_name, msg, deps);
+    }
+
+    std::vector<id_t> BaseWorker::emit(
+            const std::string &queue_name,
+            std::vector<Message>&& msgs,
+            const std::vector<Dependency>& deps) const
+    {
+        for (auto& msg : msgs) {
+            compress(queue_name, msg);
+        }
+        if (embedded_add_group) {
+            std::vector<id_t> new_msg_ids;
+            add_with_backoff([&] () {
+                embedded_add_group(new_msg_ids, queue_name, std::move(msgs), deps);
+            });
+            return new_msg_ids;
+        }
+        return add_message_group(queue_name, msgs, deps);
+    }
+
+    std::vector<id_t> BaseWorker::publish(
+            const std::vector<std::string>& queue_names,
+            const Message& msg,
+            int n_copies,
+            const std::vector<Dependency>& deps) const
+    {
+        std::vector<id_t> new_msg_ids;
+        for (auto& queue_name : queue_names) {
+            if (should_compress(queue_name, msg)) {
+                Message compressed(msg);
+                compress(queue_name, compressed);
+                add_with_backoff([&] () {
+                    std::lock_guard<std::mutex> lock(broker_process_mtx);
+                    broker_process->publish(
+                            new_msg_ids, queue_names, compressed, n_copies, deps);
+                });
+                return new_msg_ids;
+            }
+        }
+        add_with_backoff([&] () {
+            std::lock_guard<std::mutex> lock(broker_process_mtx);
+            broker_process->publish(new_msg_ids, queue_names, msg, n_copies, deps);
+        });
+        return new_msg_ids;
+    }
+
+    id_t BaseWorker::add_message(
+            const std::string& queue_name,
+            const Message& msg,
+            const std::vector<Dependency>& deps) const
+    {
+        return add_with_backoff([&] () {
+            std::lock_guard<std::mutex> lock(broker_process_mtx);
+            return broker_process->addMessage(queue_name, msg, deps);
+        });
+    }
+
+    std::vector<id_t> BaseWorker::add_message_group(
+            const std::string& queue_name,
+            const std::vector<Message>& msgs,
+            const std::vector<Dependency>& deps) const
     {
         std::vector<id_t> new_msg_ids;
-        broker_process->addMessageGroup(new_msg_ids, queue_name, msgs, deps);
+        add_with_backoff([&] () {
+            std::lock_guard<std::mutex> lock(broker_process_mtx);
+            broker_process->addMessageGroup(new_msg_ids, queue_name, msgs, deps);
+        });
         return new_msg_ids;
     }
 
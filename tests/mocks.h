@@ -1,5 +1,7 @@
 #include <deque>
 #include <memory>
+#include <mutex>
+#include <string>
 #include <tuple>
 #include <vector>
 
@@ -29,14 +31,59 @@ namespace pork {
                         const std::vector<Message>& messages,
                         const std::vector<Dependency>& deps));
 
+            MOCK_METHOD5(publish, void(
+                        std::vector<id_t>& _return,
+                        const std::vector<std::string>& queue_names,
+                        const Message& message,
+                        const int32_t n_copies,
+                        const std::vector<Dependency>& deps));
+
             MOCK_METHOD2(ack, void(const std::string& queue_name, const id_t msg_id));
 
             MOCK_METHOD2(fail, void(const std::string& queue_name, const id_t msg_id));
+
+            MOCK_METHOD4(ackAndGetMessage, void(
+                        Message& _return,
+                        const std::string& queue_name,
+                        const std::vector<Outcome>& outcomes,
+                        const std::string& consumer_id));
+
+            MOCK_METHOD4(ackAndGetAnyMessage, void(
+                        Message& _return,
+                        const std::vector<Subscription>& subscriptions,
+                        const std::vector<Outcome>& outcomes,
+                        const std::string& consumer_id));
+
+            MOCK_METHOD2(leaveQueue, void(
+                        const std::string& queue_name,
+                        const std::string& consumer_id));
+
+            MOCK_METHOD2(ackBatch, void(
+                        const std::string& queue_name,
+                        const std::vector<Outcome>& outcomes));
+
+            MOCK_METHOD2(releaseMessages, void(
+                        const std::string& queue_name,
+                        const std::vector<id_t>& msg_ids));
+
+            MOCK_METHOD2(configureQueue, void(
+                        const std::string& queue_name,
+                        const QueueOptions& options));
+
+            MOCK_METHOD2(getQueueStats, void(
+                        QueueStats& _return,
+                        const std::string& queue_name));
+
+            MOCK_METHOD1(getBrokerStats, void(BrokerStats& _return));
+
+            MOCK_METHOD1(setMemoryBudget, void(const int64_t max_bytes));
     };
 
     class FakeMessageQueue: public AbstractMessageQueue {
         public:
-            bool pop_free_message(Message& msg) override {
+            bool pop_free_message(Message& msg,
+                    const std::string& consumer_id = "") override {
+                consumer_ids.push_back(consumer_id);
                 if (free_msgs.empty()) {
                     return false;
                 }
@@ -45,10 +92,59 @@ namespace pork {
                 return true;
             }
 
+            bool try_pop_free_message(Message& msg,
+                    const std::string& consumer_id = "") override {
+                return pop_free_message(msg, consumer_id);
+            }
+
             void push_message(
-                    const std::shared_ptr<Message>& msg,
+                    Message&& msg,
+                    const std::vector<Dependency>& deps) override {
+                pushed_msgs.emplace_back(std::move(msg), deps);
+            }
+
+            void push_message_group(
+                    std::vector<Message>&& msgs,
+                    const std::vector<Dependency>& deps) override {
+                for (auto& msg : msgs) {
+                    pushed_msgs.emplace_back(std::move(msg), deps);
+                }
+            }
+
+            void push_message_copies(
+                    const Message& msg,
+                    const SharedPayloadPtr& payload,
+                    const std::vector<id_t>& ids,
+                    const std::vector<Dependency>& deps,
+                    bool reserved = false) override {
+                if (reserved) {
+                    n_reserved -= ids.size();
+                }
+                for (id_t id : ids) {
+                    Message copy(msg);
+                    copy.__set_id(id);
+                    copy.payload = payload->data;
+                    pushed_msgs.emplace_back(std::move(copy), deps);
+                }
+            }
+
+            void reserve_copies(
+                    const Message& msg,
+                    const SharedPayloadPtr& payload,
+                    size_t n_copies,
+                    const std::vector<Dependency>& deps) override {
+                if (overloaded) {
+                    throw Overloaded();
+                }
+                n_reserved += n_copies;
+            }
+
+            void cancel_copies(
+                    const Message& msg,
+                    const SharedPayloadPtr& payload,
+                    size_t n_copies,
                     const std::vector<Dependency>& deps) override {
-                pushed_msgs.emplace_back(msg, deps);
+                n_reserved -= n_copies;
             }
 
             void ack(id_t msg_id) override {
@@ -59,11 +155,43 @@ namespace pork {
                 failed_msgs.push_back(msg_id);
             }
 
+            void requeue(id_t msg_id) override {
+                requeued_msgs.push_back(msg_id);
+            }
+
+            void remove_consumer(const std::string& consumer_id) override {
+                removed_consumers.push_back(consumer_id);
+            }
+
+            void drop_consumer(const std::string& consumer_id) override {
+                std::lock_guard<std::mutex> lock(mtx);
+                dropped_consumers.push_back(consumer_id);
+            }
+
+            void configure(const QueueOptions& options) override {
+                this->options = options;
+            }
+
+            void get_stats(QueueStats& stats) override {
+                stats = this->stats;
+            }
+
+            void expire_messages() override {}
+
             std::deque<Message> free_msgs;
-            std::deque<std::tuple<const std::shared_ptr<Message>,
+            std::deque<std::tuple<const Message,
                                   const std::vector<Dependency>>> pushed_msgs;
             std::deque<id_t> acked_msgs;
             std::deque<id_t> failed_msgs;
+            std::deque<id_t> requeued_msgs;
+            std::deque<std::string> consumer_ids;  // of every pop
+            std::deque<std::string> removed_consumers;
+            std::deque<std::string> dropped_consumers;  // by the reaper thread
+            std::mutex mtx;
+            bool overloaded = false;  // reserve_copies throws Overloaded
+            size_t n_reserved = 0;  // by reserve_copies and not yet used
+            QueueOptions options;
+            QueueStats stats;
     };
 
 }
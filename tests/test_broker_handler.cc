@@ -1,4 +1,10 @@
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <gmock/gmock.h>
@@ -16,6 +22,12 @@ namespace pork {
         public:
             TestingBrokerHandler(): BrokerHandler() {}
 
+            using BrokerHandler::consumers_gone;
+
+            static void set_fetch_any_timeout(int ms) {
+                FETCH_ANY_TIMEOUT = std::chrono::milliseconds(ms);
+            }
+
             std::shared_ptr<FakeMessageQueue> get_mq(const std::string& queue_name) {
                 return std::dynamic_pointer_cast<FakeMessageQueue>(queues.at(queue_name));
             }
@@ -27,10 +39,49 @@ namespace pork {
                 return mq;
             }
 
+            void create_and_insert_real_mq(const std::string& queue_name) {
+                queues[queue_name] = std::make_shared<MessageQueue>(memory_budget);
+            }
+
+            // stands in for the znodes under ZNODE_CONSUMERS, nullptr if
+            // zookeeper cannot be reached
+            void set_consumers(const std::map<std::string, int64_t>* consumers) {
+                std::lock_guard<std::mutex> lock(zk_mtx);
+                reachable = consumers != nullptr;
+                if (reachable) {
+                    zk_consumers = *consumers;
+                }
+            }
+
+            int n_watched() {
+                std::lock_guard<std::mutex> lock(zk_mtx);
+                return n_watches;
+            }
+
+            void zk_event(int type, int state) {
+                on_consumers_changed(nullptr, type, state, nullptr, this);
+            }
+
         protected:
             std::shared_ptr<AbstractMessageQueue> create_mq() override {
                 return std::shared_ptr<FakeMessageQueue>(new FakeMessageQueue());
             }
+
+            bool get_consumers(std::map<std::string, int64_t>& consumers) override {
+                std::lock_guard<std::mutex> lock(zk_mtx);
+                if (!reachable) {
+                    return false;
+                }
+                ++n_watches;
+                consumers = zk_consumers;
+                return true;
+            }
+
+        private:
+            std::mutex zk_mtx;
+            std::map<std::string, int64_t> zk_consumers;
+            bool reachable = true;
+            int n_watches = 0;
     };
 
     Message create_msg(const std::string& payload, id_t id = -1) {
@@ -43,6 +94,13 @@ namespace pork {
         return msg;
     }
 
+    Subscription create_sub(const std::string& queue_name, int weight = 1) {
+        Subscription sub;
+        sub.queue_name = queue_name;
+        sub.weight = weight;
+        return sub;
+    }
+
     Dependency create_dep(const std::string& key, int n) {
         Dependency dep;
         dep.key = key;
@@ -107,8 +165,8 @@ namespace pork {
         msg1.__set_id(id1);
         msg2.__set_id(id2);
 
-        EXPECT_EQ(msg1, *pushed_msg1);
-        EXPECT_EQ(msg2, *pushed_msg2);
+        EXPECT_EQ(msg1, pushed_msg1);
+        EXPECT_EQ(msg2, pushed_msg2);
 
         if (group) {
             EXPECT_THAT(pushed_deps1, ElementsAre(dep1, dep2, dep3));
@@ -127,16 +185,273 @@ namespace pork {
         TestAddMsgs(true);
     }
 
+    TEST(BrokerHandlerTest, Publish) {
+        TestingBrokerHandler h;
+        auto dep = create_dep("dep", 1);
+        std::vector<id_t> ids;
+        h.publish(ids, {"q1", "q2"}, create_msg("payload"), 3, {dep});
+        ASSERT_EQ(6u, ids.size());
+        EXPECT_EQ(6u, std::set<id_t>(ids.begin(), ids.end()).size());
+
+        for (int i = 0; i < 2; ++i) {
+            auto mq = h.get_mq(i == 0 ? "q1" : "q2");
+            ASSERT_EQ(3u, mq->pushed_msgs.size());
+            for (int j = 0; j < 3; ++j) {
+                const Message& msg = std::get<0>(mq->pushed_msgs[j]);
+                EXPECT_EQ(ids[i * 3 + j], msg.id);
+                EXPECT_EQ("payload", msg.payload);
+                EXPECT_THAT(std::get<1>(mq->pushed_msgs[j]), ElementsAre(dep));
+            }
+        }
+
+        h.publish(ids, {"q1"}, create_msg("payload"), 0, {});
+        EXPECT_TRUE(ids.empty());
+        EXPECT_EQ(3u, h.get_mq("q1")->pushed_msgs.size());
+    }
+
+    TEST(BrokerHandlerTest, PublishOverloaded) {
+        TestingBrokerHandler h;
+        auto mq1 = h.create_and_insert_mq("q1");
+        auto mq2 = h.create_and_insert_mq("q2");
+        mq2->overloaded = true;
+        std::vector<id_t> ids;
+        EXPECT_THROW(h.publish(ids, {"q1", "q2"}, create_msg("payload"), 2, {}),
+                Overloaded);
+        EXPECT_TRUE(mq1->pushed_msgs.empty());
+        EXPECT_EQ(0u, mq1->n_reserved);
+
+        // retried once there is room, the copies are only added once
+        mq2->overloaded = false;
+        h.publish(ids, {"q1", "q2"}, create_msg("payload"), 2, {});
+        EXPECT_EQ(4u, ids.size());
+        EXPECT_EQ(2u, mq1->pushed_msgs.size());
+        EXPECT_EQ(2u, mq2->pushed_msgs.size());
+        EXPECT_EQ(0u, mq1->n_reserved);
+        EXPECT_EQ(0u, mq2->n_reserved);
+    }
+
     TEST(BrokerHandlerTest, Ack) {
         TestingBrokerHandler h;
         h.ack("q", 1);
         EXPECT_THAT(h.get_mq("q")->acked_msgs, ElementsAre(1));
     }
 
+    TEST(BrokerHandlerTest, ReleaseMessages) {
+        TestingBrokerHandler h;
+        h.releaseMessages("q", {3, 1});
+        EXPECT_THAT(h.get_mq("q")->requeued_msgs, ElementsAre(3, 1));
+        EXPECT_THAT(h.get_mq("q")->acked_msgs, IsEmpty());
+    }
+
+    TEST(BrokerHandlerTest, ConsumersGone) {
+        TestingBrokerHandler h;
+        auto mq1 = h.create_and_insert_mq("q1");
+        auto mq2 = h.create_and_insert_mq("q2");
+        h.consumers_gone({"w1", "w2"});
+
+        // dropped from every queue by the reaper, without waiting for its round
+        auto dropped = [] (const std::shared_ptr<FakeMessageQueue>& mq) {
+            std::lock_guard<std::mutex> lock(mq->mtx);
+            return mq->dropped_consumers.size();
+        };
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while ((dropped(mq1) < 2 || dropped(mq2) < 2)
+                && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        std::lock_guard<std::mutex> lock1(mq1->mtx);
+        std::lock_guard<std::mutex> lock2(mq2->mtx);
+        EXPECT_THAT(mq1->dropped_consumers, ElementsAre("w1", "w2"));
+        EXPECT_THAT(mq2->dropped_consumers, ElementsAre("w1", "w2"));
+    }
+
+    // waits for the message out to a lost consumer to be free again
+    static bool wait_free(TestingBrokerHandler& h, const std::string& queue_name) {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        QueueStats stats;
+        do {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            h.getQueueStats(stats, queue_name);
+        } while (stats.n_free == 0 && std::chrono::steady_clock::now() < deadline);
+        return stats.n_free != 0;
+    }
+
+    TEST(BrokerHandlerTest, ConsumerZnodeGone) {
+        TestingBrokerHandler h;
+        h.create_and_insert_real_mq("q");
+        std::map<std::string, int64_t> consumers = {{"w1", 1}, {"w2", 2}};
+        h.set_consumers(&consumers);
+        h.zk_event(ZOO_SESSION_EVENT, ZOO_CONNECTED_STATE);
+        while (h.n_watched() == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        h.addMessage("q", create_msg("payload"), {});
+        Message recv;
+        h.ackAndGetMessage(recv, "q", {}, "w1");
+        QueueStats stats;
+        h.getQueueStats(stats, "q");
+        EXPECT_EQ(0, stats.n_free);
+
+        // the znode of w1 is deleted
+        consumers.erase("w1");
+        h.set_consumers(&consumers);
+        h.zk_event(ZOO_CHILD_EVENT, ZOO_CONNECTED_STATE);
+        ASSERT_TRUE(wait_free(h, "q"));
+        h.ackAndGetMessage(recv, "q", {}, "w2");
+        EXPECT_EQ("payload", recv.payload);
+    }
+
+    TEST(BrokerHandlerTest, ConsumerGoneWhileExpired) {
+        TestingBrokerHandler h;
+        h.create_and_insert_real_mq("q");
+        std::map<std::string, int64_t> consumers = {{"w1", 1}};
+        h.set_consumers(&consumers);
+        h.zk_event(ZOO_SESSION_EVENT, ZOO_CONNECTED_STATE);
+        while (h.n_watched() == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        h.addMessage("q", create_msg("payload"), {});
+        Message recv;
+        h.ackAndGetMessage(recv, "q", {}, "w1");
+
+        // w1 goes while the session of the broker is lost, nobody is told
+        h.zk_event(ZOO_SESSION_EVENT, ZOO_EXPIRED_SESSION_STATE);
+        h.set_consumers(nullptr);
+        // connected again, but zookeeper does not answer the first time
+        h.zk_event(ZOO_SESSION_EVENT, ZOO_CONNECTED_STATE);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        consumers.clear();
+        h.set_consumers(&consumers);
+        ASSERT_TRUE(wait_free(h, "q"));
+        EXPECT_EQ(2, h.n_watched());
+    }
+
     TEST(BrokerHandlerTest, Fail) {
         TestingBrokerHandler h;
         h.fail("q", 1);
         EXPECT_THAT(h.get_mq("q")->failed_msgs, ElementsAre(1));
     }
 
+    TEST(BrokerHandlerTest, ConfigureQueue) {
+        TestingBrokerHandler h;
+        QueueOptions options;
+        options.max_messages = 10;
+        options.block_ms = 20;
+        h.configureQueue("q", options);
+        EXPECT_EQ(options, h.get_mq("q")->options);
+    }
+
+    TEST(BrokerHandlerTest, Stats) {
+        TestingBrokerHandler h;
+        h.setMemoryBudget(1 << 20);
+        h.create_and_insert_mq("q1")->stats.n_messages = 1;
+        h.create_and_insert_mq("q2")->stats.n_messages = 2;
+
+        QueueStats queue_stats;
+        h.getQueueStats(queue_stats, "q2");
+        EXPECT_EQ(2, queue_stats.n_messages);
+
+        BrokerStats stats;
+        h.getBrokerStats(stats);
+        EXPECT_EQ(1 << 20, stats.memory_budget);
+        ASSERT_EQ(2u, stats.queues.size());
+        EXPECT_EQ(1, stats.queues["q1"].n_messages);
+        EXPECT_EQ(2, stats.queues["q2"].n_messages);
+    }
+
+    TEST(BrokerHandlerTest, AckAndGet) {
+        TestingBrokerHandler h;
+        auto mq = h.create_and_insert_mq("q");
+        std::vector<Outcome> outcomes(3);
+        outcomes[0].msg_id = 1;
+        outcomes[0].acked = true;
+        outcomes[1].msg_id = 2;
+        outcomes[1].acked = false;
+        outcomes[2].msg_id = 3;
+        outcomes[2].acked = true;
+
+        // outcomes are applied even if there is nothing to fetch
+        Message recv;
+        EXPECT_THROW(h.ackAndGetMessage(recv, "q", outcomes, ""), Timeout);
+        EXPECT_THAT(mq->acked_msgs, ElementsAre(1, 3));
+        EXPECT_THAT(mq->failed_msgs, ElementsAre(2));
+
+        auto msg = create_msg("msg", 4);
+        mq->free_msgs.push_back(msg);
+        h.ackAndGetMessage(recv, "q", {outcomes[0]}, "worker1");
+        EXPECT_EQ(msg, recv);
+        EXPECT_THAT(mq->acked_msgs, ElementsAre(1, 3, 1));
+        EXPECT_THAT(mq->consumer_ids, ElementsAre("", "worker1"));
+        h.leaveQueue("q", "worker1");
+        EXPECT_THAT(mq->removed_consumers, ElementsAre("worker1"));
+
+        h.ackBatch("q", {outcomes[1]});
+        EXPECT_THAT(mq->failed_msgs, ElementsAre(2, 2));
+    }
+
+    TEST(BrokerHandlerTest, AckAndGetAny) {
+        TestingBrokerHandler::set_fetch_any_timeout(50);
+        TestingBrokerHandler h;
+        auto mq1 = h.create_and_insert_mq("q1");
+        auto mq2 = h.create_and_insert_mq("q2");
+        auto msg = create_msg("msg", 3);
+        mq2->free_msgs.push_back(msg);
+
+        std::vector<Outcome> outcomes(2);
+        outcomes[0].msg_id = 1;
+        outcomes[0].acked = true;
+        outcomes[0].__set_queue_name("q1");
+        outcomes[1].msg_id = 2;
+        outcomes[1].acked = false;
+        outcomes[1].__set_queue_name("q2");
+
+        Message recv;
+        h.ackAndGetAnyMessage(recv, {create_sub("q1"), create_sub("q2")}, outcomes, "w");
+        EXPECT_EQ(msg, recv);
+        EXPECT_EQ("q2", recv.queue_name);
+        EXPECT_THAT(mq1->acked_msgs, ElementsAre(1));
+        EXPECT_THAT(mq2->failed_msgs, ElementsAre(2));
+        EXPECT_THAT(mq2->consumer_ids, Contains("w"));
+
+        EXPECT_THROW(h.ackAndGetAnyMessage(recv, {create_sub("q1"), create_sub("q2")}, {}, "w"),
+                Timeout);
+    }
+
+    TEST(BrokerHandlerTest, AckAndGetAnyWakesUp) {
+        TestingBrokerHandler::set_fetch_any_timeout(5000);
+        BrokerHandler h(1);
+        std::thread producer([&h] () {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            h.addMessage("q2", create_msg("late"), {});
+        });
+
+        auto start = std::chrono::steady_clock::now();
+        Message recv;
+        h.ackAndGetAnyMessage(recv, {create_sub("q1"), create_sub("q2")}, {}, "");
+        EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+        EXPECT_EQ("late", recv.payload);
+        EXPECT_EQ("q2", recv.queue_name);
+        producer.join();
+    }
+
+    TEST(BrokerHandlerTest, AckAndGetAnyWeights) {
+        TestingBrokerHandler::set_fetch_any_timeout(50);
+        BrokerHandler h(1);
+        for (int i = 0; i < 400; ++i) {
+            h.addMessage("heavy", create_msg("h"), {});
+            h.addMessage("light", create_msg("l"), {});
+        }
+        int n_heavy = 0;
+        Message recv;
+        for (int i = 0; i < 200; ++i) {
+            h.ackAndGetAnyMessage(recv,
+                    {create_sub("heavy", 3), create_sub("light", 1)}, {}, "");
+            n_heavy += recv.queue_name == "heavy";
+        }
+        // 150 expected, the standard deviation is about 6
+        EXPECT_GT(n_heavy, 120);
+        EXPECT_LT(n_heavy, 180);
+    }
+
 } /* pork */
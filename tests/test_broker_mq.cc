@@ -1,7 +1,12 @@
 #include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <memory>
+#include <mutex>
+#include <map>
 #include <random>
+#include <set>
+#include <string>
 #include <thread>
 #include <vector>
 
@@ -23,6 +28,10 @@ namespace pork {
                 MessageQueue::POP_FREE_TIMEOUT = boost::chrono::milliseconds(50);
             }
 
+            static void set_pop_timeout(int ms) {
+                MessageQueue::POP_FREE_TIMEOUT = boost::chrono::milliseconds(ms);
+            }
+
             static Dependency make_dep(const std::string& key, int n) {
                 Dependency dep;
                 dep.key = key;
@@ -42,6 +51,54 @@ namespace pork {
                 return msg;
             }
 
+            // the queue takes over the pushed message, push a copy instead
+            void push(const std::shared_ptr<Message>& msg,
+                    const std::vector<Dependency>& deps) {
+                Message copy(*msg);
+                mq.push_message(std::move(copy), deps);
+            }
+
+            size_t n_msgs() {
+                return mq.all_msgs.size();
+            }
+
+            // the in-progress messages indexed as out to a named consumer
+            size_t n_taken() {
+                size_t n = 0;
+                for (auto& taken : mq.taken_msgs) {
+                    n += taken.second.size();
+                }
+                return n;
+            }
+
+            // the messages queuing, whether free or not
+            int64_t n_queued() {
+                int64_t n = 0;
+                for (auto& msg : mq.all_msgs) {
+                    n += msg.state == MessageState::QUEUING && msg.n_deps == 0;
+                }
+                return n;
+            }
+
+            size_t n_spill_segments() {
+                return mq.spill_store ? mq.spill_store->n_segments() : 0;
+            }
+
+            // as if every spilled payload had been released
+            void lose_spilled() {
+                mq.spill_store.reset(new SegmentStore("/tmp", "pork-test-spill"));
+            }
+
+            // acks enough messages for the hedging to go by, right away
+            void sample_out_times(id_t first_id) {
+                Message recv;
+                for (size_t i = 0; i < MessageQueue::MIN_OUT_TIMES; ++i) {
+                    push(make_msg(first_id + i), {});
+                    ASSERT_TRUE(mq.pop_free_message(recv));
+                    mq.ack(recv.id);
+                }
+            }
+
             MessageQueue mq;
     };
 
@@ -72,7 +129,7 @@ namespace pork {
                 while (n_sent < n_msgs) {
                     int id = ++n_sent;
                     if (id <= n_msgs) {
-                        mq.push_message(make_msg(id), {});
+                        push(make_msg(id), {});
                     }
                 }
             });
@@ -107,26 +164,26 @@ namespace pork {
         auto msg2 = make_msg(2);
         auto msg3 = make_msg(3);
 
-        mq.push_message(msg11, {});
+        push(msg11, {});
         mq.pop_free_message(recv);
-        mq.push_message(msg21, {});
+        push(msg21, {});
         mq.pop_free_message(recv);
-        mq.push_message(msg22, {});
+        push(msg22, {});
         mq.pop_free_message(recv);
-        mq.push_message(msg31, {});
+        push(msg31, {});
         mq.pop_free_message(recv);
 
-        mq.push_message(msg1, {make_dep("dep1", 1), make_dep("dep2", 2)});
+        push(msg1, {make_dep("dep1", 1), make_dep("dep2", 2)});
         EXPECT_FALSE(mq.pop_free_message(recv));
 
         mq.ack(msg11->id);
 
-        mq.push_message(msg2, {make_dep("dep1", 1), make_dep("dep2", 1)});
+        push(msg2, {make_dep("dep1", 1), make_dep("dep2", 1)});
         EXPECT_FALSE(mq.pop_free_message(recv));
 
         mq.ack(msg31->id);
 
-        mq.push_message(msg3, {make_dep("dep1", 1), make_dep("dep3", 1)});
+        push(msg3, {make_dep("dep1", 1), make_dep("dep3", 1)});
         EXPECT_TRUE(mq.pop_free_message(recv));
         EXPECT_EQ(*msg3, recv);
         EXPECT_FALSE(mq.pop_free_message(recv));
@@ -144,6 +201,57 @@ namespace pork {
         EXPECT_FALSE(mq.pop_free_message(recv));
     }
 
+    TEST_F(BrokerMqTest, Join) {
+        Message recv;
+        QueueStats stats;
+        auto joining_msg = [] (id_t id, const std::string& resolve_dep) {
+            auto msg = make_msg(id, resolve_dep);
+            msg->__set_join(true);
+            return msg;
+        };
+
+        // resolved after the dependant is added, one resolver not joining
+        push(make_msg(1), {make_dep("fan_in", 3)});
+        push(joining_msg(11, "fan_in"), {});
+        push(make_msg(12, "fan_in"), {});
+        auto compressed = joining_msg(13, "fan_in");
+        compressed->__set_compression(Compression::LZ4);  // kept along with it
+        push(compressed, {});
+        for (int i = 0; i < 3; ++i) {
+            ASSERT_TRUE(mq.pop_free_message(recv));
+            EXPECT_FALSE(recv.__isset.joined);
+            mq.ack(recv.id);
+        }
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(1, recv.id);
+        EXPECT_THAT(recv.joined, ElementsAre("msg11", "msg13"));
+        EXPECT_THAT(recv.joined_compression,
+                ElementsAre(Compression::NONE, Compression::LZ4));
+        mq.ack(recv.id);
+
+        // resolved before, the results wait for the dependant
+        push(joining_msg(21, "early"), {});
+        push(joining_msg(22, "early"), {});
+        for (int i = 0; i < 2; ++i) {
+            ASSERT_TRUE(mq.pop_free_message(recv));
+            mq.ack(recv.id);
+        }
+        mq.get_stats(stats);
+        int64_t held_bytes = stats.dependency_bytes;
+        push(make_msg(2), {make_dep("fan_in", 1), make_dep("early", 2)});
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(2, recv.id);
+        // the results of fan_in went to the first dependant
+        EXPECT_THAT(recv.joined, ElementsAre("msg21", "msg22"));
+        mq.ack(recv.id);
+
+        // taken by the dependant, so no longer held
+        mq.get_stats(stats);
+        EXPECT_EQ(held_bytes - 10, stats.dependency_bytes);
+        EXPECT_EQ(0, stats.message_bytes);
+        EXPECT_EQ(0, stats.payload_bytes);
+    }
+
     TEST_F(BrokerMqTest, AckNonInProgressMsgs) {
         Message recv;
 
@@ -153,20 +261,20 @@ namespace pork {
         auto m_in_progress = make_msg(4, "dep");
         auto msg = make_msg(5);
 
-        mq.push_message(m_queuing, {make_dep("impossible", 1)});
+        push(m_queuing, {make_dep("impossible", 1)});
 
-        mq.push_message(m_failed, {});
+        push(m_failed, {});
         mq.pop_free_message(recv);
         mq.fail(m_failed->id);
 
-        mq.push_message(m_acked, {});
+        push(m_acked, {});
         mq.pop_free_message(recv);
         mq.ack(m_acked->id);
 
-        mq.push_message(m_in_progress, {});
+        push(m_in_progress, {});
         mq.pop_free_message(recv);
 
-        mq.push_message(msg, {make_dep("dep", 2)});
+        push(msg, {make_dep("dep", 2)});
 
         mq.ack(m_queuing->id);
         mq.ack(m_failed->id);
@@ -180,6 +288,1029 @@ namespace pork {
         EXPECT_EQ(*msg, recv);
     }
 
+    TEST_F(BrokerMqTest, Requeue) {
+        push(make_msg(1), {});
+        push(make_msg(2), {});
+
+        Message recv;
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(1, recv.id);
+        mq.requeue(1);
+        mq.requeue(1);  // no longer out
+        mq.requeue(2);  // not out yet
+        mq.requeue(3);  // unknown
+
+        // goes behind what was already waiting
+        std::vector<id_t> popped;
+        while (mq.pop_free_message(recv)) {
+            popped.push_back(recv.id);
+        }
+        EXPECT_THAT(popped, ElementsAre(2, 1));
+        mq.ack(1);
+        mq.ack(2);
+        EXPECT_EQ(0u, n_msgs());
+    }
+
+    TEST_F(BrokerMqTest, RequeueOrdered) {
+        QueueOptions options;
+        options.ordered = true;
+        mq.configure(options);
+        for (id_t id = 1; id <= 2; ++id) {
+            auto msg = make_msg(id);
+            msg->__set_partition_key("a");
+            push(msg, {});
+        }
+
+        // a requeued message keeps its key's lane
+        Message recv;
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(1, recv.id);
+        mq.requeue(1);
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(1, recv.id);
+        EXPECT_FALSE(mq.pop_free_message(recv));
+        mq.ack(1);
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(2, recv.id);
+    }
+
+    TEST_F(BrokerMqTest, DropConsumer) {
+        for (id_t id = 1; id <= 4; ++id) {
+            push(make_msg(id), {});
+        }
+        Message recv;
+        ASSERT_TRUE(mq.pop_free_message(recv, "a"));
+        EXPECT_EQ(1, recv.id);
+        ASSERT_TRUE(mq.pop_free_message(recv, "b"));
+        EXPECT_EQ(2, recv.id);
+        ASSERT_TRUE(mq.pop_free_message(recv, "a"));
+        EXPECT_EQ(3, recv.id);
+        mq.ack(3);
+
+        // only what is still out to it comes back
+        mq.drop_consumer("a");
+        std::vector<id_t> popped;
+        while (mq.pop_free_message(recv, "b")) {
+            popped.push_back(recv.id);
+        }
+        EXPECT_THAT(popped, ElementsAre(4, 1));
+        QueueStats stats;
+        mq.get_stats(stats);
+        EXPECT_EQ(1, stats.n_consumers);
+
+        // out to another consumer by now
+        mq.drop_consumer("a");
+        EXPECT_FALSE(mq.pop_free_message(recv));
+
+        // only the messages still out are indexed
+        EXPECT_EQ(3u, n_taken());
+        mq.ack(1);
+        mq.fail(2);
+        EXPECT_EQ(1u, n_taken());
+        mq.requeue(4);
+        EXPECT_EQ(0u, n_taken());
+    }
+
+    TEST_F(BrokerMqTest, Hedge) {
+        QueueOptions options;
+        options.hedge_percentile = 90;
+        mq.configure(options);
+        sample_out_times(1000);
+
+        push(make_msg(1, "dep"), {});
+        push(make_msg(2), {make_dep("dep", 2)});
+        Message recv;
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(1, recv.id);
+        EXPECT_FALSE(mq.pop_free_message(recv));
+
+        // out longer than most, handed out again, once
+        mq.expire_messages();
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(1, recv.id);
+        EXPECT_EQ("msg1", recv.payload);
+        mq.expire_messages();
+        EXPECT_FALSE(mq.pop_free_message(recv));
+        QueueStats stats;
+        mq.get_stats(stats);
+        EXPECT_EQ(1, stats.n_hedged);
+
+        // a fail while the other attempt is out is ignored, the first ack
+        // counts and resolves the dependency once
+        mq.fail(1);
+        EXPECT_EQ(2u, n_msgs());
+        mq.ack(1);
+        mq.ack(1);
+        EXPECT_EQ(1u, n_msgs());
+        EXPECT_FALSE(mq.pop_free_message(recv));
+    }
+
+    TEST_F(BrokerMqTest, HedgeFailedBeforeTaken) {
+        QueueOptions options;
+        options.hedge_percentile = 90;
+        mq.configure(options);
+        sample_out_times(1000);
+
+        push(make_msg(1), {});
+        Message recv;
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        mq.expire_messages();
+        // the second attempt stands as the retry of the first one
+        mq.fail(1);
+        EXPECT_EQ(1u, n_msgs());
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(1, recv.id);
+        EXPECT_EQ("msg1", recv.payload);
+        // and is the last one
+        mq.expire_messages();
+        EXPECT_FALSE(mq.pop_free_message(recv));
+        mq.fail(1);
+        EXPECT_EQ(0u, n_msgs());
+    }
+
+    TEST_F(BrokerMqTest, HedgeTakenBack) {
+        QueueOptions options;
+        options.hedge_percentile = 90;
+        mq.configure(options);
+        sample_out_times(1000);
+
+        push(make_msg(1), {});
+        Message recv;
+        ASSERT_TRUE(mq.pop_free_message(recv, "a"));
+        mq.expire_messages();
+        // the first attempt is lost while the second one is yet to be taken
+        mq.drop_consumer("a");
+        EXPECT_EQ(0u, n_taken());
+        ASSERT_TRUE(mq.pop_free_message(recv, "b"));
+        EXPECT_EQ(1, recv.id);
+        EXPECT_FALSE(mq.pop_free_message(recv));
+
+        // no attempt is out any more, so the message is free again
+        mq.drop_consumer("b");
+        ASSERT_TRUE(mq.pop_free_message(recv, "c"));
+        EXPECT_EQ(1, recv.id);
+        mq.fail(1);
+        EXPECT_EQ(0u, n_msgs());
+        EXPECT_EQ(0u, n_taken());
+        EXPECT_FALSE(mq.pop_free_message(recv));
+    }
+
+    TEST_F(BrokerMqTest, HedgeAckedBeforeTaken) {
+        QueueOptions options;
+        options.hedge_percentile = 90;
+        options.ttl_ms = 50;
+        mq.configure(options);
+        sample_out_times(1000);
+
+        push(make_msg(1), {});
+        Message recv;
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        mq.expire_messages();
+        // the ttl does not drop the second attempt
+        std::this_thread::sleep_for(std::chrono::milliseconds(60));
+        mq.expire_messages();
+        EXPECT_EQ(1u, n_msgs());
+        // the first attempt acks before the second one is taken
+        mq.ack(1);
+        EXPECT_EQ(0u, n_msgs());
+        EXPECT_FALSE(mq.pop_free_message(recv));
+        QueueStats stats;
+        mq.get_stats(stats);
+        EXPECT_EQ(0, stats.n_expired);
+    }
+
+    TEST_F(BrokerMqTest, HedgeMinMs) {
+        QueueOptions options;
+        options.hedge_percentile = 90;
+        options.hedge_min_ms = 60000;
+        mq.configure(options);
+        sample_out_times(1000);
+
+        push(make_msg(1), {});
+        Message recv;
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        mq.expire_messages();
+        EXPECT_FALSE(mq.pop_free_message(recv));
+        mq.fail(1);
+        EXPECT_EQ(0u, n_msgs());
+    }
+
+    TEST_F(BrokerMqTest, StaggeredDependants) {
+        int n = 50;
+        Message recv;
+
+        // pushed in reverse, dependant i waits for i + 1 resolutions
+        for (int i = n - 1; i >= 0; --i) {
+            push(make_msg(i), {make_dep("dep", i + 1)});
+        }
+        // waits for the same key twice
+        push(make_msg(1000), {make_dep("dep", 2), make_dep("dep", 3)});
+
+        for (int i = 0; i < n; ++i) {
+            push(make_msg(100 + i, "dep"), {});
+            ASSERT_TRUE(mq.pop_free_message(recv));
+            mq.ack(recv.id);
+
+            std::vector<id_t> freed;
+            while (mq.pop_free_message(recv)) {
+                freed.push_back(recv.id);
+            }
+            if (i == 2) {
+                EXPECT_THAT(freed, UnorderedElementsAre(i, 1000));
+            } else {
+                EXPECT_THAT(freed, ElementsAre(i));
+            }
+        }
+
+        push(make_msg(2000), {make_dep("dep", n)});
+        EXPECT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(2000, recv.id);
+    }
+
+    TEST_F(BrokerMqTest, Priorities) {
+        QueueOptions options;
+        options.starvation_limit = 0;
+        mq.configure(options);
+
+        // out of range priorities go to the nearest band
+        std::vector<std::pair<id_t, int>> sent{
+            {1, 0}, {2, 0}, {3, 3}, {4, 1}, {5, 3}, {6, 9}, {7, -1}};
+        for (auto& p : sent) {
+            auto msg = make_msg(p.first);
+            msg->__set_priority(p.second);
+            push(msg, {});
+        }
+        auto freed = make_msg(8);
+        freed->__set_priority(2);
+        push(freed, {make_dep("dep", 1)});
+        push(make_msg(9, "dep"), {});
+
+        Message recv;
+        std::vector<id_t> popped;
+        while (mq.pop_free_message(recv)) {
+            popped.push_back(recv.id);
+            mq.ack(recv.id);
+        }
+        EXPECT_THAT(popped, ElementsAre(3, 5, 6, 4, 1, 2, 7, 9, 8));
+    }
+
+    TEST_F(BrokerMqTest, CriticalPath) {
+        QueueOptions options;
+        options.critical_path = true;
+        mq.configure(options);
+        push(make_msg(1), {});
+        push(make_msg(2), {});
+        push(make_msg(3, "a"), {});
+        // raised once something waits for it
+        push(make_msg(4), {make_dep("a", 1)});
+        // waited for before it is free
+        push(make_msg(5), {make_dep("b", 1)});
+        push(make_msg(6), {make_dep("b", 1)});
+        push(make_msg(7, "b"), {});
+        auto urgent = make_msg(8);
+        urgent->__set_priority(3);
+        push(urgent, {});
+        // raised band by band, counted once
+        push(make_msg(9, "c"), {});
+        for (id_t id = 10; id < 14; ++id) {
+            push(make_msg(id), {make_dep("c", 1)});
+        }
+        QueueStats stats;
+        mq.get_stats(stats);
+        EXPECT_EQ(6, stats.n_free);
+
+        Message recv;
+        std::vector<id_t> popped;
+        while (mq.pop_free_message(recv)) {
+            popped.push_back(recv.id);
+            mq.ack(recv.id);
+            mq.get_stats(stats);
+            EXPECT_EQ(stats.n_free, n_queued());
+        }
+        ASSERT_EQ(13u, popped.size());
+        EXPECT_THAT(std::vector<id_t>(popped.begin(), popped.begin() + 6),
+                ElementsAre(8, 9, 7, 3, 1, 2));
+        // freed at once
+        EXPECT_THAT(std::vector<id_t>(popped.begin() + 6, popped.begin() + 10),
+                UnorderedElementsAre(10, 11, 12, 13));
+        EXPECT_THAT(std::vector<id_t>(popped.begin() + 10, popped.end()),
+                ElementsAre(5, 6, 4));
+        EXPECT_EQ(0u, n_msgs());
+    }
+
+    TEST_F(BrokerMqTest, StarvationLimit) {
+        QueueOptions options;
+        options.starvation_limit = 2;
+        mq.configure(options);
+
+        push(make_msg(1), {});
+        push(make_msg(2), {});
+        for (id_t id = 10; id < 16; ++id) {
+            auto msg = make_msg(id);
+            msg->__set_priority(3);
+            push(msg, {});
+        }
+
+        Message recv;
+        std::vector<id_t> popped;
+        while (mq.pop_free_message(recv)) {
+            popped.push_back(recv.id);
+        }
+        EXPECT_THAT(popped, ElementsAre(10, 11, 1, 12, 13, 2, 14, 15));
+    }
+
+    TEST_F(BrokerMqTest, Delayed) {
+        auto now_ms = [] () {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count();
+        };
+        auto start = std::chrono::steady_clock::now();
+        auto late = make_msg(1);
+        late->__set_not_before(now_ms() + 300);
+        push(late, {});
+        auto past = make_msg(2);
+        past->__set_not_before(now_ms() - 1000);
+        push(past, {});
+        auto waiting = make_msg(3);
+        waiting->__set_not_before(now_ms() + 150);
+        push(waiting, {make_dep("dep", 1)});
+        push(make_msg(4, "dep"), {});
+
+        Message recv;
+        QueueStats stats;
+        mq.get_stats(stats);
+        EXPECT_EQ(1, stats.n_delayed);
+        EXPECT_EQ(2, stats.n_free);
+
+        std::vector<id_t> popped;
+        while (popped.size() < 4) {
+            if (mq.pop_free_message(recv)) {
+                popped.push_back(recv.id);
+                mq.ack(recv.id);
+                auto elapsed = std::chrono::steady_clock::now() - start;
+                if (recv.id == 3) {
+                    EXPECT_GE(elapsed, std::chrono::milliseconds(140));
+                } else if (recv.id == 1) {
+                    EXPECT_GE(elapsed, std::chrono::milliseconds(290));
+                }
+            }
+        }
+        EXPECT_THAT(popped, ElementsAre(2, 4, 3, 1));
+        mq.get_stats(stats);
+        EXPECT_EQ(0, stats.n_delayed);
+    }
+
+    TEST_F(BrokerMqTest, DelayedWakesWaiter) {
+        set_pop_timeout(2000);
+        auto now_ms = [] () {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count();
+        };
+        auto far = make_msg(1);
+        far->__set_not_before(now_ms() + 60000);
+        push(far, {});
+
+        // waiting for the far one, then for one due earlier pushed meanwhile
+        Message recv;
+        auto start = std::chrono::steady_clock::now();
+        std::thread waiter([this, &recv] {
+            ASSERT_TRUE(mq.pop_free_message(recv));
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        auto near = make_msg(2);
+        near->__set_not_before(now_ms() + 100);
+        push(near, {});
+        waiter.join();
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        EXPECT_EQ(2, recv.id);
+        EXPECT_GE(elapsed, std::chrono::milliseconds(140));
+        EXPECT_LT(elapsed, std::chrono::milliseconds(1000));
+    }
+
+    TEST_F(BrokerMqTest, Expiry) {
+        QueueOptions options;
+        options.ttl_ms = 100;
+        mq.configure(options);
+
+        Message recv;
+        QueueStats stats;
+        push(make_msg(1, "dep"), {});
+        auto forever = make_msg(2);
+        forever->__set_ttl_ms(0);
+        push(forever, {});
+        push(make_msg(3), {make_dep("dep", 1)});
+        push(make_msg(4), {make_dep("other", 1)});
+        std::this_thread::sleep_for(std::chrono::milliseconds(150));
+
+        // expired ones resolve their dependencies, whether they are free or not
+        mq.expire_messages();
+        mq.get_stats(stats);
+        EXPECT_EQ(3, stats.n_expired);
+        EXPECT_EQ(1, stats.n_messages);
+        EXPECT_EQ(4, stats.payload_bytes);
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(2, recv.id);
+        EXPECT_FALSE(mq.pop_free_message(recv));
+        mq.ack(2);
+
+        // the husk of 4 is dropped once freed
+        push(make_msg(5, "other"), {});
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        mq.ack(5);
+        EXPECT_FALSE(mq.pop_free_message(recv));
+
+        // or dropped when it reaches the head, before any reaping
+        auto short_lived = make_msg(6, "dep2");
+        short_lived->__set_ttl_ms(20);
+        push(short_lived, {});
+        push(make_msg(7), {make_dep("dep2", 1)});
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(7, recv.id);
+        mq.get_stats(stats);
+        EXPECT_EQ(4, stats.n_expired);
+        EXPECT_EQ(1, stats.n_messages);
+    }
+
+    TEST_F(BrokerMqTest, Partitions) {
+        auto keyed = [] (id_t id, const std::string& key) {
+            auto msg = make_msg(id);
+            msg->__set_partition_key(key);
+            return msg;
+        };
+        for (int i = 0; i < 40; ++i) {
+            push(keyed(i, "key" + std::to_string(i % 8)), {});
+        }
+        push(make_msg(100), {});
+
+        // the first consumer takes every key, until the second one joins
+        Message recv;
+        ASSERT_TRUE(mq.pop_free_message(recv, "a"));
+        EXPECT_EQ(0, recv.id);
+        std::map<std::string, std::set<std::string>> consumers_of;
+        std::map<std::string, int> n_popped;
+        bool popped = true;
+        while (popped) {
+            popped = false;
+            for (std::string consumer : {"b", "a"}) {
+                if (mq.pop_free_message(recv, consumer)) {
+                    popped = true;
+                    ++n_popped[consumer];
+                    if (recv.__isset.partition_key) {
+                        consumers_of[recv.partition_key].insert(consumer);
+                    }
+                }
+            }
+        }
+        EXPECT_EQ(40, n_popped["a"] + n_popped["b"]);
+        EXPECT_GT(n_popped["a"], 1);
+        EXPECT_GT(n_popped["b"], 1);
+        ASSERT_EQ(8u, consumers_of.size());
+        for (auto& key : consumers_of) {
+            EXPECT_EQ(1u, key.second.size()) << key.first;
+        }
+
+        // anonymous fetches leave the keys alone
+        push(keyed(200, "key1"), {});
+        push(make_msg(201), {});
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(201, recv.id);
+        EXPECT_FALSE(mq.pop_free_message(recv));
+        QueueStats stats;
+        mq.get_stats(stats);
+        EXPECT_EQ(1, stats.n_free);
+        EXPECT_EQ(2, stats.n_consumers);
+
+        // the keys of a consumer leaving go to the others
+        std::string owner = *consumers_of["key1"].begin();
+        std::string other = owner == "a" ? "b" : "a";
+        mq.remove_consumer(owner);
+        ASSERT_TRUE(mq.pop_free_message(recv, other));
+        EXPECT_EQ(200, recv.id);
+        mq.remove_consumer(other);
+        push(keyed(300, "key1"), {});
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(300, recv.id);
+        mq.get_stats(stats);
+        EXPECT_EQ(0, stats.n_consumers);
+    }
+
+    TEST_F(BrokerMqTest, Ordered) {
+        QueueOptions options;
+        options.ordered = true;
+        mq.configure(options);
+        auto keyed = [] (id_t id, const std::string& key) {
+            auto msg = make_msg(id);
+            msg->__set_partition_key(key);
+            return msg;
+        };
+        push(keyed(1, "a"), {});
+        push(keyed(2, "a"), {});
+        push(keyed(3, "b"), {});
+        push(keyed(4, "a"), {});
+        push(keyed(5, "b"), {});
+        push(make_msg(6), {});
+
+        // one message out per key
+        Message recv;
+        std::vector<id_t> popped;
+        while (mq.pop_free_message(recv)) {
+            popped.push_back(recv.id);
+        }
+        EXPECT_THAT(popped, ElementsAre(1, 3, 6));
+        QueueStats stats;
+        mq.get_stats(stats);
+        EXPECT_EQ(2, stats.n_lanes);
+        EXPECT_EQ(0, stats.n_free);
+
+        mq.ack(1);
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(2, recv.id);
+        mq.fail(3);
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(5, recv.id);
+        EXPECT_FALSE(mq.pop_free_message(recv));
+        mq.ack(5);
+        mq.get_stats(stats);
+        EXPECT_EQ(1, stats.n_lanes);
+
+        // the rest is let out once the queue is no longer ordered
+        push(keyed(7, "a"), {});
+        options.ordered = false;
+        mq.configure(options);
+        popped.clear();
+        while (mq.pop_free_message(recv)) {
+            popped.push_back(recv.id);
+        }
+        EXPECT_THAT(popped, ElementsAre(4, 7));
+        mq.get_stats(stats);
+        EXPECT_EQ(0, stats.n_lanes);
+    }
+
+    TEST_F(BrokerMqTest, OrderedExpiry) {
+        QueueOptions options;
+        options.ordered = true;
+        mq.configure(options);
+        auto keyed = [] (id_t id, int ttl_ms) {
+            auto msg = make_msg(id);
+            msg->__set_partition_key("key");
+            msg->__set_ttl_ms(ttl_ms);
+            return msg;
+        };
+        push(keyed(1, 50), {});
+        push(keyed(2, 50), {});
+        push(keyed(3, 0), {});
+
+        // the first one expires out, the second one while waiting behind it
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        mq.expire_messages();
+        Message recv;
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(3, recv.id);
+        mq.ack(3);
+        QueueStats stats;
+        mq.get_stats(stats);
+        EXPECT_EQ(2, stats.n_expired);
+        EXPECT_EQ(0, stats.n_lanes);
+        EXPECT_EQ(0, stats.n_messages);
+    }
+
+    TEST_F(BrokerMqTest, OrderedDelayedExpiry) {
+        QueueOptions options;
+        options.ordered = true;
+        mq.configure(options);
+        auto now_ms = [] () {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count();
+        };
+        auto keyed = [&] (id_t id, int delay_ms, int ttl_ms) {
+            auto msg = make_msg(id);
+            msg->__set_partition_key("key");
+            msg->__set_not_before(now_ms() + delay_ms);
+            msg->__set_ttl_ms(ttl_ms);
+            return msg;
+        };
+        push(keyed(1, 60, 20), {});
+        push(keyed(2, 100, 0), {});
+
+        // the first one expires before it is due, and is released as a husk
+        std::this_thread::sleep_for(std::chrono::milliseconds(40));
+        mq.expire_messages();
+        std::this_thread::sleep_for(std::chrono::milliseconds(40));
+        QueueStats stats;
+        mq.get_stats(stats);
+        EXPECT_EQ(1, stats.n_expired);
+        EXPECT_EQ(0, stats.n_lanes);
+
+        Message recv;
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(2, recv.id);
+        mq.ack(2);
+        mq.get_stats(stats);
+        EXPECT_EQ(0, stats.n_lanes);
+        EXPECT_EQ(0, stats.n_messages);
+    }
+
+    TEST_F(BrokerMqTest, OrderedConcurrent) {
+        QueueOptions options;
+        options.ordered = true;
+        mq.configure(options);
+        int n_keys = 50;
+        int n_per_key = 40;
+        std::atomic_int n_done(0);
+        std::mutex mtx;
+        std::set<std::string> out;  // keys with a message being processed
+        std::map<std::string, int> last_seq;
+
+        std::thread producer([&] () {
+            id_t id = 0;
+            for (int seq = 0; seq < n_per_key; ++seq) {
+                for (int k = 0; k < n_keys; ++k) {
+                    Message msg;
+                    msg.__set_id(id++);
+                    msg.__set_partition_key("key" + std::to_string(k));
+                    msg.payload = std::to_string(seq);
+                    mq.push_message(std::move(msg), {});
+                }
+            }
+        });
+        std::vector<std::thread> consumers;
+        for (int i = 0; i < 8; ++i) {
+            consumers.emplace_back([&] () {
+                Message recv;
+                while (n_done < n_keys * n_per_key) {
+                    if (!mq.pop_free_message(recv)) {
+                        continue;
+                    }
+                    {
+                        std::lock_guard<std::mutex> lock(mtx);
+                        EXPECT_TRUE(out.insert(recv.partition_key).second);
+                        int seq = std::stoi(recv.payload);
+                        auto last = last_seq.find(recv.partition_key);
+                        EXPECT_EQ(last == last_seq.end() ? 0 : last->second + 1, seq);
+                        last_seq[recv.partition_key] = seq;
+                    }
+                    std::this_thread::yield();
+                    {
+                        std::lock_guard<std::mutex> lock(mtx);
+                        out.erase(recv.partition_key);
+                    }
+                    mq.ack(recv.id);
+                    ++n_done;
+                }
+            });
+        }
+        producer.join();
+        for (auto& t : consumers) {
+            t.join();
+        }
+        QueueStats stats;
+        mq.get_stats(stats);
+        EXPECT_EQ(0, stats.n_lanes);
+        EXPECT_EQ(0, stats.n_messages);
+    }
+
+    TEST_F(BrokerMqTest, QueueLimits) {
+        QueueOptions options;
+        options.max_messages = 3;
+        mq.configure(options);
+
+        Message recv;
+        QueueStats stats;
+        push(make_msg(1), {});
+        mq.get_stats(stats);
+        options.max_bytes = 3 * stats.message_bytes + 50;
+        mq.configure(options);
+
+        push(make_msg(2), {make_dep("dep", 1)});
+        auto big = make_msg(3);
+        big->payload.assign(2 * stats.message_bytes, 'x');
+        EXPECT_THROW(push(big, {}), Overloaded);
+
+        // a group is admitted as a whole
+        std::vector<Message> group(2, *make_msg(4));
+        EXPECT_THROW(mq.push_message_group(std::move(group), {}), Overloaded);
+        EXPECT_EQ(2u, n_msgs());
+
+        // acked and failed messages no longer count
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        mq.fail(recv.id);
+        EXPECT_EQ(1u, n_msgs());
+        push(make_msg(5, "dep"), {});
+        push(make_msg(6), {});
+        EXPECT_THROW(push(make_msg(7), {}), Overloaded);
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        mq.ack(recv.id);
+        mq.ack(recv.id);  // acking twice changes nothing
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(6, recv.id);
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(2, recv.id);
+        push(make_msg(7), {});
+        EXPECT_THROW(push(make_msg(8), {}), Overloaded);
+    }
+
+    TEST_F(BrokerMqTest, BlockWhenFull) {
+        QueueOptions options;
+        options.max_messages = 1;
+        options.block_ms = 5000;
+        mq.configure(options);
+
+        Message recv;
+        push(make_msg(1), {});
+        std::atomic_bool pushed(false);
+        std::thread producer([this, &pushed] () {
+            push(make_msg(2), {});
+            pushed = true;
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        EXPECT_FALSE(pushed);
+
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        mq.ack(recv.id);
+        producer.join();
+        EXPECT_TRUE(pushed);
+
+        // an oversized group is still admitted into an empty queue
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        mq.ack(recv.id);
+        std::vector<Message> group(3, *make_msg(3));
+        mq.push_message_group(std::move(group), {});
+    }
+
+    TEST_F(BrokerMqTest, Accounting) {
+        QueueStats stats;
+        Message recv;
+        auto msg1 = make_msg(1, "dep");
+        msg1->payload.assign(1000, 'x');
+        push(msg1, {});
+        push(make_msg(2), {make_dep("dep", 1), make_dep("other", 1)});
+
+        mq.get_stats(stats);
+        EXPECT_EQ(2, stats.n_messages);
+        EXPECT_EQ(1, stats.n_free);
+        EXPECT_EQ(2, stats.n_dependencies);
+        EXPECT_EQ(1004, stats.payload_bytes);
+        EXPECT_GT(stats.message_bytes, 1004 + 2 * int64_t(sizeof(Message)));
+        EXPECT_GT(stats.dependency_bytes, 0);
+
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        mq.ack(recv.id);
+        mq.get_stats(stats);
+        EXPECT_EQ(1, stats.n_messages);
+        EXPECT_EQ(0, stats.n_free);
+        EXPECT_EQ(4, stats.payload_bytes);
+
+        auto dependency_bytes = stats.dependency_bytes;
+        mq.fail(2);  // not in progress yet
+        mq.get_stats(stats);
+        EXPECT_EQ(1, stats.n_messages);
+
+        // dependency keys stay
+        push(make_msg(3), {});
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        mq.fail(recv.id);
+        mq.get_stats(stats);
+        EXPECT_EQ(1, stats.n_messages);
+        EXPECT_EQ(dependency_bytes, stats.dependency_bytes);
+    }
+
+    TEST_F(BrokerMqTest, DropOldest) {
+        QueueOptions options;
+        options.max_messages = 3;
+        options.overflow_policy = OverflowPolicy::DROP_OLDEST;
+        mq.configure(options);
+
+        Message recv;
+        push(make_msg(1), {});
+        ASSERT_TRUE(mq.pop_free_message(recv));  // in progress, never dropped
+        push(make_msg(2), {make_dep("dep", 1)});  // waiting, never dropped
+        push(make_msg(3), {});
+        push(make_msg(4), {});
+        push(make_msg(5), {});
+
+        QueueStats stats;
+        mq.get_stats(stats);
+        EXPECT_EQ(3, stats.n_messages);
+        EXPECT_EQ(2, stats.n_dropped);
+
+        push(make_msg(6), {});
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(6, recv.id);
+
+        // nothing left to drop
+        EXPECT_THROW(push(make_msg(7), {}), Overloaded);
+        mq.ack(5);  // dropped, ignored
+        mq.get_stats(stats);
+        EXPECT_EQ(3, stats.n_dropped);
+        EXPECT_EQ(1, stats.n_rejected);
+        EXPECT_EQ(3, stats.n_messages);
+
+        mq.ack(1);
+        push(make_msg(7), {});
+    }
+
+    TEST_F(BrokerMqTest, DropOldestReplaced) {
+        QueueOptions options;
+        options.max_messages = 2;
+        options.overflow_policy = OverflowPolicy::DROP_OLDEST;
+        mq.configure(options);
+
+        QueueStats stats;
+        push(make_msg(1), {});
+        mq.get_stats(stats);
+        int64_t message_bytes = stats.message_bytes;
+        push(make_msg(1), {});  // replaces the first one
+        push(make_msg(2), {});
+        // skips the replaced one and drops its replacement
+        push(make_msg(3), {});
+        mq.get_stats(stats);
+        EXPECT_EQ(2, stats.n_messages);
+        EXPECT_EQ(1, stats.n_dropped);
+        EXPECT_EQ(2 * message_bytes, stats.message_bytes);
+
+        Message recv;
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(2, recv.id);
+        mq.ack(recv.id);
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(3, recv.id);
+        mq.ack(recv.id);
+        mq.get_stats(stats);
+        EXPECT_EQ(0, stats.n_messages);
+        EXPECT_EQ(0, stats.message_bytes);
+        EXPECT_FALSE(mq.pop_free_message(recv));
+    }
+
+    TEST_F(BrokerMqTest, SharedBudget) {
+        auto budget = std::make_shared<MemoryBudget>();
+        MessageQueue q1(budget), q2(budget);
+        Message recv;
+
+        Message msg = *make_msg(1);
+        q1.push_message(std::move(msg), {});
+        int64_t used = budget->used_bytes;
+        EXPECT_GT(used, 0);
+
+        budget->max_bytes = 2 * used + used / 2;
+        msg = *make_msg(2);
+        q2.push_message(std::move(msg), {});
+        msg = *make_msg(3);
+        EXPECT_THROW(q2.push_message(std::move(msg), {}), Overloaded);
+
+        // freed by the other queue
+        ASSERT_TRUE(q1.pop_free_message(recv));
+        q1.ack(recv.id);
+        msg = *make_msg(3);
+        q2.push_message(std::move(msg), {});
+        EXPECT_EQ(2 * used, budget->used_bytes);
+
+        // an empty queue is not exempt from the budget
+        MessageQueue q3(budget);
+        msg = *make_msg(4);
+        EXPECT_THROW(q3.push_message(std::move(msg), {}), Overloaded);
+        EXPECT_EQ(2 * used, budget->used_bytes);
+    }
+
+    TEST_F(BrokerMqTest, Spill) {
+        QueueOptions options;
+        options.overflow_policy = OverflowPolicy::SPILL;
+        mq.configure(options);
+
+        // large enough for a resident message to cost more than 5 spilled ones
+        const int payload_size = 4000;
+        auto make_big_msg = [=] (id_t id, const std::string& resolve_dep = "") {
+            auto msg = make_msg(id, resolve_dep);
+            msg->payload.assign(payload_size, static_cast<char>('a' + id));
+            return msg;
+        };
+        Message recv;
+        QueueStats stats;
+        push(make_big_msg(1, "dep"), {});
+        mq.get_stats(stats);
+        int64_t resident_cost = stats.message_bytes;
+        int64_t spilled_cost = resident_cost - payload_size;
+        // room for one resident message and 5 spilled ones, give or take
+        // their dependencies
+        options.max_bytes = resident_cost + 5 * spilled_cost + 50;
+        mq.configure(options);
+
+        push(make_big_msg(2), {make_dep("dep", 1)});
+        push(make_big_msg(3), {});
+        std::vector<Message> group{*make_big_msg(4), *make_big_msg(5)};
+        mq.push_message_group(std::move(group), {});
+        push(make_msg(6), {});  // small enough to stay in memory
+        mq.get_stats(stats);
+        EXPECT_EQ(6, stats.n_messages);
+        EXPECT_EQ(4, stats.n_spilled);
+        EXPECT_EQ(4 * payload_size, stats.spilled_bytes);
+        EXPECT_EQ(payload_size + 4, stats.payload_bytes);
+        EXPECT_THROW(push(make_big_msg(7), {}), Overloaded);
+
+        // read back in order, the waiting one once its dependency is resolved
+        std::vector<id_t> popped;
+        while (mq.pop_free_message(recv)) {
+            auto sent = recv.id == 6 ? make_msg(6) : make_big_msg(recv.id);
+            EXPECT_EQ(sent->payload, recv.payload);
+            popped.push_back(recv.id);
+            mq.ack(recv.id);
+        }
+        EXPECT_THAT(popped, ElementsAre(1, 3, 4, 5, 6, 2));
+
+        mq.get_stats(stats);
+        EXPECT_EQ(0, stats.n_messages);
+        EXPECT_EQ(0, stats.n_spilled);
+        EXPECT_EQ(0, stats.spilled_bytes);
+        EXPECT_EQ(0, stats.message_bytes);
+        EXPECT_EQ(1u, n_spill_segments());  // only the one being appended to
+    }
+
+    TEST_F(BrokerMqTest, SpillReadFailure) {
+        QueueOptions options;
+        options.overflow_policy = OverflowPolicy::SPILL;
+        mq.configure(options);
+        const int payload_size = 4000;
+        auto make_big_msg = [=] (id_t id) {
+            auto msg = make_msg(id);
+            msg->payload.assign(payload_size, 'x');
+            return msg;
+        };
+        Message recv;
+        QueueStats stats;
+        push(make_big_msg(1), {});
+        mq.get_stats(stats);
+        options.max_bytes = stats.message_bytes + 2 * (stats.message_bytes - payload_size);
+        mq.configure(options);
+        push(make_big_msg(2), {});
+        push(make_big_msg(3), {});
+        mq.get_stats(stats);
+        ASSERT_EQ(2, stats.n_spilled);
+
+        // the segments are lost, the spilled messages are failed rather
+        // than handed out without their payloads
+        lose_spilled();
+        ASSERT_TRUE(mq.pop_free_message(recv));
+        EXPECT_EQ(1, recv.id);
+        EXPECT_FALSE(mq.pop_free_message(recv));
+        mq.get_stats(stats);
+        EXPECT_EQ(1, stats.n_messages);
+        EXPECT_EQ(0, stats.n_spilled);
+        EXPECT_EQ(1u, n_msgs());
+        mq.ack(1);
+        EXPECT_EQ(0u, n_msgs());
+    }
+
+    TEST_F(BrokerMqTest, SharedPayload) {
+        QueueOptions options;
+        options.overflow_policy = OverflowPolicy::SPILL;
+        mq.configure(options);
+
+        boost::intrusive_ptr<SharedPayload> payload(new SharedPayload());
+        payload->data.assign(4000, 'p');
+        payload->share = 1000;  // as if published to 4 copies
+        auto msg = make_msg(0);
+        msg->payload.clear();
+        mq.push_message_copies(*msg, payload, {1, 2, 3, 4}, {});
+        QueueStats stats;
+        mq.get_stats(stats);
+        EXPECT_EQ(4, stats.n_messages);
+        EXPECT_EQ(4000, stats.payload_bytes);
+        EXPECT_EQ(5, payload->use_count());
+
+        // room taken and given back
+        mq.reserve_copies(*msg, payload, 2, {});
+        QueueStats reserved;
+        mq.get_stats(reserved);
+        EXPECT_EQ(6, reserved.n_messages);
+        mq.cancel_copies(*msg, payload, 2, {});
+        mq.get_stats(reserved);
+        EXPECT_EQ(stats.n_messages, reserved.n_messages);
+        EXPECT_EQ(stats.message_bytes, reserved.message_bytes);
+        EXPECT_EQ(stats.payload_bytes, reserved.payload_bytes);
+
+        // copies are rejected rather than spilled
+        options.max_bytes = stats.message_bytes + 1000;
+        mq.configure(options);
+        EXPECT_THROW(mq.push_message_copies(*msg, payload, {5, 6}, {}), Overloaded);
+        mq.get_stats(stats);
+        EXPECT_EQ(4, stats.n_messages);
+        EXPECT_EQ(0, stats.n_spilled);
+
+        std::vector<id_t> popped;
+        Message recv;
+        while (mq.pop_free_message(recv)) {
+            EXPECT_EQ(payload->data, recv.payload);
+            popped.push_back(recv.id);
+            mq.ack(recv.id);
+        }
+        EXPECT_THAT(popped, ElementsAre(1, 2, 3, 4));
+        mq.get_stats(stats);
+        EXPECT_EQ(0, stats.n_messages);
+        EXPECT_EQ(0, stats.payload_bytes);
+        EXPECT_EQ(0, stats.message_bytes);
+        EXPECT_EQ(1, payload->use_count());
+    }
+
     TEST_F(BrokerMqTest, FakeWorkLoad) {
         int n_msgs = 0;
         int n_groups = 100;
@@ -216,12 +1347,12 @@ namespace pork {
                     auto msg = msgs[local_idx];
                     int group_id = msg->id / group_size;
                     if (group_id == 0) {  // first group
-                        mq.push_message(msg, {});
+                        push(msg, {});
                     } else {
                         Dependency dep;
                         dep.key = "dep" + std::to_string(group_id - 1);
                         dep.n = group_size;
-                        mq.push_message(msg, {dep});
+                        push(msg, {dep});
                     }
                 }
             });
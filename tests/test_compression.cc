@@ -0,0 +1,120 @@
+#include <stdexcept>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "compression.h"
+#include "proto_types.h"
+
+using namespace pork;
+
+class CompressionTest: public testing::TestWithParam<Compression::type> {
+    protected:
+        void SetUp() override {
+            if (!compression_supported(GetParam())) {
+                supported = false;
+                return;
+            }
+            for (int i = 0; i < 200; ++i) {
+                payload += "{\"id\": " + std::to_string(i) + ", \"name\": \"item\"}";
+            }
+        }
+
+        bool supported = true;
+        std::string payload;
+};
+
+TEST_P(CompressionTest, RoundTrip)
+{
+    if (!supported) {
+        return;
+    }
+    Message msg;
+    msg.payload = payload;
+    ASSERT_TRUE(compress_payload(msg, GetParam()));
+    EXPECT_EQ(GetParam(), msg.compression);
+    EXPECT_LT(msg.payload.size(), payload.size());
+    // compressed payloads are left alone
+    std::string compressed = msg.payload;
+    EXPECT_FALSE(compress_payload(msg, GetParam()));
+    EXPECT_EQ(compressed, msg.payload);
+
+    decompress_payload(msg);
+    EXPECT_EQ(Compression::NONE, msg.compression);
+    EXPECT_EQ(payload, msg.payload);
+}
+
+TEST_P(CompressionTest, Joined)
+{
+    if (!supported) {
+        return;
+    }
+    Message joining;
+    joining.payload = payload;
+    ASSERT_TRUE(compress_payload(joining, GetParam()));
+    Message msg;
+    msg.payload = "plain";
+    msg.__set_joined({joining.payload, "plain"});
+    msg.__set_joined_compression({GetParam(), Compression::NONE});
+
+    decompress_payload(msg);
+    EXPECT_EQ("plain", msg.payload);
+    ASSERT_EQ(2u, msg.joined.size());
+    EXPECT_EQ(payload, msg.joined[0]);
+    EXPECT_EQ("plain", msg.joined[1]);
+    EXPECT_EQ(Compression::NONE, msg.joined_compression[0]);
+}
+
+TEST_P(CompressionTest, Incompressible)
+{
+    if (!supported) {
+        return;
+    }
+    Message msg;
+    for (int i = 0; i < 64; ++i) {
+        msg.payload.push_back(static_cast<char>(i * 131 + 17));
+    }
+    std::string original = msg.payload;
+    EXPECT_FALSE(compress_payload(msg, GetParam()));
+    EXPECT_EQ(Compression::NONE, msg.compression);
+    EXPECT_EQ(original, msg.payload);
+
+    msg.payload.clear();
+    EXPECT_FALSE(compress_payload(msg, GetParam()));
+}
+
+TEST_P(CompressionTest, Corrupted)
+{
+    if (!supported) {
+        return;
+    }
+    Message msg;
+    msg.payload = payload;
+    ASSERT_TRUE(compress_payload(msg, GetParam()));
+    Message truncated = msg;
+    truncated.payload.resize(truncated.payload.size() / 2);
+    EXPECT_THROW(decompress_payload(truncated), std::runtime_error);
+    msg.payload = "garbage";
+    EXPECT_THROW(decompress_payload(msg), std::runtime_error);
+}
+
+INSTANTIATE_TEST_CASE_P(Codecs, CompressionTest,
+        testing::Values(Compression::LZ4, Compression::ZSTD));
+
+TEST(Compression, None)
+{
+    EXPECT_TRUE(compression_supported(Compression::NONE));
+    Message msg;
+    msg.payload = std::string(1000, 'x');
+    EXPECT_FALSE(compress_payload(msg, Compression::NONE));
+    decompress_payload(msg);
+    EXPECT_EQ(std::string(1000, 'x'), msg.payload);
+    EXPECT_THROW(compress_payload(msg, static_cast<Compression::type>(42)),
+            std::invalid_argument);
+
+    // the joined payloads are decoded by their own codecs
+    msg.__set_joined({"x", "y"});
+    msg.__set_joined_compression({Compression::NONE, static_cast<Compression::type>(42)});
+    EXPECT_THROW(decompress_payload(msg), std::runtime_error);
+    EXPECT_EQ("x", msg.joined[0]);
+}
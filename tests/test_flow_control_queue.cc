@@ -1,4 +1,5 @@
 #include <atomic>
+#include <chrono>
 #include <thread>
 #include <vector>
 
@@ -106,6 +107,53 @@ TEST(FlowControlQueue, PopEmptyTimeout)
     EXPECT_THROW(q.pop(100), FlowControlQueue<int>::Timeout);
 }
 
+TEST(FlowControlQueue, PopBatch)
+{
+    FlowControlQueue<int> q(2, 5);
+    std::vector<int> batch;
+    EXPECT_THROW(q.pop_batch(batch, 3, 0, 100), FlowControlQueue<int>::Timeout);
+
+    for (int i = 1; i <= 4; ++i) {
+        q.put(i);
+    }
+    q.pop_batch(batch, 3);
+    EXPECT_EQ(std::vector<int>({1, 2, 3}), batch);
+    // without lingering, whatever is there
+    q.pop_batch(batch, 3);
+    EXPECT_EQ(std::vector<int>({4}), batch);
+
+    // lingering waits for the batch to fill
+    std::thread t([&q] () {
+        for (int i = 5; i <= 7; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            q.put(i);
+        }
+    });
+    q.pop_batch(batch, 3, 5000);
+    EXPECT_EQ(std::vector<int>({5, 6, 7}), batch);
+    t.join();
+
+    // up to the linger time
+    q.put(8);
+    auto start = std::chrono::steady_clock::now();
+    q.pop_batch(batch, 3, 50);
+    EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(50));
+    EXPECT_EQ(std::vector<int>({8}), batch);
+}
+
+TEST(FlowControlQueue, SetWaterMarks)
+{
+    FlowControlQueue<int> q(2, 4);
+    for (int i = 0; i < 4; ++i) {
+        q.put(i);
+    }
+    EXPECT_TRUE(q.high());
+    q.set_water_marks(8, 10);
+    EXPECT_TRUE(q.low());
+    EXPECT_FALSE(q.high());
+    EXPECT_THROW(q.set_water_marks(5, 5), std::runtime_error);
+}
+
 void TestWaitWaterMark(bool low)
 {
     int n_threads = 20;  // must be even!
@@ -170,3 +218,19 @@ TEST(FlowControlQueue, WaitTillHigh)
 {
     TestWaitWaterMark(false);
 }
+
+TEST(FlowControlQueue, WaitTillLowFor)
+{
+    FlowControlQueue<int> q(1, 3);
+    q.put(1);
+    EXPECT_TRUE(q.wait_till_low_for(0));
+    q.put(2);
+    EXPECT_FALSE(q.wait_till_low_for(10));
+
+    std::thread t([&q] () {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        q.pop();
+    });
+    EXPECT_TRUE(q.wait_till_low_for(1000));
+    t.join();
+}
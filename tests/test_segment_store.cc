@@ -0,0 +1,138 @@
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "broker/segment_store.h"
+
+using namespace pork;
+
+class SegmentStoreTest: public testing::Test {
+    protected:
+        void SetUp() override {
+            prefix = "pork-test-segment." + std::to_string(getpid());
+        }
+
+        // segment files left in the directory
+        int n_files() {
+            int n = 0;
+            DIR* dir = opendir("/tmp");
+            while (auto entry = readdir(dir)) {
+                n += std::string(entry->d_name).compare(0, prefix.size(), prefix) == 0;
+            }
+            closedir(dir);
+            return n;
+        }
+
+        std::string prefix;
+};
+
+TEST_F(SegmentStoreTest, AppendRead)
+{
+    SegmentStore store("/tmp", prefix, 4096);
+    std::vector<std::string> payloads;
+    std::vector<SegmentStore::Location> locs;
+    for (int i = 0; i < 100; ++i) {
+        payloads.push_back(std::string(i * 10, static_cast<char>('a' + i % 26)));
+        locs.push_back(store.append(payloads.back()));
+    }
+    EXPECT_GT(store.n_segments(), 1u);
+    EXPECT_EQ(0, n_files());
+
+    std::string data;
+    for (int i = 99; i >= 0; --i) {
+        ASSERT_TRUE(store.read(locs[i], data));
+        EXPECT_EQ(payloads[i], data);
+    }
+}
+
+TEST_F(SegmentStoreTest, LargerThanSegment)
+{
+    SegmentStore store("/tmp", prefix, 4096);
+    std::string small(100, 's');
+    std::string large(10000, 'l');
+    auto small_loc = store.append(small);
+    auto large_loc = store.append(large);
+    EXPECT_NE(small_loc.segment, large_loc.segment);
+
+    std::string data;
+    ASSERT_TRUE(store.read(large_loc, data));
+    EXPECT_EQ(large, data);
+    ASSERT_TRUE(store.read(small_loc, data));
+    EXPECT_EQ(small, data);
+}
+
+TEST_F(SegmentStoreTest, Release)
+{
+    SegmentStore store("/tmp", prefix, 4096);
+    std::string payload(1000, 'x');
+    std::vector<SegmentStore::Location> locs;
+    for (int i = 0; i < 8; ++i) {  // 2 full segments
+        locs.push_back(store.append(payload));
+    }
+    EXPECT_EQ(2u, store.n_segments());
+
+    // the first segment is full, it goes once its last payload is released
+    for (int i = 0; i < 3; ++i) {
+        store.release(locs[i]);
+    }
+    EXPECT_EQ(2u, store.n_segments());
+    store.release(locs[3]);
+    EXPECT_EQ(1u, store.n_segments());
+    std::string data;
+    EXPECT_FALSE(store.read(locs[0], data));
+
+    // but the segment being appended to is kept
+    for (int i = 4; i < 8; ++i) {
+        store.release(locs[i]);
+    }
+    EXPECT_EQ(1u, store.n_segments());
+    auto loc = store.append(payload);
+    ASSERT_TRUE(store.read(loc, data));
+    EXPECT_EQ(payload, data);
+}
+
+TEST_F(SegmentStoreTest, Empty)
+{
+    SegmentStore store("/tmp", prefix);
+    auto loc = store.append("");
+    EXPECT_EQ(0u, store.n_segments());
+    std::string data("garbage");
+    ASSERT_TRUE(store.read(loc, data));
+    EXPECT_TRUE(data.empty());
+    store.release(loc);
+}
+
+TEST_F(SegmentStoreTest, BadDir)
+{
+    SegmentStore store("/nonexistent", prefix);
+    EXPECT_THROW(store.append("data"), std::system_error);
+}
+
+TEST_F(SegmentStoreTest, Concurrent)
+{
+    SegmentStore store("/tmp", prefix, 1 << 16);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; ++t) {
+        threads.emplace_back([&store, t] () {
+            std::string data;
+            for (int i = 0; i < 1000; ++i) {
+                std::string payload(100 + i % 50, static_cast<char>(t * 31 + i));
+                auto loc = store.append(payload);
+                ASSERT_TRUE(store.read(loc, data));
+                ASSERT_EQ(payload, data);
+                if (i % 2 == 0) {
+                    store.release(loc);
+                }
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+}
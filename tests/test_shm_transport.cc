@@ -0,0 +1,226 @@
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <boost/smart_ptr.hpp>
+#include <gtest/gtest.h>
+
+#include "shm_transport.h"
+
+using namespace pork;
+using apache::thrift::transport::TTransport;
+using apache::thrift::transport::TTransportException;
+
+// sends mem_fd over a new connection to path, the way TShmTransport::open does
+static int raw_connect(const std::string& path, int mem_fd)
+{
+    int sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    EXPECT_EQ(0, connect(sock_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)));
+
+    char byte = 0;
+    iovec iov = {&byte, 1};
+    char ctrl[CMSG_SPACE(sizeof(int))] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(cmsg), &mem_fd, sizeof(int));
+    EXPECT_EQ(1, sendmsg(sock_fd, &msg, MSG_NOSIGNAL));
+    return sock_fd;
+}
+
+// the memfd a client in this process has opened
+static int find_memfd()
+{
+    DIR* dir = opendir("/proc/self/fd");
+    int found = -1;
+    while (dirent* entry = readdir(dir)) {
+        char target[256];
+        std::string link = std::string("/proc/self/fd/") + entry->d_name;
+        ssize_t n = readlink(link.c_str(), target, sizeof(target) - 1);
+        if (n > 0 && std::string(target, n).find("memfd:pork-shm") != std::string::npos) {
+            found = std::stoi(entry->d_name);
+        }
+    }
+    closedir(dir);
+    return found;
+}
+
+class ShmTransportTest: public testing::Test {
+    protected:
+        void SetUp() override {
+            path = "/tmp/pork-test-shm." + std::to_string(getpid()) + ".sock";
+            server.reset(new TShmServerTransport(path));
+            server->listen();
+        }
+
+        void TearDown() override {
+            server->close();
+        }
+
+        std::string path;
+        std::unique_ptr<TShmServerTransport> server;
+};
+
+TEST_F(ShmTransportTest, Echo)
+{
+    // much larger than the ring, so both sides have to wrap around and wait
+    const uint32_t ring_size = 4096;
+    std::string sent(1 << 20, '\0');
+    for (size_t i = 0; i < sent.size(); ++i) {
+        sent[i] = static_cast<char>(i * 31 + 7);
+    }
+
+    std::thread echo([this, &sent] () {
+        auto t = server->accept();
+        std::vector<uint8_t> buf(1000);
+        size_t n_echoed = 0;
+        while (n_echoed < sent.size()) {
+            uint32_t n = t->read(buf.data(), buf.size());
+            ASSERT_GT(n, 0u);
+            t->write(buf.data(), n);
+            t->flush();
+            n_echoed += n;
+        }
+    });
+
+    TShmTransport client(path, ring_size);
+    client.open();
+    ASSERT_TRUE(client.isOpen());
+
+    std::string recv;
+    std::thread reader([&client, &recv, &sent] () {
+        recv.resize(sent.size());
+        client.readAll(reinterpret_cast<uint8_t*>(&recv[0]), recv.size());
+    });
+    for (size_t i = 0; i < sent.size(); i += 3000) {
+        size_t n = std::min<size_t>(3000, sent.size() - i);
+        client.write(reinterpret_cast<const uint8_t*>(sent.data() + i), n);
+        client.flush();
+    }
+
+    reader.join();
+    echo.join();
+    EXPECT_EQ(sent, recv);
+}
+
+TEST_F(ShmTransportTest, NothingPublishedBeforeFlush)
+{
+    std::atomic_bool flushed(false);
+    std::thread t([this, &flushed] () {
+        auto server_side = server->accept();
+        uint8_t buf[3];
+        server_side->readAll(buf, sizeof(buf));
+        EXPECT_TRUE(flushed);
+        EXPECT_EQ(std::string("abc"), std::string(buf, buf + 3));
+    });
+
+    TShmTransport client(path);
+    client.open();
+    client.write(reinterpret_cast<const uint8_t*>("abc"), 3);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    flushed = true;
+    client.flush();
+    t.join();
+}
+
+TEST_F(ShmTransportTest, PeerClosed)
+{
+    std::thread t([this] () {
+        auto server_side = server->accept();
+        uint8_t buf[4];
+        EXPECT_EQ(4u, server_side->read(buf, sizeof(buf)));
+        EXPECT_FALSE(server_side->peek());
+        EXPECT_EQ(0u, server_side->read(buf, sizeof(buf)));
+    });
+
+    {
+        TShmTransport client(path);
+        client.open();
+        client.write(reinterpret_cast<const uint8_t*>("data"), 4);
+        client.flush();
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }  // closed here
+
+    t.join();
+}
+
+TEST_F(ShmTransportTest, ConnectWithoutServer)
+{
+    TShmTransport client(path + ".nonexistent");
+    EXPECT_THROW(client.open(), TTransportException);
+    EXPECT_FALSE(client.isOpen());
+}
+
+TEST_F(ShmTransportTest, UnsealedSegment)
+{
+    // a valid segment for a 4096 byte ring otherwise: a 64 byte header with
+    // the magic and the ring size, then two rings with 192 bytes of indexes
+    const uint32_t ring_size = 4096;
+    const size_t size = 64 + 2 * (192 + ring_size);
+    int mem_fd = memfd_create("pork-shm", MFD_CLOEXEC);
+    ASSERT_EQ(0, ftruncate(mem_fd, size));
+    uint32_t header[2] = {0x6b726f70, ring_size};
+    ASSERT_EQ(ssize_t(sizeof(header)), pwrite(mem_fd, header, sizeof(header), 0));
+    int sock_fd = raw_connect(path, mem_fd);
+    // the client could shrink it under the broker's mapping
+    EXPECT_THROW(server->accept(), TTransportException);
+    char ack;
+    EXPECT_EQ(0, ::recv(sock_fd, &ack, 1, 0));
+    ::close(sock_fd);
+    ::close(mem_fd);
+}
+
+TEST_F(ShmTransportTest, RingOverrun)
+{
+    const uint32_t ring_size = 4096;
+    TShmTransport client(path, ring_size);
+    std::thread t([&client] () { client.open(); });
+    auto server_side = server->accept();
+    t.join();
+
+    int mem_fd = find_memfd();
+    ASSERT_GE(mem_fd, 0);
+    EXPECT_EQ(-1, ftruncate(mem_fd, 4096));  // sealed
+    void* segment = mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+    ASSERT_NE(MAP_FAILED, segment);
+    // the head of the client's ring, right after the 64 byte segment header
+    auto head = reinterpret_cast<std::atomic<uint64_t>*>(
+            static_cast<uint8_t*>(segment) + 64);
+    head->store(ring_size + 1);
+
+    uint8_t buf[16];
+    try {
+        server_side->read(buf, sizeof(buf));
+        ADD_FAILURE() << "read past the ring";
+    } catch (const TTransportException& e) {
+        EXPECT_EQ(TTransportException::CORRUPTED_DATA, e.getType());
+    }
+    munmap(segment, 4096);
+}
+
+TEST(ShmTransport, IsLocalHost)
+{
+    EXPECT_TRUE(is_local_host("localhost"));
+    EXPECT_TRUE(is_local_host("127.0.0.1"));
+    EXPECT_TRUE(is_local_host("::1"));
+    EXPECT_FALSE(is_local_host("10.1.2.3"));
+    EXPECT_FALSE(is_local_host("example.com"));
+}
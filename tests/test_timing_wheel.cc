@@ -0,0 +1,95 @@
+#include <memory>
+#include <vector>
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include "broker/timing_wheel.h"
+
+using namespace pork;
+using testing::ElementsAre;
+using testing::IsEmpty;
+
+static std::vector<int> advance(TimingWheel<int>& wheel, int64_t now_ms)
+{
+    std::vector<int> released;
+    wheel.advance(now_ms, [&released] (int& item) { released.push_back(item); });
+    return released;
+}
+
+TEST(TimingWheel, Basic)
+{
+    TimingWheel<int> wheel(10, 8);
+    EXPECT_TRUE(wheel.empty());
+
+    EXPECT_TRUE(wheel.insert(25, 1));
+    EXPECT_TRUE(wheel.insert(21, 2));
+    EXPECT_TRUE(wheel.insert(11, 3));
+    EXPECT_TRUE(wheel.insert(40, 4));
+    EXPECT_EQ(4u, wheel.size());
+
+    EXPECT_THAT(advance(wheel, 19), IsEmpty());
+    EXPECT_THAT(advance(wheel, 20), ElementsAre(3));
+    // never released early, even within a tick
+    EXPECT_THAT(advance(wheel, 29), IsEmpty());
+    EXPECT_THAT(advance(wheel, 30), ElementsAre(1, 2));
+    EXPECT_THAT(advance(wheel, 30), IsEmpty());
+    EXPECT_THAT(advance(wheel, 45), ElementsAre(4));
+    EXPECT_TRUE(wheel.empty());
+
+    // already due
+    EXPECT_FALSE(wheel.insert(40, 5));
+    EXPECT_FALSE(wheel.insert(0, 5));
+    EXPECT_TRUE(wheel.insert(51, 5));
+}
+
+TEST(TimingWheel, MoreThanOneRound)
+{
+    TimingWheel<int> wheel(10, 8);
+    EXPECT_TRUE(wheel.insert(30, 1));
+    EXPECT_TRUE(wheel.insert(30 + 80, 2));  // same slot, next round
+    EXPECT_TRUE(wheel.insert(30 + 800, 3));
+
+    EXPECT_THAT(advance(wheel, 30), ElementsAre(1));
+    EXPECT_THAT(advance(wheel, 100), IsEmpty());
+    EXPECT_THAT(advance(wheel, 110), ElementsAre(2));
+    EXPECT_EQ(1u, wheel.size());
+
+    // not advanced for rounds, everything due is still released
+    EXPECT_TRUE(wheel.insert(1000, 4));
+    EXPECT_THAT(advance(wheel, 5000), testing::UnorderedElementsAre(3, 4));
+    EXPECT_TRUE(wheel.empty());
+}
+
+TEST(TimingWheel, NextDue)
+{
+    TimingWheel<int> wheel(10, 8);
+    EXPECT_TRUE(wheel.insert(45, 1));
+    EXPECT_EQ(50, wheel.next_due_ms());
+    EXPECT_TRUE(wheel.insert(21, 2));
+    EXPECT_EQ(30, wheel.next_due_ms());
+    EXPECT_TRUE(wheel.insert(30 + 800, 3));  // rounds away
+    EXPECT_EQ(30, wheel.next_due_ms());
+
+    EXPECT_THAT(advance(wheel, 30), ElementsAre(2));
+    EXPECT_EQ(50, wheel.next_due_ms());
+    EXPECT_THAT(advance(wheel, 50), ElementsAre(1));
+    EXPECT_EQ(830, wheel.next_due_ms());
+    EXPECT_TRUE(wheel.insert(200, 4));
+    EXPECT_EQ(200, wheel.next_due_ms());
+}
+
+TEST(TimingWheel, MoveOnly)
+{
+    TimingWheel<std::unique_ptr<int>> wheel(10, 8);
+    std::unique_ptr<int> item(new int(42));
+    EXPECT_FALSE(wheel.insert(0, std::move(item)));
+    ASSERT_TRUE(item);  // not taken
+    EXPECT_TRUE(wheel.insert(10, std::move(item)));
+    EXPECT_FALSE(item);
+
+    std::unique_ptr<int> released;
+    wheel.advance(10, [&released] (std::unique_ptr<int>& p) { released = std::move(p); });
+    ASSERT_TRUE(released);
+    EXPECT_EQ(42, *released);
+}
@@ -1,14 +1,18 @@
 #include <atomic>
+#include <chrono>
 #include <functional>
 #include <list>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <tuple>
+#include <vector>
 
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include "compression.h"
 #include "mocks.h"
 #include "worker.h"
 #include "proto_types.h"
@@ -48,6 +52,7 @@ namespace pork {
             {}
 
             using BaseWorker::emit;
+            using BaseWorker::publish;
 
         protected:
             bool process_message(const Message& msg)
@@ -59,16 +64,70 @@ namespace pork {
             ProcFunc f;
     };
 
+    // fails the messages with odd ids, a batch at a time
+    class BatchingWorker: public TestingWorker {
+        public:
+            using TestingWorker::TestingWorker;
+
+            std::vector<size_t> batch_sizes;
+
+        protected:
+            std::vector<bool> process_messages(const std::vector<Message>& msgs) override
+            {
+                batch_sizes.push_back(msgs.size());
+                std::vector<bool> acked;
+                for (auto& msg : msgs) {
+                    acked.push_back(msg.id % 2 == 0);
+                }
+                return acked;
+            }
+    };
+
+    // holds on to the messages it is handed until complete is called
+    class AsyncWorker: public TestingWorker {
+        public:
+            using TestingWorker::TestingWorker;
+
+            // completes the messages handed so far, acking those with even ids
+            void complete()
+            {
+                std::vector<std::pair<Message, std::function<void(bool)>>> to_complete;
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    to_complete.swap(pending);
+                }
+                for (auto& msg : to_complete) {
+                    // still readable, long after being handed over
+                    EXPECT_EQ("message" + std::to_string(msg.first.id), msg.first.payload);
+                    msg.second(msg.first.id % 2 == 0);
+                }
+            }
+
+            std::atomic<size_t> max_pending{0};
+
+        protected:
+            void process_message_async(
+                    Message msg, std::function<void(bool)> done) override
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                pending.emplace_back(std::move(msg), std::move(done));
+                max_pending = std::max<size_t>(max_pending, pending.size());
+            }
+
+        private:
+            std::mutex mtx;
+            std::vector<std::pair<Message, std::function<void(bool)>>> pending;
+    };
+
     class WorkerTest: public testing::Test {
         protected:
             void SetUp() override
             {
                 last_msg_id = -1;
+                n_delivered = 0;
+                n_reported = 0;
                 mock_broker_fetch.reset(new MockBrokerIf());
                 mock_broker_process.reset(new MockBrokerIf());
-
-                ON_CALL(*mock_broker_fetch, getMessage(_, queue_name, _))
-                    .WillByDefault(Throw(Timeout()));
             }
 
             void TearDown() override
@@ -101,6 +160,50 @@ namespace pork {
                 return msg;
             }
 
+            static Outcome create_outcome(id_t msg_id, bool acked)
+            {
+                Outcome outcome;
+                outcome.msg_id = msg_id;
+                outcome.acked = acked;
+                return outcome;
+            }
+
+            // hands out msgs in order, and records the outcomes reported
+            // along with the fetches or on their own
+            void serve(const std::vector<Message>& msgs)
+            {
+                to_deliver.assign(msgs.begin(), msgs.end());
+                EXPECT_CALL(*mock_broker_fetch, ackAndGetMessage(_, queue_name, _, _))
+                    .WillRepeatedly(Invoke([this] (Message& _return,
+                                const std::string&, const std::vector<Outcome>& outcomes,
+                                const std::string&) {
+                        record(outcomes);
+                        std::unique_lock<std::mutex> lock(mtx);
+                        if (to_deliver.empty()) {
+                            lock.unlock();
+                            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                            throw Timeout();
+                        }
+                        _return = to_deliver.front();
+                        to_deliver.pop_front();
+                        ++n_delivered;
+                    }));
+                EXPECT_CALL(*mock_broker_process, ackBatch(queue_name, _))
+                    .WillRepeatedly(Invoke([this] (
+                                const std::string&, const std::vector<Outcome>& outcomes) {
+                        record(outcomes);
+                    }));
+                EXPECT_CALL(*mock_broker_fetch, leaveQueue(queue_name, _))
+                    .Times(AtMost(1));
+            }
+
+            void record(const std::vector<Outcome>& outcomes)
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                reported.insert(reported.end(), outcomes.begin(), outcomes.end());
+                n_reported += outcomes.size();
+            }
+
             static int get_worker_buf_lwm()
             {
                 return BaseWorker::buf_low_water_mark;
@@ -110,6 +213,12 @@ namespace pork {
             std::shared_ptr<MockBrokerIf> mock_broker_fetch;
             std::shared_ptr<MockBrokerIf> mock_broker_process;
 
+            std::mutex mtx;
+            std::list<Message> to_deliver;
+            std::vector<Outcome> reported;
+            std::atomic_int n_delivered;
+            std::atomic_int n_reported;
+
             static const std::string queue_name;
     };
 
@@ -119,20 +228,15 @@ namespace pork {
     TEST_F(WorkerTest, Process)
     {
         int n_msgs = 10;
-        std::atomic_int n_acked(0);
-        std::list<Message> msgs;
-        Sequence deliver_seq;
+        std::vector<Message> to_send;
+        std::vector<Outcome> expected_outcomes;
         for (int i = 0; i < n_msgs; ++i) {
-            auto msg = create_msg("message" + std::to_string(i));
-            msgs.push_back(msg);
-            InSequence s;
-            EXPECT_CALL(*mock_broker_fetch, getMessage(_, queue_name, msg.id - 1))
-                .InSequence(deliver_seq)
-                .WillOnce(SetArgReferee<0>(msg));
-            EXPECT_CALL(*mock_broker_process, ack(queue_name, msg.id))
-                .WillOnce(Increase(&n_acked));
+            to_send.push_back(create_msg("message" + std::to_string(i)));
+            expected_outcomes.push_back(create_outcome(to_send.back().id, true));
         }
+        serve(to_send);
 
+        std::list<Message> msgs(to_send.begin(), to_send.end());
         auto worker = get_worker(queue_name,
                 [&msgs] (const Message& recv) {
                     EXPECT_EQ(msgs.front(), recv);
@@ -141,50 +245,105 @@ namespace pork {
                 });
         std::thread t(&BaseWorker::run, worker);
 
-        while (n_acked != n_msgs);
+        while (n_reported != n_msgs);
         worker->stop();
         t.join();
+
+        // every outcome is reported exactly once
+        EXPECT_THAT(reported, UnorderedElementsAreArray(expected_outcomes));
+    }
+
+    TEST_F(WorkerTest, ProcessBatches)
+    {
+        int n_msgs = 20;
+        std::vector<Message> to_send;
+        std::vector<Outcome> expected_outcomes;
+        for (int i = 0; i < n_msgs; ++i) {
+            to_send.push_back(create_msg("message" + std::to_string(i)));
+            expected_outcomes.push_back(
+                    create_outcome(to_send.back().id, to_send.back().id % 2 == 0));
+        }
+        serve(to_send);
+
+        auto worker = std::make_shared<BatchingWorker>(
+                SimpleProcFunc([] (const Message&) { return true; }),
+                queue_name, mock_broker_fetch, mock_broker_process);
+        worker->set_batching(8, 100);
+        std::thread t(&BaseWorker::run, worker);
+
+        while (n_reported != n_msgs);
+        worker->stop();
+        t.join();
+
+        EXPECT_THAT(reported, UnorderedElementsAreArray(expected_outcomes));
+        size_t n_processed = 0;
+        for (size_t size : worker->batch_sizes) {
+            EXPECT_LE(size, 8u);
+            n_processed += size;
+        }
+        EXPECT_EQ(size_t(n_msgs), n_processed);
+        // lingering fills the batches
+        EXPECT_LT(worker->batch_sizes.size(), size_t(n_msgs));
+    }
+
+    TEST_F(WorkerTest, ProcessAsync)
+    {
+        int n_msgs = 20;
+        std::vector<Message> to_send;
+        std::vector<Outcome> expected_outcomes;
+        for (int i = 0; i < n_msgs; ++i) {
+            to_send.push_back(create_msg("message" + std::to_string(i)));
+            expected_outcomes.push_back(
+                    create_outcome(to_send.back().id, to_send.back().id % 2 == 0));
+        }
+        serve(to_send);
+
+        auto worker = std::make_shared<AsyncWorker>(
+                SimpleProcFunc([] (const Message&) { return true; }),
+                queue_name, mock_broker_fetch, mock_broker_process);
+        worker->set_concurrency(4, 2);
+        std::thread t(&BaseWorker::run, worker);
+
+        while (n_reported != n_msgs) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            worker->complete();
+        }
+        worker->stop();
+        t.join();
+
+        EXPECT_THAT(reported, UnorderedElementsAreArray(expected_outcomes));
+        // several at a time, but never more than allowed
+        EXPECT_GT(worker->max_pending, 1u);
+        EXPECT_LE(worker->max_pending, 4u);
     }
 
     TEST_F(WorkerTest, ProcessFailed)
     {
         auto msg = create_msg("message");
-        InSequence s;
-        EXPECT_CALL(*mock_broker_fetch, getMessage(_, queue_name, msg.id - 1))
-            .WillOnce(SetArgReferee<0>(msg));
-        EXPECT_CALL(*mock_broker_process, fail(queue_name, msg.id))
-            .Times(Exactly(1));
+        serve({msg});
 
-        std::atomic_bool started(false);
         auto worker = get_worker(queue_name,
-                [&msg, &started] (const Message& recv) {
-                    started = true;
+                [&msg] (const Message& recv) {
                     EXPECT_EQ(msg, recv);
                     return false;
                 });
         std::thread t(&BaseWorker::run, worker);
-        while (!started);
+        while (n_reported != 1);
 
         worker->stop();
         t.join();
+        EXPECT_THAT(reported, ElementsAre(create_outcome(msg.id, false)));
     }
 
     TEST_F(WorkerTest, FlowControl)
     {
         int buf_lwm = get_worker_buf_lwm();
-        std::atomic_int n_acked(0);
-        std::atomic_int n_delivered(0);
-        Sequence deliver_seq;
+        std::vector<Message> to_send;
         // 1 in progress, buf_lwm + 1 in queue, 1 extra
         for (int i = 0; i < buf_lwm + 3; ++i) {
-            auto msg = create_msg("message" + std::to_string(i));
-            InSequence s;
-            EXPECT_CALL(*mock_broker_fetch, getMessage(_, queue_name, msg.id - 1))
-                .InSequence(deliver_seq)
-                .WillOnce(DoAll(SetArgReferee<0>(msg), Increase(&n_delivered)));
-            EXPECT_CALL(*mock_broker_process, ack(queue_name, msg.id))
-                .WillOnce(Increase(&n_acked));
+            to_send.push_back(create_msg("message" + std::to_string(i)));
         }
+        serve(to_send);
 
         std::atomic_bool allowed_to_proceed(false);
         auto worker = get_worker(queue_name,
@@ -199,20 +358,90 @@ namespace pork {
             EXPECT_EQ(buf_lwm + 2, n_delivered);
         }
         allowed_to_proceed = true;
-        while (n_acked != buf_lwm + 3);
+        while (n_reported != buf_lwm + 3);
 
         worker->stop();
         t.join();
     }
 
+    TEST_F(WorkerTest, DrainOnStop)
+    {
+        int buf_lwm = get_worker_buf_lwm();
+        std::vector<Message> to_send;
+        // 1 in progress, buf_lwm + 1 in buffer when stopped
+        for (int i = 0; i < buf_lwm + 2; ++i) {
+            to_send.push_back(create_msg("message" + std::to_string(i)));
+        }
+        serve(to_send);
+        std::vector<id_t> buffered_ids;
+        for (size_t i = 1; i < to_send.size(); ++i) {
+            buffered_ids.push_back(to_send[i].id);
+        }
+        EXPECT_CALL(*mock_broker_process,
+                releaseMessages(queue_name, ElementsAreArray(buffered_ids)))
+            .Times(1);
+
+        std::atomic_bool allowed_to_proceed(false);
+        auto worker = get_worker(queue_name,
+                [&] (const Message&) {
+                    while (!allowed_to_proceed);
+                    return true;
+                });
+        worker->set_drain_on_stop(true);
+        std::thread t(&BaseWorker::run, worker);
+
+        while (n_delivered != buf_lwm + 2);
+        worker->stop();
+        allowed_to_proceed = true;
+        t.join();
+
+        // the one in progress is finished, the others are handed back
+        EXPECT_THAT(reported, ElementsAre(create_outcome(to_send[0].id, true)));
+    }
+
+    TEST_F(WorkerTest, ReportWhenIdle)
+    {
+        auto msg = create_msg("message");
+        std::atomic_bool fetching(false);
+        std::atomic_bool finished(false);
+        std::atomic_bool stopped(false);
+        // the second fetch hangs until the worker is stopped, so the outcome
+        // has to be reported on its own
+        EXPECT_CALL(*mock_broker_fetch, ackAndGetMessage(_, queue_name, IsEmpty(), _))
+            .WillOnce(SetArgReferee<0>(msg))
+            .WillOnce(Invoke([&] (Message&, const std::string&,
+                            const std::vector<Outcome>&, const std::string&) {
+                fetching = true;
+                while (!stopped);
+                throw Timeout();
+            }));
+        EXPECT_CALL(*mock_broker_process,
+                ackBatch(queue_name, ElementsAre(create_outcome(msg.id, true))))
+            .WillOnce(Invoke([&finished] (const std::string&,
+                            const std::vector<Outcome>&) {
+                finished = true;
+            }));
+        EXPECT_CALL(*mock_broker_fetch, leaveQueue(queue_name, _));
+
+        auto worker = get_worker(queue_name,
+                [&fetching] (const Message&) {
+                    while (!fetching);
+                    return true;
+                });
+        std::thread t(&BaseWorker::run, worker);
+        while (!finished);
+
+        worker->stop();
+        stopped = true;
+        t.join();
+    }
+
     TEST_F(WorkerTest, EmitMessages)
     {
         std::string ds_queue = "downstream";
         int n_msgs = 10;
-        std::atomic_int n_acked(0);
         std::list<std::tuple<Message, Dependency, Message>> msgs;
-        Sequence deliver_seq;
-        id_t last_us_id = -1;
+        std::vector<Message> to_send;
         for (int i = 0; i < n_msgs; ++i) {
             auto us_msg = create_msg("upstream" + std::to_string(i), std::to_string(i));
             auto ds_msg = create_msg("downstream" + std::to_string(i));
@@ -220,11 +449,7 @@ namespace pork {
             dep.key = std::to_string(i - 1);
             dep.n = i % 2 ? 3 : 1;
             msgs.emplace_back(us_msg, dep, ds_msg);
-
-            InSequence s;
-            EXPECT_CALL(*mock_broker_fetch, getMessage(_, queue_name, last_us_id))
-                .InSequence(deliver_seq)
-                .WillOnce(SetArgReferee<0>(us_msg));
+            to_send.push_back(us_msg);
 
             if (i % 2) {  // i is odd, should emit 1 msg
                 EXPECT_CALL(*mock_broker_process,
@@ -238,12 +463,8 @@ namespace pork {
                     .WillOnce(SetArgReferee<0>(
                                 std::vector<id_t>({i + 100, i + 101, i + 102})));
             }
-
-            EXPECT_CALL(*mock_broker_process, ack(queue_name, us_msg.id))
-                .WillOnce(Increase(&n_acked));
-
-            last_us_id = us_msg.id;
         }
+        serve(to_send);
 
         auto worker = get_worker(queue_name,
                 [&] (const Message& recv, TestingWorker* self) {
@@ -268,8 +489,179 @@ namespace pork {
                 });
         std::thread t(&BaseWorker::run, worker);
 
-        while (n_acked != n_msgs);
+        while (n_reported != n_msgs);
+        worker->stop();
+        t.join();
+    }
+
+    TEST_F(WorkerTest, EmitRetriesWhenOverloaded)
+    {
+        auto msg = create_msg("message");
+        Overloaded overloaded;
+        overloaded.retry_after_ms = 1;
+        EXPECT_CALL(*mock_broker_process, addMessage("downstream", msg, IsEmpty()))
+            .WillOnce(Throw(overloaded))
+            .WillOnce(Throw(overloaded))
+            .WillOnce(Return(42));
+        EXPECT_CALL(*mock_broker_process, addMessageGroup(_, "downstream", _, IsEmpty()))
+            .WillOnce(Throw(overloaded))
+            .WillOnce(SetArgReferee<0>(std::vector<id_t>({43, 44})));
+
+        auto worker = get_worker(queue_name, [] (const Message&) { return true; });
+        EXPECT_EQ(42, worker->emit("downstream", msg, {}));
+        EXPECT_THAT(worker->emit("downstream", {msg, msg}, {}), ElementsAre(43, 44));
+    }
+
+    TEST_F(WorkerTest, Publish)
+    {
+        auto msg = create_msg("message");
+        Overloaded overloaded;
+        overloaded.retry_after_ms = 1;
+        EXPECT_CALL(*mock_broker_process,
+                publish(_, ElementsAre("q1", "q2"), msg, 2, IsEmpty()))
+            .WillOnce(Throw(overloaded))
+            .WillOnce(SetArgReferee<0>(std::vector<id_t>({1, 2, 3, 4})));
+
+        auto worker = get_worker(queue_name, [] (const Message&) { return true; });
+        EXPECT_THAT(worker->publish({"q1", "q2"}, msg, 2, {}), ElementsAre(1, 2, 3, 4));
+    }
+
+    TEST_F(WorkerTest, EmitCompressed)
+    {
+        if (!compression_supported(Compression::LZ4)) {
+            return;
+        }
+        std::string payload;
+        for (int i = 0; i < 100; ++i) {
+            payload += "{\"key\": \"value" + std::to_string(i % 7) + "\"}";
+        }
+        std::vector<Message> added;
+        EXPECT_CALL(*mock_broker_process, addMessage("downstream", _, IsEmpty()))
+            .WillRepeatedly(DoAll(
+                        Invoke([&added] (const std::string&, const Message& msg,
+                                const std::vector<Dependency>&) {
+                            added.push_back(msg);
+                        }),
+                        Return(42)));
+        EXPECT_CALL(*mock_broker_process, addMessage("other", _, IsEmpty()))
+            .WillOnce(DoAll(
+                        Invoke([&added] (const std::string&, const Message& msg,
+                                const std::vector<Dependency>&) {
+                            added.push_back(msg);
+                        }),
+                        Return(43)));
+
+        auto worker = get_worker(queue_name, [] (const Message&) { return true; });
+        worker->set_compression("downstream", Compression::LZ4, 64);
+        worker->emit("downstream", create_msg(payload), {});
+        worker->emit("downstream", create_msg("small"), {});
+        worker->emit("other", create_msg(payload), {});
+        ASSERT_EQ(3u, added.size());
+
+        EXPECT_EQ(Compression::LZ4, added[0].compression);
+        EXPECT_LT(added[0].payload.size(), payload.size());
+        decompress_payload(added[0]);
+        EXPECT_EQ(payload, added[0].payload);
+        // below the threshold, or not configured for the queue
+        EXPECT_EQ(Compression::NONE, added[1].compression);
+        EXPECT_EQ("small", added[1].payload);
+        EXPECT_EQ(Compression::NONE, added[2].compression);
+        EXPECT_EQ(payload, added[2].payload);
+    }
+
+    TEST_F(WorkerTest, ProcessCompressed)
+    {
+        std::string payload(1000, 'x');
+        auto undecodable = create_msg("garbage");
+        undecodable.__set_compression(Compression::LZ4);
+        std::vector<Message> to_send{create_msg(payload), undecodable};
+        if (compression_supported(Compression::LZ4)) {
+            compress_payload(to_send[0], Compression::LZ4);
+        }
+        serve(to_send);
+
+        std::vector<std::string> received;
+        auto worker = get_worker(queue_name,
+                [&received] (const Message& recv) {
+                    EXPECT_EQ(Compression::NONE, recv.compression);
+                    received.push_back(recv.payload);
+                    return true;
+                });
+        std::thread t(&BaseWorker::run, worker);
+        while (n_reported != 2);
+        worker->stop();
+        t.join();
+
+        // a payload that cannot be decoded is never handed to the worker
+        EXPECT_THAT(received, ElementsAre(payload));
+        EXPECT_THAT(reported, UnorderedElementsAre(
+                    create_outcome(to_send[0].id, true),
+                    create_outcome(undecodable.id, false)));
+    }
+
+    TEST_F(WorkerTest, UnsupportedCompression)
+    {
+        auto worker = get_worker(queue_name, [] (const Message&) { return true; });
+        EXPECT_THROW(worker->set_compression("downstream", static_cast<Compression::type>(42)),
+                std::invalid_argument);
+    }
+
+    TEST_F(WorkerTest, MultipleQueues)
+    {
+        std::vector<Message> to_send;
+        for (int i = 0; i < 6; ++i) {
+            to_send.push_back(create_msg("message" + std::to_string(i)));
+            to_send.back().__set_queue_name(i % 2 ? "other" : queue_name);
+        }
+        std::vector<Subscription> subs(2);
+        subs[0].queue_name = queue_name;
+        subs[0].weight = 1;
+        subs[1].queue_name = "other";
+        subs[1].weight = 3;
+
+        to_deliver.assign(to_send.begin(), to_send.end());
+        EXPECT_CALL(*mock_broker_fetch, ackAndGetAnyMessage(_, subs, _, _))
+            .WillRepeatedly(Invoke([this] (Message& _return,
+                        const std::vector<Subscription>&,
+                        const std::vector<Outcome>& outcomes, const std::string&) {
+                record(outcomes);
+                std::unique_lock<std::mutex> lock(mtx);
+                if (to_deliver.empty()) {
+                    lock.unlock();
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    throw Timeout();
+                }
+                _return = to_deliver.front();
+                to_deliver.pop_front();
+            }));
+        // outcomes reported on their own go to the queue of each message
+        EXPECT_CALL(*mock_broker_process, ackBatch(_, _))
+            .WillRepeatedly(Invoke([this] (
+                        const std::string& name, const std::vector<Outcome>& outcomes) {
+                for (auto& outcome : outcomes) {
+                    EXPECT_EQ(name, outcome.queue_name);
+                }
+                record(outcomes);
+            }));
+        EXPECT_CALL(*mock_broker_fetch, leaveQueue(queue_name, _));
+        EXPECT_CALL(*mock_broker_fetch, leaveQueue("other", _));
+
+        std::vector<std::string> received_from;
+        auto worker = get_worker(queue_name,
+                [&received_from] (const Message& recv) {
+                    received_from.push_back(recv.queue_name);
+                    return true;
+                });
+        worker->subscribe("other", 3);
+        std::thread t(&BaseWorker::run, worker);
+        while (n_reported != 6);
         worker->stop();
         t.join();
+
+        EXPECT_THAT(received_from, ElementsAre(queue_name, "other", queue_name,
+                    "other", queue_name, "other"));
+        for (auto& outcome : reported) {
+            EXPECT_EQ(outcome.msg_id % 2 ? "other" : queue_name, outcome.queue_name);
+        }
     }
 }
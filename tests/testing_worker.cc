@@ -87,8 +87,7 @@ class Stage1: public BaseWorker {
             next_msg.payload += ";" + std::to_string(msg.id);
             prev_id = msg.id;
 
-            std::vector<Message> next_msgs(4, next_msg);
-            emit("q2", next_msgs, {});
+            publish({"q2"}, next_msg, 4, {});
 
             stats();
             return true;
@@ -99,6 +98,21 @@ class Stage1: public BaseWorker {
         Stats& stats;
 };
 
+// takes messages of q1 and never finishes them. kill -9 it, and once its
+// zookeeper session expires the broker hands them to a stage 1 worker
+class StuckStage1: public BaseWorker {
+    public:
+        StuckStage1(): BaseWorker({"localhost:2181"}, "q1") {}
+
+        bool process_message(const Message& msg) override {
+            LOG_INFO << "Stuck on message " << msg.id;
+            while (true) {
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+            }
+            return true;
+        }
+};
+
 class Stage2: public BaseWorker {
     public:
         Stage2(Stats& s): BaseWorker({"localhost:2181"}, "q2"), stats(s) {}
@@ -168,6 +182,8 @@ int main(int argc, char** argv)
         Stage0().produce_msgs(std::stoi(argv[2]));
     } else if (stage == "1") {
         Stage1(s).run();
+    } else if (stage == "1-stuck") {
+        StuckStage1().run();
     } else if (stage == "2") {
         Stage2(s).run();
     } else if (stage == "3") {
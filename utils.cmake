@@ -103,3 +103,17 @@ else()
         message(STATUS "Test target: ${target} skipped")
     endmacro()
 endif()
+
+
+# Google Benchmark
+find_package(benchmark QUIET)
+if(benchmark_FOUND)
+    macro(add_benchmark_target target srcs)
+        add_executable(${target} ${srcs})
+        target_link_libraries(${target} benchmark::benchmark benchmark::benchmark_main)
+    endmacro()
+else()
+    macro(add_benchmark_target target srcs)
+        message(STATUS "Benchmark target: ${target} skipped")
+    endmacro()
+endif()